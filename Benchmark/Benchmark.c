@@ -0,0 +1,365 @@
+//
+//  Benchmark.c
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#include <pthread.h>      // pthread_mutex_t
+#include <stdbool.h>      // bool
+#include <stdint.h>       // uint64_t
+#include <stdio.h>        // printf()
+#include <stdlib.h>       // malloc()
+#include <string.h>       // strcmp()
+#include <sys/resource.h> // getrusage()
+#include <time.h>         // clock_gettime()
+#include <unistd.h>       // dup2()
+#include "Arena.h"
+#include "FileIO.h"
+#include "bplistReader.h"
+#include "ichatReader.h"
+#include "BatchConvert.h"
+
+#define BENCHMARK_OUT_DIR "/tmp/ichat-benchmark" // where the converted logs are written unless "-output-dir" is given
+
+#pragma mark Enums
+// The stages of a conversion that are timed, in the order in which they are run on each log
+enum BenchmarkStages
+{
+    kStageLoadBplist,
+    kStageValidateIchat,
+    kStageLoadIchat,
+    kStageConvertTXT,
+    kStageConvertRTF,
+    kStageCount
+};
+
+#pragma mark Function prototypes
+bool     ProcessArguments(int argc, const char *argv[]);
+bool     BenchmarkLog(BatchJob *job, double *stageSeconds);
+double   ReturnSeconds(void);
+double   ReturnMedian(double *values, int count);
+int      CompareSeconds(const void *a, const void *b);
+uint64_t ReturnPeakRSS(void);
+void     PrintResults(Batch *corpus, double *seconds, uint64_t numMessages, uint64_t numBytes);
+void     PrintJSONString(const char *str);
+
+#pragma mark Globals
+const char *kStageNames[kStageCount] = {"Load_bplist", "Validate_ichat", "Load_ichat", "Convert_ichat TXT", "Convert_ichat RTF"};
+
+char *gCorpusPath = NULL; // directory of .ichat files to benchmark on
+char *gOutDirPath = NULL; // directory in which to write the converted logs, or NULL for BENCHMARK_OUT_DIR
+int   gIterations = 5;    // number of timed runs over the corpus
+int   gNumThreads = 1;    // number of threads to format each log's messages on
+bool  gPrintJSON = false; // whether to print the results as JSON instead of a table
+
+#pragma mark Functions
+// Time each stage of converting every log in the corpus, over several runs, and print how long each stage took and how fast it went.
+// The first run is not timed; it warms the page cache and finds the logs that can't be converted, which are left out of the timed runs.
+int main(int argc, const char *argv[])
+{
+    if (!ProcessArguments(argc, argv))
+        return 1;
+    
+    // Anything that the conversion prints goes to stderr, so that only the results are on stdout
+    fflush(stdout);
+    int resultsFileDesc = dup(STDOUT_FILENO);
+    if (resultsFileDesc == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1)
+    {
+        printf("Fatal error: Could not set aside stdout for the results.\n");
+        return 1;
+    }
+    
+    Batch corpus;
+    InitBatch(&corpus);
+    corpus.baInDir = gCorpusPath;
+    corpus.baOutDir = (gOutDirPath != NULL ? gOutDirPath : BENCHMARK_OUT_DIR);
+    if (!FindLogsInDirectory(&corpus, gCorpusPath))
+        return 1;
+    if (corpus.baNumJobs == 0)
+    {
+        printf("Fatal error: There are no .ichat files in \"%s\".\n", gCorpusPath);
+        return 1;
+    }
+    
+    double warmUpSeconds[kStageCount] = {0};
+    uint64_t numMessages = 0, numBytes = 0, numFailed = 0;
+    for (uint64_t a = 0; a < corpus.baNumJobs; a++)
+    {
+        BatchJob *job = &corpus.baJobs[a];
+        job->bjConverted = BenchmarkLog(job, warmUpSeconds);
+        if (!job->bjConverted)
+        {
+            printf("Leaving \"%s\" out of the benchmark, as it could not be converted.\n", job->bjInPath);
+            numFailed++;
+            continue;
+        }
+        numMessages += job->bjMessages;
+        numBytes += job->bjSize;
+    }
+    if (numFailed == corpus.baNumJobs)
+    {
+        printf("Fatal error: None of the .ichat files in \"%s\" could be converted.\n", gCorpusPath);
+        return 1;
+    }
+    
+    // The time that each stage took over the whole corpus in each run
+    double *seconds = calloc((size_t)gIterations * kStageCount, sizeof(double)); // freed below
+    if (seconds == NULL)
+    {
+        printf("Fatal error: Memory allocation failed.\n");
+        return 1;
+    }
+    for (int run = 0; run < gIterations; run++)
+    {
+        for (uint64_t a = 0; a < corpus.baNumJobs; a++)
+        {
+            if (corpus.baJobs[a].bjConverted && !BenchmarkLog(&corpus.baJobs[a], seconds + run * kStageCount))
+            {
+                printf("Fatal error: \"%s\" could not be converted in run %d.\n", corpus.baJobs[a].bjInPath, run + 1);
+                return 1;
+            }
+        }
+    }
+    
+    fflush(stdout);
+    dup2(resultsFileDesc, STDOUT_FILENO);
+    close(resultsFileDesc);
+    PrintResults(&corpus, seconds, numMessages, numBytes);
+    
+    free(seconds);
+    FreeBatch(&corpus);
+    return 0;
+}
+
+// Run each stage of a conversion on the log of "job", both to TXT and to RTF, adding the time that each took to "stageSeconds" and
+// setting the job's number of messages. Returns whether every stage succeeded.
+bool BenchmarkLog(BatchJob *job, double *stageSeconds)
+{
+    BPContext bc;
+    ICContext ic;
+    InitBPContext(&bc);
+    InitICContext(&ic, &bc);
+    ic.icOutFileBase = job->bjOutFileBase;
+    ic.icOverwriteFile = true;
+    ic.icNumThreads = gNumThreads;
+    
+    // Loading the file is left out of the times, since it only maps the file
+    if (!LoadInFile(job->bjInPath, &bc.bcFileContents, &bc.bcFileLength))
+        return false;
+    bool succeeded = MakeParentDirectories(job->bjOutFileBase);
+    
+    double start = ReturnSeconds();
+    succeeded = succeeded && Validate_bplist(&bc) && Load_bplist(&bc);
+    double end = ReturnSeconds();
+    stageSeconds[kStageLoadBplist] += end - start;
+    
+    start = end;
+    succeeded = succeeded && Validate_ichat(&ic);
+    end = ReturnSeconds();
+    stageSeconds[kStageValidateIchat] += end - start;
+    
+    start = end;
+    succeeded = succeeded && Load_ichat(&ic);
+    end = ReturnSeconds();
+    stageSeconds[kStageLoadIchat] += end - start;
+    
+    start = end;
+    succeeded = succeeded && Convert_ichat(&ic, false);
+    end = ReturnSeconds();
+    stageSeconds[kStageConvertTXT] += end - start;
+    
+    start = end;
+    succeeded = succeeded && Convert_ichat(&ic, true);
+    end = ReturnSeconds();
+    stageSeconds[kStageConvertRTF] += end - start;
+    
+    job->bjMessages = ic.icMessageListArray.oSize;
+    FreeICContext(&ic);
+    FreeBPContext(&bc);
+    CloseInFile(&bc.bcFileContents, &bc.bcFileLength);
+    return succeeded;
+}
+
+// Returns the time on the monotonic clock in seconds
+double ReturnSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Returns the median of the "count" values in "values", which are sorted in the process
+double ReturnMedian(double *values, int count)
+{
+    qsort(values, (size_t)count, sizeof(double), CompareSeconds);
+    if (count % 2 == 1)
+        return values[count / 2];
+    
+    return (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+// Comparison function for sorting times with qsort()
+int CompareSeconds(const void *a, const void *b)
+{
+    double first = *(const double *)a, second = *(const double *)b;
+    return (first > second) - (first < second);
+}
+
+// Returns the most memory that the process has had resident at once, in bytes
+uint64_t ReturnPeakRSS(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1)
+        return 0;
+    
+#if defined(__APPLE__)
+    return (uint64_t)usage.ru_maxrss; // macOS gives bytes
+#else
+    return (uint64_t)usage.ru_maxrss * 1024; // Linux gives kilobytes
+#endif
+}
+
+// Print the median and fastest time of each stage over the runs in "seconds", with the rates that the median time works out to, either
+// as a table or as JSON
+void PrintResults(Batch *corpus, double *seconds, uint64_t numMessages, uint64_t numBytes)
+{
+    uint64_t numLogs = 0;
+    for (uint64_t a = 0; a < corpus->baNumJobs; a++)
+        numLogs += (corpus->baJobs[a].bjConverted ? 1 : 0);
+    uint64_t peakRSS = ReturnPeakRSS();
+    
+    if (gPrintJSON)
+    {
+        printf("{\n  \"corpus\": ");
+        PrintJSONString(gCorpusPath);
+        printf(",\n  \"logs\": %llu,\n  \"messages\": %llu,\n  \"bytes\": %llu,\n  \"iterations\": %d,\n  \"threads\": %d,\n"
+               "  \"peak_rss_bytes\": %llu,\n  \"stages\": [\n", numLogs, numMessages, numBytes, gIterations, gNumThreads, peakRSS);
+    }
+    else
+    {
+        printf("Benchmarked %llu log(s) with %llu message(s) in %.2f MB, %d time(s) on %d thread(s).\n", numLogs,
+               numMessages, numBytes / 1e6, gIterations, gNumThreads);
+        printf("%-18s %12s %12s %16s %12s\n", "Stage", "Median (s)", "Fastest (s)", "Messages/s", "MB/s");
+    }
+    
+    double *stageRuns = malloc((size_t)gIterations * sizeof(double)); // freed below
+    if (stageRuns == NULL)
+        return;
+    for (int stage = 0; stage < kStageCount; stage++)
+    {
+        for (int run = 0; run < gIterations; run++)
+            stageRuns[run] = seconds[run * kStageCount + stage];
+        double median = ReturnMedian(stageRuns, gIterations);
+        double fastest = stageRuns[0];
+        double messagesPerSecond = (median > 0 ? numMessages / median : 0);
+        double megabytesPerSecond = (median > 0 ? numBytes / 1e6 / median : 0);
+        
+        if (gPrintJSON)
+            printf("    {\"stage\": \"%s\", \"median_seconds\": %.6f, \"fastest_seconds\": %.6f, \"messages_per_second\": %.1f, "
+                   "\"mb_per_second\": %.3f}%s\n", kStageNames[stage], median, fastest, messagesPerSecond, megabytesPerSecond,
+                   (stage + 1 < kStageCount ? "," : ""));
+        else
+            printf("%-18s %12.6f %12.6f %16.1f %12.3f\n", kStageNames[stage], median, fastest, messagesPerSecond, megabytesPerSecond);
+    }
+    free(stageRuns);
+    
+    if (gPrintJSON)
+        printf("  ]\n}\n");
+    else
+        printf("Peak resident memory: %.2f MB\n", peakRSS / 1e6);
+}
+
+// Print "str" as a JSON string, in quotes and with any characters that JSON doesn't allow as they are escaped
+void PrintJSONString(const char *str)
+{
+    putchar('"');
+    for (const char *c = str; *c != '\0'; c++)
+    {
+        if (*c == '"' || *c == '\\')
+            printf("\\%c", *c);
+        else if ((unsigned char)*c < 0x20)
+            printf("\\u%04x", *c);
+        else
+            putchar(*c);
+    }
+    putchar('"');
+}
+
+// Interpret arguments passed to program
+bool ProcessArguments(int argc, const char *argv[])
+{
+    bool error = false;
+    
+    // Print usage if the user doesn't seem to know what they're doing
+    if (argc < 3)
+    {
+        printf("Times each stage of converting a corpus of .ichat files. Syntax:\n");
+        printf(" Arguments:\n");
+        printf("   -corpus \"<full path to directory>\": Required. Every .ichat file in the directory and its subdirectories is converted to TXT and to RTF.\n");
+        printf("   -output-dir \"<full path to directory>\": Optional. Where to write the converted files; by default, \"%s\".\n", BENCHMARK_OUT_DIR);
+        printf("   -iterations <number>: Optional. How many timed runs to make over the corpus, after one untimed run; by default, 5.\n");
+        printf("   -threads <number>: Optional. How many threads to convert each big log on; by default, 1.\n");
+        printf(" Options:\n");
+        printf("   --json: Print the results as JSON instead of a table.\n");
+        return false;
+    }
+    
+    // Look at arguments after our own binary path
+    for (int a = 1; a < argc; a++)
+    {
+        if (!strcmp(argv[a], "-corpus"))
+        {
+            if (a + 1 < argc)
+                asprintf(&gCorpusPath, "%s", argv[++a]); // freed on program quit
+            else
+                break;
+        }
+        else if (!strcmp(argv[a], "-output-dir"))
+        {
+            if (a + 1 < argc)
+                asprintf(&gOutDirPath, "%s", argv[++a]); // freed on program quit
+            else
+                break;
+        }
+        else if (!strcmp(argv[a], "-iterations"))
+        {
+            if (a + 1 < argc)
+            {
+                gIterations = atoi(argv[++a]);
+                if (gIterations < 1)
+                {
+                    printf("Fatal error: You need to supply a number of at least 1 after the -iterations argument.\n");
+                    error = true;
+                }
+            }
+            else
+                break;
+        }
+        else if (!strcmp(argv[a], "-threads"))
+        {
+            if (a + 1 < argc)
+            {
+                gNumThreads = atoi(argv[++a]);
+                if (gNumThreads < 1)
+                {
+                    printf("Fatal error: You need to supply a number of at least 1 after the -threads argument.\n");
+                    error = true;
+                }
+            }
+            else
+                break;
+        }
+        else if (!strcmp(argv[a], "--json"))
+            gPrintJSON = true;
+    }
+    
+    if (!error && gCorpusPath == NULL)
+    {
+        printf("Fatal error: You need to supply the full path to a directory of .ichat files after the -corpus argument.\n");
+        error = true;
+    }
+    
+    return !error;
+}
@@ -0,0 +1,134 @@
+//
+//  Arena.c
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#include <stdarg.h>  // va_list
+#include <stdbool.h> // bool
+#include <stdint.h>  // uint64_t
+#include <stdio.h>   // vsnprintf()
+#include <stdlib.h>  // malloc()
+#include <string.h>  // memcpy()
+#include "Arena.h"
+
+#define ARENA_ALIGNMENT 8
+
+#pragma mark Arena management
+// Sets up "arena" with a first block of "initialSize" bytes
+void InitArena(Arena *arena, size_t initialSize)
+{
+    arena->aHead = NULL;
+    arena->aTotalSize = 0;
+    arena->aHeapAllocs = 0;
+    
+    if (initialSize > 0)
+    {
+        AllocFromArena(arena, initialSize);
+        ResetArena(arena);
+    }
+}
+
+// Returns "size" bytes from "arena", only going to the heap if the current block is full
+void *AllocFromArena(Arena *arena, size_t size)
+{
+    ArenaBlock *block = arena->aHead;
+    size = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    
+    if (block == NULL || block->abSize - block->abUsed < size)
+    {
+        // Double the arena's size each time it runs out so that a big message only costs a few trips to the heap
+        size_t blockSize = (arena->aTotalSize > size ? arena->aTotalSize : size);
+        block = malloc(sizeof(ArenaBlock) + blockSize); // freed with ResetArena() or FreeArena()
+        if (block == NULL)
+        {
+            printf("Fatal error: Memory allocation failed.\n");
+            exit(1);
+        }
+        block->abNext = arena->aHead;
+        block->abSize = blockSize;
+        block->abUsed = 0;
+        arena->aHead = block;
+        arena->aTotalSize += blockSize;
+        arena->aHeapAllocs++;
+    }
+    
+    void *result = block->abData + block->abUsed;
+    block->abUsed += size;
+    return result;
+}
+
+// Returns a null-terminated copy of the "length" bytes at "str", allocated from "arena"
+char *CopyToArena(Arena *arena, const char *str, size_t length)
+{
+    char *copy = AllocFromArena(arena, length + 1);
+    memcpy(copy, str, length);
+    copy[length] = '\0';
+    return copy;
+}
+
+// Works like asprintf(), but the string is allocated from "arena"
+char *PrintToArena(Arena *arena, const char *format, ...)
+{
+    va_list args;
+    
+    // Try to print straight into the space left in the current block, which is almost always enough
+    char *dest = NULL;
+    size_t space = 0;
+    if (arena->aHead != NULL)
+    {
+        dest = arena->aHead->abData + arena->aHead->abUsed;
+        space = arena->aHead->abSize - arena->aHead->abUsed;
+    }
+    va_start(args, format);
+    int length = vsnprintf(dest, space, format, args);
+    va_end(args);
+    if (length < 0)
+        return NULL;
+    
+    // Block sizes are always a multiple of the alignment, so if the string fit, so will the aligned allocation that claims it
+    if ((size_t)length < space)
+        return AllocFromArena(arena, (size_t)length + 1);
+    
+    dest = AllocFromArena(arena, (size_t)length + 1);
+    va_start(args, format);
+    vsnprintf(dest, (size_t)length + 1, format, args);
+    va_end(args);
+    return dest;
+}
+
+// Makes all of the arena's memory available again. If the arena had to add blocks since the last reset, they are merged into a
+// single block big enough for all of them, so that repeating the same work does not go to the heap again.
+void ResetArena(Arena *arena)
+{
+    ArenaBlock *block = arena->aHead;
+    if (block == NULL)
+        return;
+    
+    if (block->abNext != NULL)
+    {
+        size_t totalSize = arena->aTotalSize;
+        FreeArena(arena);
+        AllocFromArena(arena, totalSize);
+        block = arena->aHead;
+    }
+    
+    block->abUsed = 0;
+}
+
+// Returns all of the arena's memory to the heap
+void FreeArena(Arena *arena)
+{
+    ArenaBlock *block = arena->aHead;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->abNext;
+        free(block);
+        block = next;
+    }
+    
+    arena->aHead = NULL;
+    arena->aTotalSize = 0;
+}
@@ -0,0 +1,36 @@
+//
+//  Arena.h
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#ifndef Arena_h
+#define Arena_h
+
+// A block of memory that an arena hands out allocations from
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *abNext; // block that was in use before this one was added
+    size_t             abSize; // number of bytes available in "abData"
+    size_t             abUsed; // number of bytes of "abData" that have been handed out
+    char               abData[];
+} ArenaBlock;
+
+// A bump allocator for memory that only needs to live until the next ResetArena(), such as the strings belonging to one message
+typedef struct Arena
+{
+    ArenaBlock *aHead;       // block currently being allocated from
+    size_t      aTotalSize;  // sum of "abSize" for all blocks in the arena
+    uint64_t    aHeapAllocs; // number of times the arena has had to go to the heap for a block
+} Arena;
+
+void  InitArena(Arena *arena, size_t initialSize);
+void *AllocFromArena(Arena *arena, size_t size);
+char *CopyToArena(Arena *arena, const char *str, size_t length);
+char *PrintToArena(Arena *arena, const char *format, ...);
+void  ResetArena(Arena *arena);
+void  FreeArena(Arena *arena);
+
+#endif /* Arena_h */
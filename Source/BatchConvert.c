@@ -0,0 +1,461 @@
+//
+//  BatchConvert.c
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#include <dirent.h>    // opendir()
+#include <errno.h>     // errno
+#include <pthread.h>   // pthread_create()
+#include <stdatomic.h> // _Atomic
+#include <stdbool.h>   // bool
+#include <stdint.h>    // uint64_t
+#include <stdio.h>     // printf()
+#include <stdlib.h>    // malloc()
+#include <string.h>    // strlen()
+#include <sys/stat.h>  // lstat()
+#include <time.h>      // clock_gettime()
+#include <unistd.h>    // sysconf()
+#include "Arena.h"
+#include "FileIO.h"
+#include "bplistReader.h"
+#include "ichatReader.h"
+#include "BatchConvert.h"
+#include "Pipeline.h"
+
+#pragma mark Batch management
+// Set up "batch" with no jobs, using a worker thread for each core unless "baNumThreads" is changed
+void InitBatch(Batch *batch)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    
+    batch->baInDir = NULL;
+    batch->baOutDir = NULL;
+    batch->baNumThreads = (cores > 0 ? (int)cores : 1);
+    batch->baNumWorkers = 0;
+    batch->baUseRTF = false;
+    batch->baUseRealNames = false;
+    batch->baTrimEmailIDs = false;
+    batch->baOverwriteFile = false;
+    batch->baPrintStats = false;
+    batch->baPipeline = false;
+    batch->baMaxInflightBytes = 256 * 1024 * 1024;
+    batch->baTimeZone = NULL;
+    batch->baJobs = NULL;
+    batch->baNumJobs = 0;
+    batch->baJobsCapacity = 0;
+    batch->baDeques = NULL;
+}
+
+// Free the jobs and deques of "batch"
+void FreeBatch(Batch *batch)
+{
+    for (uint64_t a = 0; a < batch->baNumJobs; a++)
+    {
+        free(batch->baJobs[a].bjInPath);
+        free(batch->baJobs[a].bjOutFileBase);
+    }
+    free(batch->baJobs);
+    batch->baJobs = NULL;
+    batch->baNumJobs = 0;
+    batch->baJobsCapacity = 0;
+    
+    if (batch->baDeques != NULL)
+    {
+        for (int a = 0; a < batch->baNumWorkers; a++)
+        {
+            pthread_mutex_destroy(&batch->baDeques[a].wdLock);
+            free(batch->baDeques[a].wdJobs);
+        }
+        free(batch->baDeques);
+        batch->baDeques = NULL;
+    }
+}
+
+// Convert every log under "baInDir" on "baNumThreads" threads. A log that can't be converted is reported and skipped without
+// affecting the others. Returns whether every log was converted.
+bool Convert_batch(Batch *batch)
+{
+    if (!FindLogsInDirectory(batch, batch->baInDir))
+        return false;
+    if (batch->baNumJobs == 0)
+    {
+        printf("No .ichat files were found in \"%s\".\n", batch->baInDir);
+        return true;
+    }
+    
+    if (batch->baNumThreads < 1)
+        batch->baNumThreads = 1;
+    
+    // Start the biggest logs first, so that a huge log is not left until last to run on its own while the other threads sit idle
+    qsort(batch->baJobs, (size_t)batch->baNumJobs, sizeof(BatchJob), CompareBatchJobSizes);
+    
+    // A log that is more than a thread's fair share of the whole run would still be going after everything else had finished, so its
+    // messages are split across all of the threads
+    uint64_t totalSize = 0;
+    for (uint64_t a = 0; a < batch->baNumJobs; a++)
+        totalSize += batch->baJobs[a].bjSize;
+    for (uint64_t a = 0; a < batch->baNumJobs; a++)
+    {
+        if (batch->baNumThreads > 1 && batch->baJobs[a].bjSize > totalSize / (uint64_t)batch->baNumThreads)
+            batch->baJobs[a].bjNumThreads = batch->baNumThreads;
+    }
+    
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    // If the pipeline's threads can't be started, fall back on the worker threads, which can always run on the calling thread alone
+    if (!batch->baPipeline || !Convert_pipeline(batch))
+    {
+        if (!DealBatchJobs(batch) || !RunBatchWorkers(batch))
+            return false;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    PrintBatchSummary(batch, seconds);
+    
+    for (uint64_t a = 0; a < batch->baNumJobs; a++)
+    {
+        if (!batch->baJobs[a].bjConverted)
+            return false;
+    }
+    return true;
+}
+
+// Add every .ichat file in the tree under "dirPath" to the jobs of "batch". Symlinks to files are followed, but symlinks to directories
+// are not, as with "find".
+bool FindLogsInDirectory(Batch *batch, const char *dirPath)
+{
+    DIR *dir = opendir(dirPath);
+    if (dir == NULL)
+    {
+        printf("Error %d: \"%s\". Could not read directory \"%s\".\n", errno, strerror(errno), dirPath);
+        return false;
+    }
+    
+    bool success = true;
+    size_t dirPathLength = strlen(dirPath);
+    bool needsSlash = (dirPathLength > 0 && dirPath[dirPathLength - 1] != '/');
+    struct dirent *entry;
+    while (success && (entry = readdir(dir)) != NULL)
+    {
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+            continue;
+        
+        char *path = NULL;
+        if (asprintf(&path, "%s%s%s", dirPath, needsSlash ? "/" : "", entry->d_name) == -1) // freed below
+        {
+            printf("Fatal error: Memory allocation failed.\n");
+            success = false;
+            break;
+        }
+        
+        struct stat info;
+        if (lstat(path, &info) == 0)
+        {
+            if (S_ISDIR(info.st_mode))
+                success = FindLogsInDirectory(batch, path);
+            else if (HasSuffix(entry->d_name, ".ichat"))
+            {
+                if (S_ISLNK(info.st_mode) && stat(path, &info) != 0)
+                    info.st_mode = 0;
+                if (S_ISREG(info.st_mode))
+                    success = AddBatchJob(batch, path, (uint64_t)info.st_size);
+            }
+        }
+        free(path);
+    }
+    
+    closedir(dir);
+    return success;
+}
+
+// Add the log at "path", which is "size" bytes long, to the jobs of "batch", working out where its out file goes
+bool AddBatchJob(Batch *batch, const char *path, uint64_t size)
+{
+    if (batch->baNumJobs == batch->baJobsCapacity)
+    {
+        uint64_t capacity = (batch->baJobsCapacity == 0 ? 256 : batch->baJobsCapacity * 2);
+        BatchJob *jobs = realloc(batch->baJobs, capacity * sizeof(BatchJob)); // freed with FreeBatch()
+        if (jobs == NULL)
+        {
+            printf("Fatal error: Memory allocation failed.\n");
+            return false;
+        }
+        batch->baJobs = jobs;
+        batch->baJobsCapacity = capacity;
+    }
+    
+    BatchJob *job = &batch->baJobs[batch->baNumJobs];
+    job->bjInPath = NULL;
+    job->bjOutFileBase = NULL;
+    job->bjSize = size;
+    job->bjNumThreads = 1;
+    job->bjMessages = 0;
+    job->bjConverted = false;
+    
+    // With an output directory, the out file goes to the same place relative to it as the log is relative to the input directory
+    int result;
+    if (batch->baOutDir != NULL)
+    {
+        const char *relativePath = path + strlen(batch->baInDir);
+        while (*relativePath == '/')
+            relativePath++;
+        result = asprintf(&job->bjOutFileBase, "%s/%s", batch->baOutDir, relativePath); // freed with FreeBatch()
+    }
+    else
+        result = asprintf(&job->bjOutFileBase, "%s", path); // freed with FreeBatch()
+    if (result == -1 || asprintf(&job->bjInPath, "%s", path) == -1) // freed with FreeBatch()
+    {
+        printf("Fatal error: Memory allocation failed.\n");
+        free(job->bjOutFileBase);
+        return false;
+    }
+    
+    batch->baNumJobs++;
+    return true;
+}
+
+// Deal the jobs of "batch" out to a deque for each worker thread in turn. Since the jobs are sorted largest first, the front of each
+// deque holds the biggest logs left in it.
+bool DealBatchJobs(Batch *batch)
+{
+    // There is no use in a worker thread that will never have a job of its own
+    batch->baNumWorkers = batch->baNumThreads;
+    if ((uint64_t)batch->baNumWorkers > batch->baNumJobs)
+        batch->baNumWorkers = (int)batch->baNumJobs;
+    int numThreads = batch->baNumWorkers;
+    uint64_t perDeque = (batch->baNumJobs + (uint64_t)numThreads - 1) / (uint64_t)numThreads;
+    
+    batch->baDeques = calloc((size_t)numThreads, sizeof(WorkDeque)); // freed with FreeBatch()
+    if (batch->baDeques == NULL)
+    {
+        printf("Fatal error: Memory allocation failed.\n");
+        return false;
+    }
+    for (int a = 0; a < numThreads; a++)
+    {
+        WorkDeque *deque = &batch->baDeques[a];
+        pthread_mutex_init(&deque->wdLock, NULL);
+        deque->wdJobs = malloc(perDeque * sizeof(uint64_t)); // freed with FreeBatch()
+        if (deque->wdJobs == NULL)
+        {
+            printf("Fatal error: Memory allocation failed.\n");
+            return false;
+        }
+        deque->wdHead = 0;
+        deque->wdTail = 0;
+    }
+    
+    for (uint64_t a = 0; a < batch->baNumJobs; a++)
+    {
+        WorkDeque *deque = &batch->baDeques[a % (uint64_t)numThreads];
+        deque->wdJobs[deque->wdTail++] = a;
+    }
+    
+    return true;
+}
+#pragma mark Worker threads
+// Convert the jobs dealt out by DealBatchJobs() on "baNumWorkers" worker threads, returning once every job has been run
+bool RunBatchWorkers(Batch *batch)
+{
+    // The calling thread works as worker 0, so the run finishes even if no other thread can be started; the jobs dealt to a worker
+    // that failed to start are stolen by the others
+    BatchWorker *workers = malloc((size_t)batch->baNumWorkers * sizeof(BatchWorker)); // freed below
+    pthread_t *threads = malloc((size_t)batch->baNumWorkers * sizeof(pthread_t));     // freed below
+    bool *started = calloc((size_t)batch->baNumWorkers, sizeof(bool));               // freed below
+    if (workers == NULL || threads == NULL || started == NULL)
+    {
+        printf("Fatal error: Memory allocation failed.\n");
+        free(workers);
+        free(threads);
+        free(started);
+        return false;
+    }
+    for (int a = 0; a < batch->baNumWorkers; a++)
+    {
+        workers[a].bwBatch = batch;
+        workers[a].bwIndex = a;
+        if (a > 0)
+        {
+            started[a] = (pthread_create(&threads[a], NULL, RunBatchWorker, &workers[a]) == 0);
+            if (!started[a])
+                printf("Warning: Could not start worker thread %d; the other threads will take on its logs.\n", a);
+        }
+    }
+    RunBatchWorker(&workers[0]);
+    for (int a = 1; a < batch->baNumWorkers; a++)
+    {
+        if (started[a])
+            pthread_join(threads[a], NULL);
+    }
+    free(workers);
+    free(threads);
+    free(started);
+    
+    return true;
+}
+
+// Body of a worker thread: convert logs until there are none left in any deque
+void *RunBatchWorker(void *arg)
+{
+    BatchWorker *worker = arg;
+    Batch *batch = worker->bwBatch;
+    
+    uint64_t jobNum;
+    while (TakeBatchJob(batch, worker->bwIndex, &jobNum))
+    {
+        BatchJob *job = &batch->baJobs[jobNum];
+        job->bjConverted = ConvertBatchJob(batch, job);
+    }
+    
+    return NULL;
+}
+
+// Take the next job for worker "worker" and put its index in "jobNum", first from the worker's own deque and then from another
+// worker's. No jobs are added once the workers have started, so when every deque is empty, the run is over and
+// false is returned.
+bool TakeBatchJob(Batch *batch, int worker, uint64_t *jobNum)
+{
+    WorkDeque *own = &batch->baDeques[worker];
+    bool found = false;
+    
+    pthread_mutex_lock(&own->wdLock);
+    if (own->wdHead < own->wdTail)
+    {
+        *jobNum = own->wdJobs[own->wdHead++];
+        found = true;
+    }
+    pthread_mutex_unlock(&own->wdLock);
+    
+    // Start with the next worker along so that thieves spread out over the deques instead of all raiding the same one. A thief takes
+    // from the front too, so that the biggest logs left are always the next to be started wherever they are.
+    for (int a = 1; !found && a < batch->baNumWorkers; a++)
+    {
+        WorkDeque *victim = &batch->baDeques[(worker + a) % batch->baNumWorkers];
+        pthread_mutex_lock(&victim->wdLock);
+        if (victim->wdHead < victim->wdTail)
+        {
+            *jobNum = victim->wdJobs[victim->wdHead++];
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->wdLock);
+    }
+    
+    return found;
+}
+
+// Convert the log of "job" with the options of "batch". Everything needed for the conversion is kept in contexts of its own, so any
+// number of these can run at once. Returns whether the whole log was converted.
+bool ConvertBatchJob(Batch *batch, BatchJob *job)
+{
+    BPContext bc;
+    ICContext ic;
+    InitBatchJobContexts(batch, job, &bc, &ic);
+    
+    printf("Converting \"%s\"...\n", job->bjInPath);
+    bool converted = false;
+    if (LoadInFile(job->bjInPath, &bc.bcFileContents, &bc.bcFileLength) && Validate_bplist(&bc) && Load_bplist(&bc))
+    {
+        if (!Validate_ichat(&ic))
+            printf("\"%s\" is not an iChat log, so it cannot be converted.\n", job->bjInPath);
+        else if (Load_ichat(&ic) && (batch->baOutDir == NULL || MakeParentDirectories(job->bjOutFileBase)))
+        {
+            converted = Convert_ichat(&ic, batch->baUseRTF);
+            job->bjMessages = ic.icMessageListArray.oSize;
+        }
+    }
+    if (!converted)
+        printf("Failed to convert \"%s\".\n", job->bjInPath);
+    
+    FreeICContext(&ic);
+    FreeBPContext(&bc);
+    CloseInFile(&bc.bcFileContents, &bc.bcFileLength);
+    return converted;
+}
+
+// Set up "bc" and "ic" for converting the log of "job" with the options of "batch"
+void InitBatchJobContexts(Batch *batch, BatchJob *job, BPContext *bc, ICContext *ic)
+{
+    InitBPContext(bc);
+    InitICContext(ic, bc);
+    ic->icOutFileBase = job->bjOutFileBase;
+    ic->icUseRealNames = batch->baUseRealNames;
+    ic->icTrimEmailIDs = batch->baTrimEmailIDs;
+    ic->icOverwriteFile = batch->baOverwriteFile;
+    ic->icPrintStats = batch->baPrintStats;
+    ic->icNumThreads = job->bjNumThreads;
+    ic->icTimeZone = batch->baTimeZone;
+}
+#pragma mark Utility functions
+// Create each of the directories leading up to the file at "path" that does not exist yet
+bool MakeParentDirectories(const char *path)
+{
+    char *dirPath = NULL;
+    if (asprintf(&dirPath, "%s", path) == -1) // freed below
+    {
+        printf("Fatal error: Memory allocation failed.\n");
+        return false;
+    }
+    
+    // Cut the path off at each slash in turn; another thread may be creating the same directory, so one that already exists is fine
+    bool success = true;
+    for (char *slash = strchr(dirPath + 1, '/'); success && slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdir(dirPath, 0777) == -1 && errno != EEXIST)
+        {
+            printf("Error %d: \"%s\". Could not create directory \"%s\".\n", errno, strerror(errno), dirPath);
+            success = false;
+        }
+        *slash = '/';
+    }
+    
+    free(dirPath);
+    return success;
+}
+
+// Print how many logs were converted and how quickly the run went through them
+void PrintBatchSummary(Batch *batch, double seconds)
+{
+    uint64_t numConverted = 0, numMessages = 0, numBytes = 0;
+    for (uint64_t a = 0; a < batch->baNumJobs; a++)
+    {
+        BatchJob *job = &batch->baJobs[a];
+        if (job->bjConverted)
+        {
+            numConverted++;
+            numMessages += job->bjMessages;
+            numBytes += job->bjSize;
+        }
+    }
+    if (seconds <= 0)
+        seconds = 1e-9;
+    
+    printf("Converted %llu of %llu logs on %d thread(s) in %.2f seconds.\n", numConverted, batch->baNumJobs, batch->baNumThreads,
+           seconds);
+    if (numConverted < batch->baNumJobs)
+        printf("%llu log(s) could not be converted; see above for the reasons.\n", batch->baNumJobs - numConverted);
+    printf("Throughput: %.1f logs/s, %.0f messages/s, %.2f MB/s of input.\n", (double)numConverted / seconds,
+           (double)numMessages / seconds, (double)numBytes / (1024 * 1024) / seconds);
+}
+
+// Comparison function for qsort() that puts bigger jobs first, and jobs of the same size in order of path so that runs are repeatable
+int CompareBatchJobSizes(const void *a, const void *b)
+{
+    const BatchJob *jobA = a, *jobB = b;
+    
+    if (jobA->bjSize != jobB->bjSize)
+        return (jobA->bjSize > jobB->bjSize ? -1 : 1);
+    return strcmp(jobA->bjInPath, jobB->bjInPath);
+}
+
+// Returns whether "str" ends with "suffix"
+bool HasSuffix(const char *str, const char *suffix)
+{
+    size_t strLength = strlen(str), suffixLength = strlen(suffix);
+    return (strLength >= suffixLength && !strcmp(str + strLength - suffixLength, suffix));
+}
@@ -0,0 +1,80 @@
+//
+//  BatchConvert.h
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#ifndef BatchConvert_h
+#define BatchConvert_h
+
+// One log found in the input directory
+typedef struct BatchJob
+{
+    char    *bjInPath;      // path of the log
+    char    *bjOutFileBase; // path that the out file is named after; the log's own path unless there is an output directory
+    uint64_t bjSize;        // size of the log in bytes
+    int      bjNumThreads;  // number of threads to format the log's messages on; more than one only for a log that dwarfs the rest
+    uint64_t bjMessages;    // number of messages converted, set once the job has been run
+    bool     bjConverted;   // whether the whole log was converted, set once the job has been run
+} BatchJob;
+
+// The jobs dealt to one worker thread, biggest first. The worker takes its own jobs from the front; a worker that has run out of jobs of
+// its own steals from the front of another worker's deque, so that the biggest logs are started before the small ones.
+typedef struct WorkDeque
+{
+    pthread_mutex_t wdLock; // held while "wdHead" or "wdTail" is being changed
+    uint64_t       *wdJobs; // indices into the batch's job list
+    uint64_t        wdHead; // index in "wdJobs" of the next job for the owner
+    uint64_t        wdTail; // index in "wdJobs" just past the last job left
+} WorkDeque;
+
+// A run over every log in a directory tree
+typedef struct Batch
+{
+    // Options
+    const char *baInDir;         // directory to search for logs
+    const char *baOutDir;        // directory in which to mirror the input tree, or NULL to write each out file beside its log
+    int         baNumThreads;    // number of worker threads
+    bool        baUseRTF;        // whether to convert into RTF instead of TXT
+    bool        baUseRealNames;  // whether to look up names given to chat accounts in iChat or use account IDs
+    bool        baTrimEmailIDs;  // whether to remove '@domain.com' from end of account ID names
+    bool        baOverwriteFile; // whether to overwrite a file by the same name as an out file
+    bool        baPrintStats;    // whether to print statistics about each conversion
+    bool        baPipeline;      // whether to convert with a thread for each stage of the work instead of a thread for each log
+    uint64_t    baMaxInflightBytes; // when "baPipeline" is set, how many bytes of logs and output can be held in memory at once
+    const struct TimeZone *baTimeZone; // zone that message times are written in, or NULL for LOCAL_TIME_ZONE
+    
+    // State of the run
+    int         baNumWorkers;    // number of worker threads that DealBatchJobs() gave jobs to, which is no more than the number of jobs
+    BatchJob   *baJobs;          // every log found by FindLogsInDirectory()
+    uint64_t    baNumJobs;       // number of jobs in "baJobs"
+    uint64_t    baJobsCapacity;  // number of jobs that "baJobs" has room for
+    WorkDeque  *baDeques;        // one deque of jobs for each of the "baNumWorkers" worker threads
+} Batch;
+
+// What a worker thread is given to work with
+typedef struct BatchWorker
+{
+    Batch *bwBatch;  // the run that the worker is part of
+    int    bwIndex;  // which deque in the batch belongs to this worker
+} BatchWorker;
+
+void  InitBatch(Batch *batch);
+void  FreeBatch(Batch *batch);
+bool  Convert_batch(Batch *batch);
+bool  FindLogsInDirectory(Batch *batch, const char *dirPath);
+bool  AddBatchJob(Batch *batch, const char *path, uint64_t size);
+bool  DealBatchJobs(Batch *batch);
+bool  RunBatchWorkers(Batch *batch);
+void *RunBatchWorker(void *arg);
+bool  TakeBatchJob(Batch *batch, int worker, uint64_t *jobNum);
+bool  ConvertBatchJob(Batch *batch, BatchJob *job);
+void  InitBatchJobContexts(Batch *batch, BatchJob *job, BPContext *bc, ICContext *ic);
+bool  MakeParentDirectories(const char *path);
+void  PrintBatchSummary(Batch *batch, double seconds);
+int   CompareBatchJobSizes(const void *a, const void *b);
+bool  HasSuffix(const char *str, const char *suffix);
+
+#endif /* BatchConvert_h */
@@ -6,86 +6,93 @@
 //  Copyright © 2017 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
 //
 
-#include <errno.h>   // errno
-#include <stdbool.h> // bool
-#include <stdio.h>   // fprintf()
-#include <stdlib.h>  // malloc()
-#include <string.h>  // strerror()
+#include <errno.h>    // errno
+#include <fcntl.h>    // open()
+#include <pthread.h>  // pthread_create()
+#include <stdbool.h>  // bool
+#include <stdint.h>   // SIZE_MAX
+#include <stdio.h>    // fprintf()
+#include <stdlib.h>   // malloc()
+#include <string.h>   // strerror()
+#include <sys/mman.h> // mmap()
+#include <sys/stat.h> // fstat()
+#include <sys/uio.h>  // writev()
+#include <unistd.h>   // close()
+#include "IORing.h"
 #include "FileIO.h"
 
-#define FILE_SIZE_MAX_MB 5
-#define FILE_SIZE_MAX    (FILE_SIZE_MAX_MB * 1024 * 1024)
-
-char  *gInFileContents = NULL;
-size_t gInFileLength = 0;
-char  *gOutFilePath = NULL;
-FILE  *gOutFileHandle = NULL;
-
-extern char *gInFilePath;
-extern bool  gOverwriteFile;
+const size_t   kOutSinkSize = 1024 * 1024;           // a whole conversion is usually written in one or two calls
+const uint32_t kMaxRingTransfer = 1024 * 1024 * 1024; // most bytes to read or write with one io_uring operation
+const int      kInFileThreads = 4;                    // number of threads for LoadInFiles() to read with when there is no io_uring
 
 // Compiled from various file-related functions' man pages
 FileError gErrorTable[] =
 {
     {EACCES,       "search permission denied"},
-    {EBADF,        "stream not seekable"},
+    {EBADF,        "invalid file descriptor"},
     {EFAULT,       "invalid address"},
     {EINVAL,       "seek location negative or argument has improper value"},
     {EIO,          "I/O error"},
     {ELOOP,        "possible symlink loop"},
+    {EMFILE,       "too many open files"},
     {ENAMETOOLONG, "name too long"},
+    {ENODEV,       "file system does not support memory mapping"},
     {ENOENT,       "does not exist"},
-    {ENOMEM,       "malloc failure"},
+    {ENOMEM,       "out of memory or address space"},
     {ENOTDIR,      "a component of the file path is not a directory"},
-    {EOVERFLOW,    "seek location too large to be stored in off_t/long"},
+    {EOVERFLOW,    "file size too large to be stored in off_t/size_t"},
     {ESPIPE,       "stream's file desc. associated with pipe, socket or FIFO; or file-position indicator is unspecified"},
     {0,            ""}
 };
 
 #pragma mark Input file
-// Load file from disk which is going to be examined and browsed/converted
-bool LoadInFile(char *srcPath)
+// Map file at "srcPath" from disk which is going to be examined and browsed/converted, setting "contents" and "length" to the mapping.
+// The file is never copied into memory of our own; the kernel pages it in as the bplist is read, so there is no limit on its size other
+// than the address space.
+bool LoadInFile(const char *srcPath, char **contents, size_t *length)
 {
 #define DieIf(boole) \
 if (boole) \
 { \
-   ReportInFileError(stream); \
+   ReportInFileError(); \
+   if (fd != -1) \
+      close(fd); \
    return false; \
 } \
 do {} while (0)
     
-    long result = 0;
-    
-    FILE *stream = fopen(srcPath, "r");
-    DieIf(stream == NULL);
+    struct stat info;
     
-    result = fseek(stream, 0, SEEK_END);
-    DieIf(result == -1);
+    int fd = open(srcPath, O_RDONLY);
+    DieIf(fd == -1);
     
-    result = ftell(stream);
-    DieIf(result == -1);
-    
-    gInFileLength = (size_t)result;
-    if (gInFileLength > FILE_SIZE_MAX)
+    DieIf(fstat(fd, &info) == -1);
+    if (info.st_size <= 0)
     {
-        printf("Fatal error: File is over the limit of %d megabytes.\n", FILE_SIZE_MAX_MB);
+        printf("Fatal error: File is empty.\n");
+        close(fd);
         return false;
     }
-    
-    rewind(stream);
-    DieIf(ferror(stream));
-    
-    gInFileContents = calloc((unsigned long)(gInFileLength + 1), 1); // freed on program quit
-    if (gInFileContents == NULL)
+    if ((uint64_t)info.st_size > SIZE_MAX)
     {
-        printf("Fatal error: Memory allocation failed.\n");
+        printf("Fatal error: File is too large to be mapped into memory.\n");
+        close(fd);
         return false;
     }
+    size_t fileLength = (size_t)info.st_size;
     
-    result = (long)fread(gInFileContents, 1, gInFileLength, stream);
-    DieIf(result != gInFileLength);
+    void *mapping = mmap(NULL, fileLength, PROT_READ, MAP_PRIVATE, fd, 0); // unmapped with CloseInFile()
+    DieIf(mapping == MAP_FAILED);
+    *contents = mapping;
+    *length = fileLength;
     
-    fclose(stream);
+    // The mapping stays valid after the descriptor is closed
+    close(fd);
+    
+    // Building the object header table reads the whole file, so ask for it to be paged in ahead of us. After that, lookups jump
+    // around the file, so read-ahead past the pages that are actually touched would be wasted.
+    madvise(mapping, fileLength, MADV_WILLNEED);
+    madvise(mapping, fileLength, MADV_RANDOM);
     
     return true;
     
@@ -93,14 +100,9 @@ do {} while (0)
 }
 
 // Report on whatever error occurred when working with the in file
-void ReportInFileError(FILE *stream)
+void ReportInFileError(void)
 {
-    int error = 0;
-    
-    if (stream == NULL)
-        error = errno;
-    else
-        error = ferror(stream);
+    int error = errno;
     
     FileError *e;
     for (e = gErrorTable; e->feCode != 0; e++)
@@ -114,52 +116,561 @@ void ReportInFileError(FILE *stream)
     if (e->feCode == 0)
         printf("Fatal file error occurred. Could not obtain details.\n");
 }
+
+// Read every page of an in file mapped by LoadInFile() into memory now, so that waiting on the disk is done by the caller rather than by
+// whoever reads the file next
+void PrefetchInFile(const char *contents, size_t length)
+{
+    long pageSize = sysconf(_SC_PAGESIZE);
+    if (pageSize <= 0)
+        pageSize = 4096;
+    
+    madvise((void *)contents, length, MADV_SEQUENTIAL);
+    volatile char touched = 0;
+    for (size_t a = 0; a < length; a += (size_t)pageSize)
+        touched ^= contents[a];
+    touched ^= contents[length - 1];
+    madvise((void *)contents, length, MADV_RANDOM);
+}
+
+// Release the mapping of an in file made by LoadInFile()
+void CloseInFile(char **contents, size_t *length)
+{
+    if (*contents != NULL)
+        munmap(*contents, *length);
+    *contents = NULL;
+    *length = 0;
+}
+#pragma mark Batches of input files
+// Load each of the "count" files in "requests", setting "ifLoaded" on the ones that succeed. Each step is taken for all of the files at
+// once through "ring" if it has been set up, so that a batch costs a few system calls instead of several per file; otherwise the files
+// are shared out between a few threads so that one slow read doesn't hold up the others.
+void LoadInFiles(struct IORing *ring, InFileRequest **requests, int count)
+{
+    for (int a = 0; a < count; a++)
+    {
+        requests[a]->ifContents = NULL;
+        requests[a]->ifLength = 0;
+        requests[a]->ifMapped = false;
+        requests[a]->ifLoaded = false;
+        requests[a]->ifFileDesc = -1;
+    }
+    
+    if (ring != NULL && ring->irFileDesc != -1)
+        LoadInFilesWithRing(ring, requests, count);
+    else
+        LoadInFilesOnThreads(requests, count);
+}
+
+// Open all of the files, read each into memory of its own as soon as it is open, and then close them all. The files are read up to the
+// size they had when they were found, which is enough for a log that hasn't changed since.
+void LoadInFilesWithRing(struct IORing *ring, InFileRequest **requests, int count)
+{
+    int inFlight = 0;
+    for (int a = 0; a < count; a++)
+    {
+        if (QueueOpenFile(ring, requests[a]->ifPath, O_RDONLY | O_CLOEXEC, 0, (uint64_t)a))
+            inFlight++;
+        else
+            LoadInFileRequest(requests[a]);
+    }
+    
+    // The tag of each completion is the file's index, and whether it was an open or a read is told by whether the file has a descriptor
+    while (inFlight > 0 && SubmitIORing(ring, 1))
+    {
+        uint64_t tag;
+        int result;
+        while (ReapIORing(ring, &tag, &result))
+        {
+            InFileRequest *request = requests[tag];
+            inFlight--;
+            if (result < 0)
+            {
+                errno = -result;
+                ReportInFileError();
+                continue;
+            }
+            
+            if (request->ifFileDesc == -1)
+            {
+                request->ifFileDesc = result;
+                if (request->ifSize == 0 || request->ifSize > SIZE_MAX)
+                {
+                    printf("Fatal error: File is %s.\n", request->ifSize == 0 ? "empty" : "too large to be loaded into memory");
+                    continue;
+                }
+                request->ifContents = malloc((size_t)request->ifSize); // freed with CloseInFileRequest()
+                if (request->ifContents == NULL)
+                {
+                    printf("Fatal error: Memory allocation failed.\n");
+                    continue;
+                }
+            }
+            else if (result == 0) // the file has shrunk since it was found, so make do with what there is
+            {
+                request->ifLoaded = (request->ifLength > 0);
+                continue;
+            }
+            else
+                request->ifLength += (size_t)result;
+            
+            // Read whatever is left, in pieces if the file is huge
+            if (request->ifLength == request->ifSize)
+            {
+                request->ifLoaded = true;
+                continue;
+            }
+            uint64_t remaining = request->ifSize - request->ifLength;
+            uint32_t pieceLength = (remaining > kMaxRingTransfer ? kMaxRingTransfer : (uint32_t)remaining);
+            if (QueueReadFile(ring, request->ifFileDesc, request->ifContents + request->ifLength, pieceLength, request->ifLength, tag))
+                inFlight++;
+            else
+                printf("Fatal error: Could not read \"%s\".\n", request->ifPath);
+        }
+    }
+    
+    int numToClose = 0;
+    for (int a = 0; a < count; a++)
+    {
+        InFileRequest *request = requests[a];
+        if (request->ifFileDesc != -1)
+        {
+            if (QueueCloseFile(ring, request->ifFileDesc, (uint64_t)a))
+                numToClose++;
+            else
+                close(request->ifFileDesc);
+            request->ifFileDesc = -1;
+        }
+        if (!request->ifLoaded && !request->ifMapped)
+        {
+            free(request->ifContents);
+            request->ifContents = NULL;
+            request->ifLength = 0;
+        }
+    }
+    if (numToClose > 0 && SubmitIORing(ring, (unsigned)numToClose))
+    {
+        uint64_t tag;
+        int result;
+        while (ReapIORing(ring, &tag, &result))
+            ;
+    }
+}
+
+// Load the files by mapping them with LoadInFile() on a few threads, the calling thread being one of them
+void LoadInFilesOnThreads(InFileRequest **requests, int count)
+{
+    InFileBatch batch = {requests, count, 0};
+    
+    pthread_t threads[kInFileThreads];
+    int numStarted = 0;
+    while (numStarted < kInFileThreads - 1 && numStarted < count - 1 &&
+           pthread_create(&threads[numStarted], NULL, RunInFileLoader, &batch) == 0)
+        numStarted++;
+    RunInFileLoader(&batch);
+    for (int a = 0; a < numStarted; a++)
+        pthread_join(threads[a], NULL);
+}
+
+// Body of a thread started by LoadInFilesOnThreads(): load files until there are none left
+void *RunInFileLoader(void *arg)
+{
+    InFileBatch *batch = arg;
+    
+    int index;
+    while ((index = __atomic_fetch_add(&batch->ibNext, 1, __ATOMIC_RELAXED)) < batch->ibCount)
+        LoadInFileRequest(batch->ibRequests[index]);
+    
+    return NULL;
+}
+
+// Map the file of "request" with LoadInFile() and read it in from the disk straight away
+void LoadInFileRequest(InFileRequest *request)
+{
+    request->ifLoaded = LoadInFile(request->ifPath, &request->ifContents, &request->ifLength);
+    request->ifMapped = request->ifLoaded;
+    if (request->ifLoaded)
+        PrefetchInFile(request->ifContents, request->ifLength);
+}
+
+// Release the contents of a file loaded by LoadInFiles()
+void CloseInFileRequest(InFileRequest *request)
+{
+    if (request->ifMapped)
+        CloseInFile(&request->ifContents, &request->ifLength);
+    else
+        free(request->ifContents);
+    request->ifContents = NULL;
+    request->ifLength = 0;
+    request->ifMapped = false;
+    request->ifLoaded = false;
+}
 #pragma mark Output file
-// Create RTF or TXT file for converted chat log
-bool CreateOutFile(bool useRTF)
+// Set up "sink" with no out file attached to it
+void InitOutSink(OutSink *sink)
+{
+    sink->osFilePath = NULL;
+    sink->osFileDesc = -1;
+    sink->osInMemory = false;
+    sink->osBuffer = NULL;
+    sink->osUsed = 0;
+    sink->osCapacity = 0;
+    sink->osFailed = false;
+    sink->osBytes = 0;
+    sink->osWrites = 0;
+}
+
+// Create RTF or TXT file for the converted chat log at "srcPath" and attach it to "sink". If "overwrite" is false, an existing file by
+// the same name is left alone.
+bool CreateOutFile(OutSink *sink, const char *srcPath, bool useRTF, bool overwrite)
 {
     char *suffix = (useRTF ? "rtf" : "txt");
     
-    // Change suffix of gInFileName to .rtf or .txt and save in gOutFilePath
-    asprintf(&gOutFilePath, "%s", gInFilePath); // freed on program quit
-    char *dotPosition = strrchr(gOutFilePath, '.');
+    // Change suffix of "srcPath" to .rtf or .txt and save in "osFilePath"
+    asprintf(&sink->osFilePath, "%s", srcPath); // freed with CloseOutFile()
+    char *dotPosition = strrchr(sink->osFilePath, '.');
     if (dotPosition == NULL)
     {
         printf("Fatal error: Could not create output file name!\n");
+        CloseOutFile(sink);
         return false;
     }
     strncpy(dotPosition + 1, suffix, 4);
     
-    gOutFileHandle = fopen(gOutFilePath, (gOverwriteFile ? "w" : "wx"));
+    int flags = O_WRONLY | O_CREAT | (overwrite ? O_TRUNC : O_EXCL);
+    sink->osFileDesc = open(sink->osFilePath, flags, 0666); // closed with CloseOutFile()
     
     // Check for pre-existing file with this name
-    if (!gOutFileHandle)
+    if (sink->osFileDesc == -1)
     {
         if (errno == 17) // "File exists"
         {
             char *fileName = NULL;
-            char *lastSlash = strrchr(gOutFilePath, '/');
+            char *lastSlash = strrchr(sink->osFilePath, '/');
             asprintf(&fileName, "%s", lastSlash + 1); // freed below
             printf("Skipping conversion; \"%s\" already exists.\n", fileName);
             free(fileName);
         }
         else
             printf("Fatal error %d: \"%s\". Could not create output file.\n", errno, strerror(errno));
+        CloseOutFile(sink);
         return false;
     }
     
+    sink->osBuffer = malloc(kOutSinkSize); // freed with CloseOutFile()
+    if (sink->osBuffer == NULL)
+    {
+        printf("Fatal error: Could not allocate output buffer.\n");
+        close(sink->osFileDesc);
+        sink->osFileDesc = -1;
+        CloseOutFile(sink);
+        return false;
+    }
+    sink->osUsed = 0;
+    sink->osCapacity = kOutSinkSize;
+    sink->osFailed = false;
+    sink->osBytes = 0;
+    sink->osWrites = 0;
+    
+    return true;
+}
+
+// Set up "sink" to collect output in memory, starting with room for "initialSize" bytes
+bool CreateMemorySink(OutSink *sink, size_t initialSize)
+{
+    InitOutSink(sink);
+    sink->osInMemory = true;
+    if (initialSize == 0)
+        return true;
+    
+    sink->osBuffer = malloc(initialSize); // freed with FreeMemorySink()
+    if (sink->osBuffer == NULL)
+    {
+        printf("Fatal error: Could not allocate output buffer.\n");
+        sink->osFailed = true;
+        return false;
+    }
+    sink->osCapacity = initialSize;
+    
+    return true;
+}
+
+// Make room in memory sink "sink" for "length" more bytes. If there isn't enough memory, the output is thrown away so that the caller
+// still has somewhere to put its bytes, and the sink is marked as failed.
+bool GrowMemorySink(OutSink *sink, size_t length)
+{
+    size_t capacity = (sink->osCapacity < 4096 ? 4096 : sink->osCapacity);
+    while (capacity - sink->osUsed < length)
+        capacity *= 2;
+    
+    char *buffer = realloc(sink->osBuffer, capacity); // freed with FreeMemorySink()
+    if (buffer == NULL)
+    {
+        printf("Fatal error: Could not enlarge output buffer.\n");
+        sink->osFailed = true;
+        sink->osUsed = 0;
+        return (sink->osCapacity >= length);
+    }
+    sink->osBuffer = buffer;
+    sink->osCapacity = capacity;
+    
     return true;
 }
 
-// Write provided text to out file
-void WriteToOutFile(char *output)
+// Free the buffer of memory sink "sink" once its output has been used
+void FreeMemorySink(OutSink *sink)
 {
-    fprintf(gOutFileHandle, "%s", output);
+    free(sink->osBuffer);
+    sink->osBuffer = NULL;
+    sink->osUsed = 0;
+    sink->osCapacity = 0;
 }
 
-// Close file now that we are done with it
-void CloseOutFile(void)
+// Keep everything appended to "sink" in memory instead of writing it to the out file as the buffer fills, until ReleaseOutFile() is
+// called. The out file must already have been created.
+void HoldOutFile(OutSink *sink)
 {
-    fflush(gOutFileHandle);
-    fclose(gOutFileHandle);
+    sink->osInMemory = true;
+}
+
+// Go back to writing "sink" to its out file after HoldOutFile(), starting with everything that was held back
+void ReleaseOutFile(OutSink *sink)
+{
+    sink->osInMemory = false;
+    FlushOutFile(sink);
+}
+
+// Hand the "count" pieces of output in "pieces" to the kernel, repeating the call until all of it has been written
+void WritePieces(OutSink *sink, struct iovec *pieces, int count)
+{
+    while (count > 0 && !sink->osFailed)
+    {
+        ssize_t written = writev(sink->osFileDesc, pieces, count);
+        sink->osWrites++;
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            printf("Fatal error %d: \"%s\". Could not write to output file.\n", errno, strerror(errno));
+            sink->osFailed = true;
+            return;
+        }
+        sink->osBytes += (uint64_t)written;
+        
+        // Skip past whatever was written and try again with the rest
+        while (count > 0 && (size_t)written >= pieces->iov_len)
+        {
+            written -= pieces->iov_len;
+            pieces++;
+            count--;
+        }
+        if (count > 0)
+        {
+            pieces->iov_base = (char *)pieces->iov_base + written;
+            pieces->iov_len -= (size_t)written;
+        }
+    }
+}
+
+// Append "length" bytes of "bytes", which need not be null-terminated, to out file
+void AppendToOutFile(OutSink *sink, const char *bytes, size_t length)
+{
+    if (sink->osCapacity - sink->osUsed >= length)
+    {
+        memcpy(sink->osBuffer + sink->osUsed, bytes, length);
+        sink->osUsed += length;
+        return;
+    }
+    
+    if (sink->osInMemory)
+    {
+        if (GrowMemorySink(sink, length))
+        {
+            memcpy(sink->osBuffer + sink->osUsed, bytes, length);
+            sink->osUsed += length;
+        }
+        return;
+    }
+    
+    // If the bytes would fill most of the buffer anyway, write them straight from where they are along with what's buffered
+    if (length >= sink->osCapacity / 2)
+    {
+        struct iovec pieces[2] = {{sink->osBuffer, sink->osUsed}, {(void *)bytes, length}};
+        WritePieces(sink, pieces, 2);
+        sink->osUsed = 0;
+        return;
+    }
+    
+    FlushOutFile(sink);
+    memcpy(sink->osBuffer, bytes, length);
+    sink->osUsed = length;
+}
+
+// Returns a place in the out file's buffer where up to "length" bytes can be written directly; "length" must not be more than the
+// buffer's capacity. The bytes become part of the output once CommitOutFileSpace() is called with the number actually written.
+char *ReserveOutFileSpace(OutSink *sink, size_t length)
+{
+    if (sink->osCapacity - sink->osUsed < length)
+    {
+        if (sink->osInMemory)
+            GrowMemorySink(sink, length);
+        else
+            FlushOutFile(sink);
+    }
+    return sink->osBuffer + sink->osUsed;
+}
+
+// Adds "length" bytes written to the space returned by ReserveOutFileSpace() to the output
+void CommitOutFileSpace(OutSink *sink, size_t length)
+{
+    sink->osUsed += length;
+}
+
+// Append null-terminated string "str" to out file
+void AppendStringToOutFile(OutSink *sink, const char *str)
+{
+    AppendToOutFile(sink, str, strlen(str));
+}
+
+// Append a single character to out file
+void AppendCharToOutFile(OutSink *sink, char c)
+{
+    if (sink->osUsed == sink->osCapacity)
+    {
+        if (sink->osInMemory)
+        {
+            if (!GrowMemorySink(sink, 1))
+                return;
+        }
+        else
+            FlushOutFile(sink);
+    }
+    sink->osBuffer[sink->osUsed++] = c;
+}
+
+// Append the decimal digits of "num" to out file
+void AppendNumToOutFile(OutSink *sink, uint64_t num)
+{
+    char digits[20];
+    char *writer = digits + sizeof(digits);
+    do
+    {
+        *--writer = (char)('0' + num % 10);
+        num /= 10;
+    }
+    while (num > 0);
+    AppendToOutFile(sink, writer, (size_t)(digits + sizeof(digits) - writer));
+}
+
+// Write everything that has been appended so far to the out file; a memory sink keeps it
+void FlushOutFile(OutSink *sink)
+{
+    if (sink->osInMemory)
+        return;
+    if (sink->osUsed > 0)
+    {
+        struct iovec piece = {sink->osBuffer, sink->osUsed};
+        WritePieces(sink, &piece, 1);
+    }
+    sink->osUsed = 0;
+}
+
+// Close file now that we are done with it, or give up on creating it
+void CloseOutFile(OutSink *sink)
+{
+    free(sink->osFilePath);
+    sink->osFilePath = NULL;
+    if (sink->osFileDesc == -1)
+        return;
+    
+    ReleaseOutFile(sink); // also writes whatever HoldOutFile() kept back
+    close(sink->osFileDesc);
+    sink->osFileDesc = -1;
+    free(sink->osBuffer);
+    sink->osBuffer = NULL;
+    sink->osCapacity = 0;
+}
+
+// Write out and close each of the "count" sinks in "sinks" whose output is being held back by HoldOutFile(), handing all of the writes
+// and then all of the closes to the kernel at once through "ring". Without an io_uring, nothing is done here and the sinks are written
+// as usual when they are closed. Either way, CloseOutFile() still has to be called on each sink afterwards.
+void WriteHeldOutFiles(struct IORing *ring, OutSink **sinks, int count)
+{
+    if (ring == NULL || ring->irFileDesc == -1)
+        return;
+    
+    // Each sink has at most one write in flight, so whatever it writes can be dropped from the front of its buffer before the next;
+    // the held output always starts at "osBytes" in the file
+    int inFlight = 0;
+    for (int a = 0; a < count; a++)
+    {
+        OutSink *sink = sinks[a];
+        if (sink->osFileDesc == -1 || !sink->osInMemory || sink->osUsed == 0)
+            continue;
+        uint32_t pieceLength = (sink->osUsed > kMaxRingTransfer ? kMaxRingTransfer : (uint32_t)sink->osUsed);
+        if (QueueWriteFile(ring, sink->osFileDesc, sink->osBuffer, pieceLength, sink->osBytes, (uint64_t)a))
+            inFlight++;
+    }
+    
+    while (inFlight > 0 && SubmitIORing(ring, 1))
+    {
+        uint64_t tag;
+        int result;
+        while (ReapIORing(ring, &tag, &result))
+        {
+            OutSink *sink = sinks[tag];
+            inFlight--;
+            sink->osWrites++;
+            if (result < 0 && result != -EINTR && result != -EAGAIN)
+            {
+                printf("Fatal error %d: \"%s\". Could not write to output file.\n", -result, strerror(-result));
+                sink->osFailed = true;
+                sink->osUsed = 0;
+                continue;
+            }
+            if (result > 0)
+            {
+                sink->osBytes += (uint64_t)result;
+                sink->osUsed -= (size_t)result;
+                memmove(sink->osBuffer, sink->osBuffer + result, sink->osUsed);
+            }
+            if (sink->osUsed == 0)
+                continue;
+            
+            uint32_t pieceLength = (sink->osUsed > kMaxRingTransfer ? kMaxRingTransfer : (uint32_t)sink->osUsed);
+            if (QueueWriteFile(ring, sink->osFileDesc, sink->osBuffer, pieceLength, sink->osBytes, tag))
+                inFlight++;
+        }
+    }
+    
+    // Writes at an offset don't move the file position, so a sink that the ring didn't finish is left held and moved to where it
+    // got to, for CloseOutFile() to write the rest of the usual way
+    int numToClose = 0;
+    for (int a = 0; a < count; a++)
+    {
+        OutSink *sink = sinks[a];
+        if (sink->osFileDesc == -1 || !sink->osInMemory)
+            continue;
+        if (sink->osUsed > 0)
+        {
+            lseek(sink->osFileDesc, (off_t)sink->osBytes, SEEK_SET);
+            continue;
+        }
+        if (QueueCloseFile(ring, sink->osFileDesc, (uint64_t)a))
+            numToClose++;
+        else
+            close(sink->osFileDesc);
+        sink->osFileDesc = -1;
+        sink->osInMemory = false;
+        free(sink->osBuffer);
+        sink->osBuffer = NULL;
+        sink->osCapacity = 0;
+    }
+    if (numToClose > 0 && SubmitIORing(ring, (unsigned)numToClose))
+    {
+        uint64_t tag;
+        int result;
+        while (ReapIORing(ring, &tag, &result))
+            ;
+    }
 }
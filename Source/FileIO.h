@@ -16,10 +16,74 @@ typedef struct FileError
     char *feDesc;
 } FileError;
 
-bool LoadInFile(char *srcPath);
-void ReportInFileError(FILE *stream);
-bool CreateOutFile(bool useRTF);
-void WriteToOutFile(char *output);
-void CloseOutFile(void);
+// Output is collected in a large buffer and handed to the kernel in a few big writes instead of one library call per fragment. Each
+// conversion has a sink of its own, so several files can be written at once. A sink made with CreateMemorySink() has no file; its
+// buffer grows to hold everything appended to it, so that output made on one thread can be written by another.
+typedef struct OutSink
+{
+    char    *osFilePath; // path of the out file
+    int      osFileDesc; // descriptor of the out file
+    bool     osInMemory; // whether the output is kept in "osBuffer" instead of being written to a file
+    char    *osBuffer;   // output that has not been written yet
+    size_t   osUsed;     // number of bytes waiting in "osBuffer"
+    size_t   osCapacity; // size of "osBuffer"
+    bool     osFailed;   // whether a write failed, in which case the rest of the output is discarded
+    uint64_t osBytes;    // total bytes written to the out file
+    uint64_t osWrites;   // number of write()/writev() calls made
+} OutSink;
+
+// One file for LoadInFiles() to read
+typedef struct InFileRequest
+{
+    const char *ifPath;     // path of the file
+    uint64_t    ifSize;     // size that the file is expected to have, from when it was found
+    char       *ifContents; // the contents of the file, once loaded
+    size_t      ifLength;   // number of bytes in "ifContents"
+    bool        ifMapped;   // whether "ifContents" is a mapping made by LoadInFile() instead of memory from malloc()
+    bool        ifLoaded;   // whether the file was loaded
+    int         ifFileDesc; // descriptor of the file while LoadInFiles() is reading it through an io_uring
+} InFileRequest;
+
+// The requests that LoadInFiles() shares out between its threads when there is no io_uring
+typedef struct InFileBatch
+{
+    InFileRequest **ibRequests; // the files to load
+    int             ibCount;    // number of files in "ibRequests"
+    int             ibNext;     // index of the next file for a thread to take, changed atomically
+} InFileBatch;
+
+struct iovec;
+struct IORing;
+
+// Appends a string literal without measuring it at runtime
+#define AppendLiteralToOutFile(sink, literal) AppendToOutFile((sink), (literal), sizeof(literal) - 1)
+
+bool  LoadInFile(const char *srcPath, char **contents, size_t *length);
+void  ReportInFileError(void);
+void  PrefetchInFile(const char *contents, size_t length);
+void  CloseInFile(char **contents, size_t *length);
+void  LoadInFiles(struct IORing *ring, InFileRequest **requests, int count);
+void  LoadInFilesWithRing(struct IORing *ring, InFileRequest **requests, int count);
+void  LoadInFilesOnThreads(InFileRequest **requests, int count);
+void *RunInFileLoader(void *arg);
+void  LoadInFileRequest(InFileRequest *request);
+void  CloseInFileRequest(InFileRequest *request);
+void  InitOutSink(OutSink *sink);
+bool  CreateOutFile(OutSink *sink, const char *srcPath, bool useRTF, bool overwrite);
+bool  CreateMemorySink(OutSink *sink, size_t initialSize);
+bool  GrowMemorySink(OutSink *sink, size_t length);
+void  FreeMemorySink(OutSink *sink);
+void  HoldOutFile(OutSink *sink);
+void  ReleaseOutFile(OutSink *sink);
+void  WritePieces(OutSink *sink, struct iovec *pieces, int count);
+void  AppendToOutFile(OutSink *sink, const char *bytes, size_t length);
+char *ReserveOutFileSpace(OutSink *sink, size_t length);
+void  CommitOutFileSpace(OutSink *sink, size_t length);
+void  AppendStringToOutFile(OutSink *sink, const char *str);
+void  AppendCharToOutFile(OutSink *sink, char c);
+void  AppendNumToOutFile(OutSink *sink, uint64_t num);
+void  FlushOutFile(OutSink *sink);
+void  CloseOutFile(OutSink *sink);
+void  WriteHeldOutFiles(struct IORing *ring, OutSink **sinks, int count);
 
 #endif /* FileIO_h */
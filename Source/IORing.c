@@ -0,0 +1,285 @@
+//
+//  IORing.c
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#include <errno.h>   // errno
+#include <stdbool.h> // bool
+#include <stdint.h>  // uint64_t
+#include <stdlib.h>  // calloc()
+#include <string.h>  // memset()
+#include "IORing.h"
+
+#if defined(__linux__)
+#include <fcntl.h>          // AT_FDCWD
+#include <linux/io_uring.h> // struct io_uring_params
+#include <sys/mman.h>       // mmap()
+#include <sys/syscall.h>    // __NR_io_uring_setup
+#include <unistd.h>         // syscall()
+
+#pragma mark Ring management
+// Set up "ring" with room for "entries" operations at a time. Returns false, leaving "ring" with no descriptor, if io_uring can't be
+// used here or doesn't support all of the operations that we queue.
+bool InitIORing(IORing *ring, unsigned entries)
+{
+    memset(ring, 0, sizeof(IORing));
+    ring->irFileDesc = -1;
+    
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return false;
+    ring->irFileDesc = fd;
+    ring->irEntries = params.sq_entries;
+    
+    // Ask the kernel which operations it knows; openat and close arrived later than read and write
+    size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, probeSize); // freed below
+    bool supported = (probe != NULL && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0);
+    int neededOps[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE};
+    for (int a = 0; supported && a < (int)(sizeof(neededOps) / sizeof(neededOps[0])); a++)
+        supported = (neededOps[a] <= probe->last_op && (probe->ops[neededOps[a]].flags & IO_URING_OP_SUPPORTED));
+    free(probe);
+    if (!supported)
+    {
+        FreeIORing(ring);
+        return false;
+    }
+    
+    // Map the two rings, which newer kernels let us do in one go, and the array of submission entries
+    ring->irSQRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->irCQRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP);
+    if (singleMap && ring->irCQRingSize > ring->irSQRingSize)
+        ring->irSQRingSize = ring->irCQRingSize;
+    ring->irSQRing = mmap(NULL, ring->irSQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring->irSQRing == MAP_FAILED)
+    {
+        ring->irSQRing = NULL;
+        FreeIORing(ring);
+        return false;
+    }
+    if (singleMap)
+        ring->irCQRing = ring->irSQRing;
+    else
+    {
+        ring->irCQRing = mmap(NULL, ring->irCQRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring->irCQRing == MAP_FAILED)
+        {
+            ring->irCQRing = NULL;
+            FreeIORing(ring);
+            return false;
+        }
+    }
+    ring->irSQEntriesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->irSQEntries = mmap(NULL, ring->irSQEntriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring->irSQEntries == MAP_FAILED)
+    {
+        ring->irSQEntries = NULL;
+        FreeIORing(ring);
+        return false;
+    }
+    
+    char *sq = ring->irSQRing, *cq = ring->irCQRing;
+    ring->irSQHead = (unsigned *)(sq + params.sq_off.head);
+    ring->irSQTail = (unsigned *)(sq + params.sq_off.tail);
+    ring->irSQMask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->irSQArray = (unsigned *)(sq + params.sq_off.array);
+    ring->irCQHead = (unsigned *)(cq + params.cq_off.head);
+    ring->irCQTail = (unsigned *)(cq + params.cq_off.tail);
+    ring->irCQMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->irCQEntries = cq + params.cq_off.cqes;
+    
+    return true;
+}
+
+// Unmap and close "ring"; any operations still in flight are finished by the kernel
+void FreeIORing(IORing *ring)
+{
+    if (ring->irSQEntries != NULL)
+        munmap(ring->irSQEntries, ring->irSQEntriesSize);
+    if (ring->irCQRing != NULL && ring->irCQRing != ring->irSQRing)
+        munmap(ring->irCQRing, ring->irCQRingSize);
+    if (ring->irSQRing != NULL)
+        munmap(ring->irSQRing, ring->irSQRingSize);
+    if (ring->irFileDesc != -1)
+        close(ring->irFileDesc);
+    memset(ring, 0, sizeof(IORing));
+    ring->irFileDesc = -1;
+}
+#pragma mark Queueing operations
+// Queue the opening of the file at "path" with open() flags "flags" and permissions "mode". The completion's result is the descriptor.
+bool QueueOpenFile(IORing *ring, const char *path, int flags, int mode, uint64_t tag)
+{
+    struct io_uring_sqe *entry = GetSubmissionEntry(ring);
+    if (entry == NULL)
+        return false;
+    
+    entry->opcode = IORING_OP_OPENAT;
+    entry->fd = AT_FDCWD;
+    entry->addr = (uint64_t)(uintptr_t)path;
+    entry->len = (uint32_t)mode;
+    entry->open_flags = (uint32_t)flags;
+    entry->user_data = tag;
+    return true;
+}
+
+// Queue the reading of "length" bytes at "offset" in file "fileDesc" into "buffer". The completion's result is the number read.
+bool QueueReadFile(IORing *ring, int fileDesc, void *buffer, uint32_t length, uint64_t offset, uint64_t tag)
+{
+    struct io_uring_sqe *entry = GetSubmissionEntry(ring);
+    if (entry == NULL)
+        return false;
+    
+    entry->opcode = IORING_OP_READ;
+    entry->fd = fileDesc;
+    entry->addr = (uint64_t)(uintptr_t)buffer;
+    entry->len = length;
+    entry->off = offset;
+    entry->user_data = tag;
+    return true;
+}
+
+// Queue the writing of "length" bytes from "buffer" at "offset" in file "fileDesc". The completion's result is the number written.
+bool QueueWriteFile(IORing *ring, int fileDesc, const void *buffer, uint32_t length, uint64_t offset, uint64_t tag)
+{
+    struct io_uring_sqe *entry = GetSubmissionEntry(ring);
+    if (entry == NULL)
+        return false;
+    
+    entry->opcode = IORING_OP_WRITE;
+    entry->fd = fileDesc;
+    entry->addr = (uint64_t)(uintptr_t)buffer;
+    entry->len = length;
+    entry->off = offset;
+    entry->user_data = tag;
+    return true;
+}
+
+// Queue the closing of file "fileDesc"
+bool QueueCloseFile(IORing *ring, int fileDesc, uint64_t tag)
+{
+    struct io_uring_sqe *entry = GetSubmissionEntry(ring);
+    if (entry == NULL)
+        return false;
+    
+    entry->opcode = IORING_OP_CLOSE;
+    entry->fd = fileDesc;
+    entry->user_data = tag;
+    return true;
+}
+
+// Returns a cleared submission entry at the back of the queue, handing what's queued to the kernel first if the queue is full, or NULL
+// if there is no room even then. The entry is only made visible to the kernel by SubmitIORing(), once the caller has filled it in.
+void *GetSubmissionEntry(IORing *ring)
+{
+    unsigned tail = *ring->irSQTail + ring->irPending;
+    if (tail - __atomic_load_n(ring->irSQHead, __ATOMIC_ACQUIRE) == ring->irEntries)
+    {
+        if (!SubmitIORing(ring, 0))
+            return NULL;
+        tail = *ring->irSQTail;
+        if (tail - __atomic_load_n(ring->irSQHead, __ATOMIC_ACQUIRE) == ring->irEntries)
+            return NULL;
+    }
+    
+    unsigned index = tail & *ring->irSQMask;
+    struct io_uring_sqe *entry = (struct io_uring_sqe *)ring->irSQEntries + index;
+    memset(entry, 0, sizeof(struct io_uring_sqe));
+    ring->irSQArray[index] = index;
+    ring->irPending++;
+    return entry;
+}
+#pragma mark Completing operations
+// Hand everything queued to the kernel, then wait until at least "waitFor" operations have completed. Returns false on failure.
+bool SubmitIORing(IORing *ring, unsigned waitFor)
+{
+    unsigned tail = *ring->irSQTail + ring->irPending;
+    __atomic_store_n(ring->irSQTail, tail, __ATOMIC_RELEASE);
+    ring->irPending = 0;
+    
+    // The kernel may take fewer entries than it was offered, in which case the rest are offered again
+    while (true)
+    {
+        unsigned toSubmit = tail - __atomic_load_n(ring->irSQHead, __ATOMIC_ACQUIRE);
+        long result = syscall(__NR_io_uring_enter, ring->irFileDesc, toSubmit, waitFor, (waitFor > 0 ? IORING_ENTER_GETEVENTS : 0), NULL,
+                              0);
+        if (result < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            return false;
+        }
+        if ((unsigned)result >= toSubmit)
+            return true;
+    }
+}
+
+// Take the oldest completion off the queue, giving the tag it was queued with and its result, which is negative errno on failure.
+// Returns false if there are no completions waiting.
+bool ReapIORing(IORing *ring, uint64_t *tag, int *result)
+{
+    unsigned head = *ring->irCQHead;
+    if (head == __atomic_load_n(ring->irCQTail, __ATOMIC_ACQUIRE))
+        return false;
+    
+    struct io_uring_cqe *completion = (struct io_uring_cqe *)ring->irCQEntries + (head & *ring->irCQMask);
+    *tag = completion->user_data;
+    *result = completion->res;
+    __atomic_store_n(ring->irCQHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else // io_uring is Linux-only, so elsewhere there is never a ring and callers always take their fallback path
+
+bool InitIORing(IORing *ring, unsigned entries)
+{
+    memset(ring, 0, sizeof(IORing));
+    ring->irFileDesc = -1;
+    return false;
+}
+
+void FreeIORing(IORing *ring)
+{
+}
+
+bool QueueOpenFile(IORing *ring, const char *path, int flags, int mode, uint64_t tag)
+{
+    return false;
+}
+
+bool QueueReadFile(IORing *ring, int fileDesc, void *buffer, uint32_t length, uint64_t offset, uint64_t tag)
+{
+    return false;
+}
+
+bool QueueWriteFile(IORing *ring, int fileDesc, const void *buffer, uint32_t length, uint64_t offset, uint64_t tag)
+{
+    return false;
+}
+
+bool QueueCloseFile(IORing *ring, int fileDesc, uint64_t tag)
+{
+    return false;
+}
+
+void *GetSubmissionEntry(IORing *ring)
+{
+    return NULL;
+}
+
+bool SubmitIORing(IORing *ring, unsigned waitFor)
+{
+    return false;
+}
+
+bool ReapIORing(IORing *ring, uint64_t *tag, int *result)
+{
+    return false;
+}
+
+#endif
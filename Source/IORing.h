@@ -0,0 +1,46 @@
+//
+//  IORing.h
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#ifndef IORing_h
+#define IORing_h
+
+// A Linux io_uring, through which many file operations can be handed to the kernel with one system call and completed without the
+// caller blocking on each of them. It is set up with the raw system calls, so no library is needed. Where io_uring is missing or
+// refused, or the operations we need aren't supported, InitIORing() returns false and callers fall back on ordinary calls.
+typedef struct IORing
+{
+    int       irFileDesc;    // descriptor of the ring, or -1 if there is none
+    unsigned  irEntries;     // number of entries in the submission queue
+    unsigned  irPending;     // number of entries filled in since the last call to SubmitIORing(), which the kernel can't see yet
+    unsigned *irSQHead;      // submission queue: index of the next entry for the kernel to take
+    unsigned *irSQTail;      // submission queue: index just past the last entry queued
+    unsigned *irSQMask;      // submission queue: mask for turning an index into a position in the ring
+    unsigned *irSQArray;     // submission queue: positions in "irSQEntries" of the queued entries
+    void     *irSQEntries;   // submission queue entries (struct io_uring_sqe)
+    unsigned *irCQHead;      // completion queue: index of the next completion for us to take
+    unsigned *irCQTail;      // completion queue: index just past the last completion posted by the kernel
+    unsigned *irCQMask;      // completion queue: mask for turning an index into a position in the ring
+    void     *irCQEntries;   // completion queue entries (struct io_uring_cqe)
+    void     *irSQRing;      // mapping of the submission queue ring
+    size_t    irSQRingSize;  // size of "irSQRing"
+    void     *irCQRing;      // mapping of the completion queue ring; the same as "irSQRing" on kernels that map them together
+    size_t    irCQRingSize;  // size of "irCQRing"
+    size_t    irSQEntriesSize; // size of the mapping of "irSQEntries"
+} IORing;
+
+bool  InitIORing(IORing *ring, unsigned entries);
+void  FreeIORing(IORing *ring);
+bool  QueueOpenFile(IORing *ring, const char *path, int flags, int mode, uint64_t tag);
+bool  QueueReadFile(IORing *ring, int fileDesc, void *buffer, uint32_t length, uint64_t offset, uint64_t tag);
+bool  QueueWriteFile(IORing *ring, int fileDesc, const void *buffer, uint32_t length, uint64_t offset, uint64_t tag);
+bool  QueueCloseFile(IORing *ring, int fileDesc, uint64_t tag);
+void *GetSubmissionEntry(IORing *ring);
+bool  SubmitIORing(IORing *ring, unsigned waitFor);
+bool  ReapIORing(IORing *ring, uint64_t *tag, int *result);
+
+#endif /* IORing_h */
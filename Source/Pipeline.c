@@ -0,0 +1,301 @@
+//
+//  Pipeline.c
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#include <pthread.h>   // pthread_create()
+#include <sched.h>     // sched_yield()
+#include <stdatomic.h> // atomic_load_explicit()
+#include <stdbool.h>   // bool
+#include <stdint.h>    // uint64_t
+#include <stdio.h>     // printf()
+#include <stdlib.h>    // calloc()
+#include <time.h>      // nanosleep()
+#include "Arena.h"
+#include "FileIO.h"
+#include "IORing.h"
+#include "bplistReader.h"
+#include "ichatReader.h"
+#include "BatchConvert.h"
+#include "Pipeline.h"
+
+#pragma mark Pipeline management
+// Convert the jobs of "batch", which must already be sorted, with a stage for each of reading, decoding, formatting and writing. The
+// reader runs on the calling thread. Returns false without converting anything if the other stages could not be started.
+bool Convert_pipeline(Batch *batch)
+{
+    Pipeline *pl = calloc(1, sizeof(Pipeline)); // freed below
+    if (pl == NULL)
+    {
+        printf("Fatal error: Memory allocation failed.\n");
+        return false;
+    }
+    pl->plBatch = batch;
+    atomic_init(&pl->plToDecoder.sqHead, 0);
+    atomic_init(&pl->plToDecoder.sqTail, 0);
+    atomic_init(&pl->plToFormatter.sqHead, 0);
+    atomic_init(&pl->plToFormatter.sqTail, 0);
+    atomic_init(&pl->plToWriter.sqHead, 0);
+    atomic_init(&pl->plToWriter.sqTail, 0);
+    atomic_init(&pl->plInflightBytes, 0);
+    
+    void *(*stageFuncs[3])(void *) = {RunPipelineDecoder, RunPipelineFormatter, RunPipelineWriter};
+    StageQueue *stageQueues[3] = {&pl->plToDecoder, &pl->plToFormatter, &pl->plToWriter};
+    pthread_t threads[3];
+    int numStarted = 0;
+    while (numStarted < 3 && pthread_create(&threads[numStarted], NULL, stageFuncs[numStarted], pl) == 0)
+        numStarted++;
+    
+    // If a stage could not be started, tell the ones that were to finish straight away; the queues have room for the end marker
+    bool success = (numStarted == 3);
+    if (success)
+        RunPipelineReader(pl);
+    else
+    {
+        printf("Warning: Could not start the threads for the pipeline.\n");
+        for (int a = 0; a < numStarted; a++)
+            PushToStage(stageQueues[a], NULL);
+    }
+    for (int a = 0; a < numStarted; a++)
+        pthread_join(threads[a], NULL);
+    
+    free(pl);
+    return success;
+}
+#pragma mark Stages
+// Reader stage: read the logs in from the disk a group at a time, through an io_uring if the system has one, waiting first if the logs
+// in flight would take the pipeline over its budget. A log bigger than the whole budget is still let in once the pipeline is empty.
+void RunPipelineReader(Pipeline *pl)
+{
+    Batch *batch = pl->plBatch;
+    
+    IORing ring;
+    bool haveRing = InitIORing(&ring, PIPELINE_RING_SIZE);
+    if (batch->baPrintStats)
+        printf("Reading and writing logs %s.\n", haveRing ? "through io_uring" : "on threads");
+    
+    uint64_t a = 0;
+    while (a < batch->baNumJobs)
+    {
+        PipelineItem *group[PIPELINE_GROUP_SIZE];
+        InFileRequest *requests[PIPELINE_GROUP_SIZE];
+        int groupSize = 0;
+        uint64_t groupBytes = 0;
+        
+        // The first log of a group waits for room in the budget; the rest only join the group if there is room for them already
+        for (; a < batch->baNumJobs && groupSize < PIPELINE_GROUP_SIZE; a++)
+        {
+            BatchJob *job = &batch->baJobs[a];
+            
+            unsigned rounds = 0;
+            uint64_t inflight;
+            while ((inflight = atomic_load_explicit(&pl->plInflightBytes, memory_order_acquire) + groupBytes) > 0 &&
+                   inflight + job->bjSize > batch->baMaxInflightBytes && groupSize == 0)
+                WaitForStage(&rounds);
+            if (inflight > 0 && inflight + job->bjSize > batch->baMaxInflightBytes)
+                break;
+            
+            PipelineItem *item = calloc(1, sizeof(PipelineItem)); // freed by RunPipelineWriter()
+            if (item == NULL)
+            {
+                printf("Fatal error: Memory allocation failed.\n");
+                printf("Failed to convert \"%s\".\n", job->bjInPath);
+                continue;
+            }
+            item->piJob = job;
+            item->piInFile.ifPath = job->bjInPath;
+            item->piInFile.ifSize = job->bjSize;
+            item->piCharge = job->bjSize;
+            InitBatchJobContexts(batch, job, &item->piBP, &item->piIC);
+            item->piIC.icNumThreads = batch->baNumThreads;
+            
+            printf("Converting \"%s\"...\n", job->bjInPath);
+            group[groupSize] = item;
+            requests[groupSize] = &item->piInFile;
+            groupSize++;
+            groupBytes += job->bjSize;
+        }
+        
+        ChargePipeline(pl, groupBytes);
+        LoadInFiles(haveRing ? &ring : NULL, requests, groupSize);
+        for (int b = 0; b < groupSize; b++)
+        {
+            PipelineItem *item = group[b];
+            item->piOK = item->piInFile.ifLoaded;
+            item->piBP.bcFileContents = item->piInFile.ifContents;
+            item->piBP.bcFileLength = item->piInFile.ifLength;
+            PushToStage(&pl->plToDecoder, item);
+        }
+    }
+    
+    PushToStage(&pl->plToDecoder, NULL);
+    FreeIORing(&ring);
+}
+
+// Decoder stage: check that each log is an iChat log, load it, and create its out file, holding back what is written to it
+void *RunPipelineDecoder(void *arg)
+{
+    Pipeline *pl = arg;
+    Batch *batch = pl->plBatch;
+    
+    PipelineItem *item;
+    while ((item = PopFromStage(&pl->plToDecoder)) != NULL)
+    {
+        if (item->piOK)
+            item->piOK = (Validate_bplist(&item->piBP) && Load_bplist(&item->piBP));
+        if (item->piOK && !Validate_ichat(&item->piIC))
+        {
+            printf("\"%s\" is not an iChat log, so it cannot be converted.\n", item->piJob->bjInPath);
+            item->piOK = false;
+        }
+        if (item->piOK)
+            item->piOK = (Load_ichat(&item->piIC) &&
+                          (batch->baOutDir == NULL || MakeParentDirectories(item->piJob->bjOutFileBase)) &&
+                          CreateOutFile(&item->piIC.icOutSink, item->piIC.icOutFileBase, batch->baUseRTF, batch->baOverwriteFile));
+        if (item->piOK)
+            HoldOutFile(&item->piIC.icOutSink);
+        PushToStage(&pl->plToFormatter, item);
+    }
+    
+    PushToStage(&pl->plToFormatter, NULL);
+    return NULL;
+}
+
+// Formatter stage: convert each log into its held-back out sink, splitting big logs across threads, and charge the output to the budget
+void *RunPipelineFormatter(void *arg)
+{
+    Pipeline *pl = arg;
+    Batch *batch = pl->plBatch;
+    
+    PipelineItem *item;
+    while ((item = PopFromStage(&pl->plToFormatter)) != NULL)
+    {
+        if (item->piOK)
+        {
+            // A log that fails part of the way through still has its out file written, as with Convert_ichat(), so the writer stage
+            // is told by the job rather than by "piOK"
+            item->piJob->bjConverted = FormatLog(&item->piIC, batch->baUseRTF);
+            item->piJob->bjMessages = item->piIC.icMessageListArray.oSize;
+            item->piCharge += item->piIC.icOutSink.osUsed;
+            ChargePipeline(pl, item->piIC.icOutSink.osUsed);
+        }
+        PushToStage(&pl->plToWriter, item);
+    }
+    
+    PushToStage(&pl->plToWriter, NULL);
+    return NULL;
+}
+
+// Writer stage: take whichever converted logs are waiting, up to a group of them, and write them all out together, through an io_uring
+// if the system has one; then free each log and give its share of the budget back to the reader
+void *RunPipelineWriter(void *arg)
+{
+    Pipeline *pl = arg;
+    
+    IORing ring;
+    bool haveRing = InitIORing(&ring, PIPELINE_RING_SIZE);
+    
+    bool finished = false;
+    while (!finished)
+    {
+        PipelineItem *group[PIPELINE_GROUP_SIZE];
+        OutSink *sinks[PIPELINE_GROUP_SIZE];
+        int groupSize = 0, numSinks = 0;
+        
+        PipelineItem *item = PopFromStage(&pl->plToWriter);
+        while (item != NULL)
+        {
+            group[groupSize++] = item;
+            if (item->piOK)
+                sinks[numSinks++] = &item->piIC.icOutSink;
+            if (groupSize == PIPELINE_GROUP_SIZE || !TryPopFromStage(&pl->plToWriter, &item))
+                break;
+        }
+        finished = (item == NULL);
+        
+        WriteHeldOutFiles(haveRing ? &ring : NULL, sinks, numSinks);
+        for (int a = 0; a < groupSize; a++)
+        {
+            item = group[a];
+            BatchJob *job = item->piJob;
+            if (item->piOK)
+                job->bjConverted = FinishConvertedLog(&item->piIC, job->bjConverted);
+            else
+                job->bjConverted = false;
+            if (!job->bjConverted)
+                printf("Failed to convert \"%s\".\n", job->bjInPath);
+            
+            FreeICContext(&item->piIC);
+            FreeBPContext(&item->piBP);
+            CloseInFileRequest(&item->piInFile);
+            atomic_fetch_sub_explicit(&pl->plInflightBytes, item->piCharge, memory_order_release);
+            free(item);
+        }
+    }
+    
+    FreeIORing(&ring);
+    return NULL;
+}
+#pragma mark Stage queues
+// Put "item" at the back of "queue", waiting while the queue is full. Only the stage before the queue may call this.
+void PushToStage(StageQueue *queue, PipelineItem *item)
+{
+    uint64_t tail = atomic_load_explicit(&queue->sqTail, memory_order_relaxed);
+    
+    unsigned rounds = 0;
+    while (tail - atomic_load_explicit(&queue->sqHead, memory_order_acquire) == STAGE_QUEUE_SIZE)
+        WaitForStage(&rounds);
+    
+    queue->sqSlots[tail % STAGE_QUEUE_SIZE] = item;
+    atomic_store_explicit(&queue->sqTail, tail + 1, memory_order_release);
+}
+
+// Take the log at the front of "queue", waiting while the queue is empty. Only the stage after the queue may call this.
+PipelineItem *PopFromStage(StageQueue *queue)
+{
+    uint64_t head = atomic_load_explicit(&queue->sqHead, memory_order_relaxed);
+    
+    unsigned rounds = 0;
+    while (atomic_load_explicit(&queue->sqTail, memory_order_acquire) == head)
+        WaitForStage(&rounds);
+    
+    PipelineItem *item = queue->sqSlots[head % STAGE_QUEUE_SIZE];
+    atomic_store_explicit(&queue->sqHead, head + 1, memory_order_release);
+    return item;
+}
+
+// Take the log at the front of "queue" into "item" if there is one, without waiting. Only the stage after the queue may call this.
+bool TryPopFromStage(StageQueue *queue, PipelineItem **item)
+{
+    uint64_t head = atomic_load_explicit(&queue->sqHead, memory_order_relaxed);
+    if (atomic_load_explicit(&queue->sqTail, memory_order_acquire) == head)
+        return false;
+    
+    *item = queue->sqSlots[head % STAGE_QUEUE_SIZE];
+    atomic_store_explicit(&queue->sqHead, head + 1, memory_order_release);
+    return true;
+}
+
+// Wait for another stage to catch up, giving up the processor at first and then sleeping for longer each round up to a millisecond,
+// so that a stage held up by a slow disk does not keep a core busy
+void WaitForStage(unsigned *rounds)
+{
+    if (*rounds < 16)
+        sched_yield();
+    else
+    {
+        long micros = 10L << (*rounds < 23 ? *rounds - 16 : 7);
+        struct timespec pause = {0, (micros > 1000 ? 1000 : micros) * 1000};
+        nanosleep(&pause, NULL);
+    }
+    (*rounds)++;
+}
+
+// Count "bytes" more against the pipeline's in-flight budget
+void ChargePipeline(Pipeline *pl, uint64_t bytes)
+{
+    atomic_fetch_add_explicit(&pl->plInflightBytes, bytes, memory_order_relaxed);
+}
@@ -0,0 +1,60 @@
+//
+//  Pipeline.h
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#ifndef Pipeline_h
+#define Pipeline_h
+
+#define STAGE_QUEUE_SIZE    8  // number of logs that can wait between two stages; must be a power of two
+#define PIPELINE_GROUP_SIZE 16 // most logs that the reader and writer stages hand to the kernel together
+#define PIPELINE_RING_SIZE  64 // number of operations that the io_uring of the reader or writer stage can queue at once
+
+// One log on its way through the pipeline. Each stage works on it in turn and passes it to the next, even if it has failed, so that the
+// writer stage can account for it and free it.
+typedef struct PipelineItem
+{
+    BatchJob     *piJob;    // the job in the batch that this log belongs to
+    InFileRequest piInFile; // the reading of the log from the disk, which owns the contents that "piBP" parses
+    BPContext     piBP;     // the bplist that the log is read from
+    ICContext     piIC;     // the log itself, which is written to an out sink held in memory until the writer stage
+    uint64_t      piCharge; // bytes of the pipeline's in-flight budget that the log is holding
+    bool          piOK;     // whether every stage so far has succeeded; once false, the remaining stages only pass the log along
+} PipelineItem;
+
+// A bounded queue between two stages. Only one thread puts logs in and only one takes them out, so each end is moved with an atomic
+// store alone. A stage that finds the queue after it full waits, which holds every stage before it to the pace of the slowest one.
+typedef struct StageQueue
+{
+    _Atomic uint64_t sqHead;    // number of logs taken out so far; only changed by the stage after the queue
+    char             sqPad[64]; // keeps the two ends on different cache lines
+    _Atomic uint64_t sqTail;    // number of logs put in so far; only changed by the stage before the queue
+    PipelineItem    *sqSlots[STAGE_QUEUE_SIZE]; // the logs waiting, at their count modulo the size; NULL marks the end of the run
+} StageQueue;
+
+// A run of a batch through the reader, decoder, formatter and writer stages, each on a thread of its own, so that one log can be read
+// from the disk while another is being converted and a third is being written
+typedef struct Pipeline
+{
+    Batch           *plBatch;         // the run that the pipeline is working through
+    StageQueue       plToDecoder;     // logs that have been read into memory
+    StageQueue       plToFormatter;   // logs that have been checked and loaded
+    StageQueue       plToWriter;      // logs that have been converted in memory
+    _Atomic uint64_t plInflightBytes; // bytes of logs and converted output held by the pipeline at the moment
+} Pipeline;
+
+bool          Convert_pipeline(Batch *batch);
+void          RunPipelineReader(Pipeline *pl);
+void         *RunPipelineDecoder(void *arg);
+void         *RunPipelineFormatter(void *arg);
+void         *RunPipelineWriter(void *arg);
+void          PushToStage(StageQueue *queue, PipelineItem *item);
+PipelineItem *PopFromStage(StageQueue *queue);
+bool          TryPopFromStage(StageQueue *queue, PipelineItem **item);
+void          WaitForStage(unsigned *rounds);
+void          ChargePipeline(Pipeline *pl, uint64_t bytes);
+
+#endif /* Pipeline_h */
@@ -0,0 +1,475 @@
+//
+//  TextConversion.c
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#include <stdbool.h> // bool
+#include <stdint.h>  // uint64_t
+#include <string.h>  // memcpy()
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h> // _mm_cmpeq_epi8()
+#endif
+#include "FileIO.h"
+#include "TextConversion.h"
+
+// Converters work through their input in pieces of this many bytes so that the worst-case output for a piece always fits in the out
+// file's buffer
+const size_t kConversionChunkSize = 16 * 1024;
+
+// Characters that RTF treats as markup, plus the newline, which has to be escaped to display as such
+const bool kRTFSpecialChars[256] =
+{
+    ['\n'] = true, ['{'] = true, ['}'] = true, ['\\'] = true
+};
+
+// Every pair of decimal digits from "00" to "99", so that numbers can be formatted two digits at a time
+const char kDigitPairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+#pragma mark Unicode helpers
+// Returns the code point of the UTF-8 sequence at "text", which is no longer than "end", and sets "seqLength" to the number of bytes
+// it takes up. Invalid or cut-off sequences come back as U+FFFD with a length of one byte.
+uint32_t DecodeUTF8(const char *text, const char *end, int *seqLength)
+{
+    const uint8_t *bytes = (const uint8_t *)text;
+    uint8_t lead = bytes[0];
+    uint32_t cp;
+    int length;
+    uint32_t minimum;
+    
+    *seqLength = 1;
+    if (lead < 0x80)
+        return lead;
+    else if (lead >= 0xC2 && lead <= 0xDF)
+    {
+        cp = lead & 0x1F;
+        length = 2;
+        minimum = 0x80;
+    }
+    else if (lead >= 0xE0 && lead <= 0xEF)
+    {
+        cp = lead & 0x0F;
+        length = 3;
+        minimum = 0x800;
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4)
+    {
+        cp = lead & 0x07;
+        length = 4;
+        minimum = 0x10000;
+    }
+    else
+        return REPLACEMENT_CHAR;
+    
+    if (end - text < length)
+        return REPLACEMENT_CHAR;
+    for (int a = 1; a < length; a++)
+    {
+        if ((bytes[a] & 0xC0) != 0x80)
+            return REPLACEMENT_CHAR;
+        cp = (cp << 6) | (bytes[a] & 0x3F);
+    }
+    if (cp < minimum || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF))
+        return REPLACEMENT_CHAR;
+    
+    *seqLength = length;
+    return cp;
+}
+
+// Writes code point "cp" to "writer" as UTF-8 and returns the end of what was written
+char *EncodeUTF8(uint32_t cp, char *writer)
+{
+    if (cp < 0x80) // 7 bits or less, so we have a standard ASCII byte; just save it
+        *writer++ = (char)cp;
+    else if (cp < 0x800) // no more than 11 bits, so we can fit the Unicode into two bytes of 5 + 6 bits
+    {
+        *writer++ = (char)(0xC0 | (cp >> 6));   // add b110xxxxx to upper five bits
+        *writer++ = (char)(0x80 | (cp & 0x3F)); // add b10xxxxxx to lower six bits
+    }
+    else if (cp < 0x10000) // no more than 16 bits, so we can fit it in 4 + 6 + 6 bits
+    {
+        *writer++ = (char)(0xE0 | (cp >> 12));         // add b1110xxxx to upper four bits
+        *writer++ = (char)(0x80 | ((cp >> 6) & 0x3F)); // add b10xxxxxx to next six bits
+        *writer++ = (char)(0x80 | (cp & 0x3F));        // add b10xxxxxx to final six bits
+    }
+    else // no more than 21 bits, 3 + 6 + 6 + 6
+    {
+        *writer++ = (char)(0xF0 | (cp >> 18));          // add b11110xxx to upper three bits
+        *writer++ = (char)(0x80 | ((cp >> 12) & 0x3F)); // add b10xxxxxx to next six bits
+        *writer++ = (char)(0x80 | ((cp >> 6) & 0x3F));  // add b10xxxxxx to next six bits
+        *writer++ = (char)(0x80 | (cp & 0x3F));         // add b10xxxxxx to final six bits
+    }
+    return writer;
+}
+
+// Writes UTF-16 code unit "unit" to "writer" as RTF Unicode markup and returns the end of what was written. RTF stores the unit as a
+// signed 16-bit number, e.g. 0x2019 => "\uc0\u8217 " and 0xFFFD => "\uc0\u-3 ".
+char *WriteRTFUnicodeEscape(uint16_t unit, char *writer)
+{
+    memcpy(writer, "\\uc0\\u", 6);
+    writer += 6;
+    
+    int value = (int16_t)unit;
+    if (value < 0)
+    {
+        *writer++ = '-';
+        value = -value;
+    }
+    
+    // Work out how many digits the value has, then fill them in from the right, two at a time
+    int numDigits = (value >= 10000 ? 5 : value >= 1000 ? 4 : value >= 100 ? 3 : value >= 10 ? 2 : 1);
+    char *digit = writer + numDigits;
+    while (value >= 100)
+    {
+        digit -= 2;
+        memcpy(digit, &kDigitPairs[(value % 100) * 2], 2);
+        value /= 100;
+    }
+    if (value >= 10)
+        memcpy(digit - 2, &kDigitPairs[value * 2], 2);
+    else
+        *(digit - 1) = (char)('0' + value);
+    writer += numDigits;
+    
+    *writer++ = ' ';
+    return writer;
+}
+
+// Writes code point "cp" to "writer" as RTF Unicode markup, using a surrogate pair for characters outside of the BMP, and returns the
+// end of what was written
+char *WriteRTFCodePoint(uint32_t cp, char *writer)
+{
+    if (cp < 0x10000)
+        return WriteRTFUnicodeEscape((uint16_t)cp, writer);
+    
+    cp -= 0x10000;
+    writer = WriteRTFUnicodeEscape((uint16_t)(0xD800 + (cp >> 10)), writer);
+    return WriteRTFUnicodeEscape((uint16_t)(0xDC00 + (cp & 0x3FF)), writer);
+}
+
+#pragma mark RTF escaping
+// Writes "length" bytes of UTF-8 "text" to "writer", putting a backslash in front of each curly brace, backslash and newline and
+// turning anything outside of ASCII into RTF Unicode markup. "writer" must have room for RTF_ESCAPE_MAX_GROWTH times "length" bytes
+// plus the width of one vector. Returns the end of what was written.
+char *EscapeRTFIntoBuffer(const char *text, size_t length, char *writer)
+{
+    const char *end = text + length;
+    
+    // Compare a vector of text at a time against each special character; the sign bit of each byte flags anything outside of ASCII.
+    // Clean vectors are copied as they are; otherwise the clean part of the vector is kept and the first special character is
+    // escaped. The whole vector is stored either way, since anything past the clean part is overwritten by what follows.
+#if defined(__AVX2__)
+    const __m256i openBrace32 = _mm256_set1_epi8('{'), closeBrace32 = _mm256_set1_epi8('}');
+    const __m256i backslash32 = _mm256_set1_epi8('\\'), newline32 = _mm256_set1_epi8('\n');
+    while (end - text >= 32)
+    {
+        __m256i chars = _mm256_loadu_si256((const __m256i *)text);
+        __m256i special = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(chars, openBrace32), _mm256_cmpeq_epi8(chars, closeBrace32)),
+                                          _mm256_or_si256(_mm256_cmpeq_epi8(chars, backslash32), _mm256_cmpeq_epi8(chars, newline32)));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(special, chars));
+        _mm256_storeu_si256((__m256i *)writer, chars);
+        if (mask == 0)
+        {
+            text += 32;
+            writer += 32;
+            continue;
+        }
+        int clean = __builtin_ctz(mask);
+        text += clean;
+        writer += clean;
+        writer = EscapeRTFChar(&text, end, writer);
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+    const __m128i openBrace = _mm_set1_epi8('{'), closeBrace = _mm_set1_epi8('}');
+    const __m128i backslash = _mm_set1_epi8('\\'), newline = _mm_set1_epi8('\n');
+    while (end - text >= 16)
+    {
+        __m128i chars = _mm_loadu_si128((const __m128i *)text);
+        __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chars, openBrace), _mm_cmpeq_epi8(chars, closeBrace)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(chars, backslash), _mm_cmpeq_epi8(chars, newline)));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(special, chars));
+        _mm_storeu_si128((__m128i *)writer, chars);
+        if (mask == 0)
+        {
+            text += 16;
+            writer += 16;
+            continue;
+        }
+        int clean = __builtin_ctz(mask);
+        text += clean;
+        writer += clean;
+        writer = EscapeRTFChar(&text, end, writer);
+    }
+#endif
+    
+    // Finish off whatever is too short for a vector, or all of the text if vectors aren't available
+    while (text < end)
+    {
+        if (kRTFSpecialChars[(uint8_t)*text] || (uint8_t)*text >= 0x80)
+            writer = EscapeRTFChar(&text, end, writer);
+        else
+            *writer++ = *text++;
+    }
+    
+    return writer;
+}
+
+// Writes the markup for the special character or UTF-8 sequence at "*text" to "writer", moves "*text" past it, and returns the end of
+// what was written
+char *EscapeRTFChar(const char **text, const char *end, char *writer)
+{
+    if ((uint8_t)**text < 0x80)
+    {
+        *writer++ = '\\';
+        *writer++ = *(*text)++;
+        return writer;
+    }
+    
+    int seqLength;
+    uint32_t cp = DecodeUTF8(*text, end, &seqLength);
+    *text += seqLength;
+    return WriteRTFCodePoint(cp, writer);
+}
+
+// Append UTF-8 "text" to the out file of "sink" with curly braces, backslashes and newlines escaped for RTF and anything outside of
+// ASCII written as RTF Unicode markup, in a single pass over the text
+void AppendRTFEscapedToOutFile(OutSink *sink, const char *text, size_t length)
+{
+    const char *end = text + length;
+    while (text < end)
+    {
+        // Don't split a UTF-8 sequence between pieces
+        size_t chunk = (size_t)(end - text);
+        if (chunk > kConversionChunkSize)
+        {
+            chunk = kConversionChunkSize;
+            while (chunk > 0 && ((uint8_t)text[chunk] & 0xC0) == 0x80)
+                chunk--;
+            if (chunk == 0)
+                chunk = kConversionChunkSize;
+        }
+        
+        char *start = ReserveOutFileSpace(sink, (chunk * RTF_ESCAPE_MAX_GROWTH) + 32);
+        char *written = EscapeRTFIntoBuffer(text, chunk, start);
+        CommitOutFileSpace(sink, (size_t)(written - start));
+        text += chunk;
+    }
+}
+
+// Writes "numUnits" UTF-16BE code units from "utf16" to "writer" as RTF. ASCII characters are written as they are, with curly
+// braces, backslashes and newlines escaped; everything else becomes RTF Unicode markup, one "\u" per code unit, which is how RTF
+// expects characters above U+FFFF to be written. Unpaired surrogates are replaced with U+FFFD and null characters are skipped.
+// "writer" must have room for RTF_UNICODE_ESCAPE_SIZE bytes per code unit. Returns the end of what was written.
+char *EscapeUTF16ForRTFIntoBuffer(const char *utf16, size_t numUnits, char *writer)
+{
+    const uint8_t *reader = (const uint8_t *)utf16;
+    const uint8_t *end = reader + (numUnits * 2);
+    
+    // Pack runs of ASCII down a vector at a time as TranscodeUTF16ToUTF8IntoBuffer() does, then look for special characters among
+    // the packed bytes. The clean part of the run is kept and the first unit that needs escaping is handled one at a time below.
+#if defined(__AVX2__) || defined(__SSE2__)
+    const __m128i nonASCII = _mm_set1_epi16((short)0x80FF);
+    const __m128i openBrace = _mm_set1_epi8('{'), closeBrace = _mm_set1_epi8('}');
+    const __m128i backslash = _mm_set1_epi8('\\'), newline = _mm_set1_epi8('\n');
+#endif
+    while (reader < end)
+    {
+#if defined(__AVX2__)
+        if (end - reader >= 32)
+        {
+            __m256i units = _mm256_loadu_si256((const __m256i *)reader);
+            if (_mm256_testz_si256(units, _mm256_set1_epi16((short)0x80FF)))
+            {
+                __m256i packed = _mm256_packus_epi16(_mm256_srli_epi16(units, 8), _mm256_setzero_si256());
+                __m128i chars = _mm256_castsi256_si128(_mm256_permute4x64_epi64(packed, 0xD8));
+                __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chars, openBrace), _mm_cmpeq_epi8(chars, closeBrace)),
+                                               _mm_or_si128(_mm_cmpeq_epi8(chars, backslash), _mm_cmpeq_epi8(chars, newline)));
+                special = _mm_or_si128(special, _mm_cmpeq_epi8(chars, _mm_setzero_si128()));
+                uint32_t mask = (uint32_t)_mm_movemask_epi8(special);
+                _mm_storeu_si128((__m128i *)writer, chars);
+                int clean = (mask == 0 ? 16 : __builtin_ctz(mask));
+                reader += clean * 2;
+                writer += clean;
+                if (mask == 0)
+                    continue;
+            }
+        }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+        if (end - reader >= 16)
+        {
+            __m128i units = _mm_loadu_si128((const __m128i *)reader);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(units, nonASCII), _mm_setzero_si128())) == 0xFFFF)
+            {
+                __m128i chars = _mm_packus_epi16(_mm_srli_epi16(units, 8), _mm_setzero_si128());
+                __m128i special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chars, openBrace), _mm_cmpeq_epi8(chars, closeBrace)),
+                                               _mm_or_si128(_mm_cmpeq_epi8(chars, backslash), _mm_cmpeq_epi8(chars, newline)));
+                special = _mm_or_si128(special, _mm_cmpeq_epi8(chars, _mm_setzero_si128()));
+                uint32_t mask = (uint32_t)_mm_movemask_epi8(special) & 0xFF;
+                _mm_storel_epi64((__m128i *)writer, chars);
+                int clean = (mask == 0 ? 8 : __builtin_ctz(mask));
+                reader += clean * 2;
+                writer += clean;
+                if (mask == 0)
+                    continue;
+            }
+        }
+#endif
+        if (reader == end)
+            break;
+        
+        uint32_t unit = ((uint32_t)reader[0] << 8) | reader[1];
+        reader += 2;
+        if (unit < 0x80)
+        {
+            // Escape curly braces and backslashes to avoid breaking RTF markup. Escape newlines to make them display as such.
+            if (kRTFSpecialChars[unit])
+                *writer++ = '\\';
+            if (unit != 0)
+                *writer++ = (char)unit;
+        }
+        else if (unit >= 0xD800 && unit <= 0xDFFF)
+        {
+            // Keep a surrogate pair as it is, as two escapes
+            uint32_t nextUnit = (end - reader >= 2 ? ((uint32_t)reader[0] << 8) | reader[1] : 0);
+            if (unit <= 0xDBFF && nextUnit >= 0xDC00 && nextUnit <= 0xDFFF)
+            {
+                writer = WriteRTFUnicodeEscape((uint16_t)unit, writer);
+                writer = WriteRTFUnicodeEscape((uint16_t)nextUnit, writer);
+                reader += 2;
+            }
+            else
+                writer = WriteRTFUnicodeEscape(REPLACEMENT_CHAR, writer);
+        }
+        else
+            writer = WriteRTFUnicodeEscape((uint16_t)unit, writer);
+    }
+    
+    return writer;
+}
+
+// Append "numUnits" UTF-16BE code units from "utf16" to the out file of "sink" as RTF
+void AppendUTF16AsRTFToOutFile(OutSink *sink, const char *utf16, size_t numUnits)
+{
+    while (numUnits > 0)
+    {
+        // Don't split a surrogate pair between pieces
+        size_t chunk = (numUnits < kConversionChunkSize ? numUnits : kConversionChunkSize);
+        if (chunk < numUnits && ((uint8_t)utf16[(chunk - 1) * 2] & 0xFC) == 0xD8)
+            chunk++;
+        
+        char *start = ReserveOutFileSpace(sink, chunk * RTF_UNICODE_ESCAPE_SIZE);
+        char *written = EscapeUTF16ForRTFIntoBuffer(utf16, chunk, start);
+        CommitOutFileSpace(sink, (size_t)(written - start));
+        utf16 += chunk * 2;
+        numUnits -= chunk;
+    }
+}
+
+#pragma mark UTF-16 conversion
+// Writes "numUnits" UTF-16BE code units from "utf16" to "writer" as UTF-8, combining surrogate pairs into a single character and
+// replacing unpaired surrogates with U+FFFD. "writer" must have room for 3 bytes per code unit. Returns the end of what was written.
+char *TranscodeUTF16ToUTF8IntoBuffer(const char *utf16, size_t numUnits, char *writer)
+{
+    const uint8_t *reader = (const uint8_t *)utf16;
+    const uint8_t *end = reader + (numUnits * 2);
+    
+    // Runs of ASCII are common even in Unicode messages, so pack them down a vector at a time. A unit is ASCII if its high byte and
+    // the top bit of its low byte are clear; loaded as little-endian 16-bit lanes, that means that (lane & 0x80FF) is zero. Shifting
+    // each lane right by 8 then leaves the ASCII byte in the bottom of the lane, ready to be packed.
+#if defined(__AVX2__)
+    const __m256i nonASCII32 = _mm256_set1_epi16((short)0x80FF);
+    while (end - reader >= 32)
+    {
+        __m256i units = _mm256_loadu_si256((const __m256i *)reader);
+        if (!_mm256_testz_si256(units, nonASCII32))
+            break;
+        __m256i packed = _mm256_packus_epi16(_mm256_srli_epi16(units, 8), _mm256_setzero_si256());
+        packed = _mm256_permute4x64_epi64(packed, 0xD8); // packus works within each 128-bit lane, so bring the two halves together
+        _mm_storeu_si128((__m128i *)writer, _mm256_castsi256_si128(packed));
+        reader += 32;
+        writer += 16;
+    }
+#endif
+    while (reader < end)
+    {
+#if defined(__AVX2__) || defined(__SSE2__)
+        const __m128i nonASCII = _mm_set1_epi16((short)0x80FF);
+        if (end - reader >= 16)
+        {
+            __m128i units = _mm_loadu_si128((const __m128i *)reader);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(units, nonASCII), _mm_setzero_si128())) == 0xFFFF)
+            {
+                __m128i packed = _mm_packus_epi16(_mm_srli_epi16(units, 8), _mm_setzero_si128());
+                _mm_storel_epi64((__m128i *)writer, packed);
+                reader += 16;
+                writer += 8;
+                continue;
+            }
+        }
+#endif
+        uint32_t unit = ((uint32_t)reader[0] << 8) | reader[1];
+        reader += 2;
+        if (unit >= 0xD800 && unit <= 0xDFFF)
+        {
+            // A high surrogate followed by a low one makes up a single character above U+FFFF
+            uint32_t nextUnit = (end - reader >= 2 ? ((uint32_t)reader[0] << 8) | reader[1] : 0);
+            if (unit <= 0xDBFF && nextUnit >= 0xDC00 && nextUnit <= 0xDFFF)
+            {
+                unit = 0x10000 + ((unit - 0xD800) << 10) + (nextUnit - 0xDC00);
+                reader += 2;
+            }
+            else
+                unit = REPLACEMENT_CHAR;
+        }
+        writer = EncodeUTF8(unit, writer);
+    }
+    
+    return writer;
+}
+
+// Append "numUnits" UTF-16BE code units from "utf16" to the out file of "sink" as UTF-8
+void AppendUTF16AsUTF8ToOutFile(OutSink *sink, const char *utf16, size_t numUnits)
+{
+    while (numUnits > 0)
+    {
+        // Don't split a surrogate pair between pieces
+        size_t chunk = (numUnits < kConversionChunkSize ? numUnits : kConversionChunkSize);
+        if (chunk < numUnits && ((uint8_t)utf16[(chunk - 1) * 2] & 0xFC) == 0xD8)
+            chunk++;
+        
+        char *start = ReserveOutFileSpace(sink, chunk * 3);
+        char *written = TranscodeUTF16ToUTF8IntoBuffer(utf16, chunk, start);
+        CommitOutFileSpace(sink, (size_t)(written - start));
+        utf16 += chunk * 2;
+        numUnits -= chunk;
+    }
+}
+
+// Removes the invisible marks that set the direction of text, such as LEFT-TO-RIGHT EMBEDDING (U+202A) and POP DIRECTIONAL
+// FORMATTING (U+202C), from the "length" bytes of UTF-8 "text", and returns the new length
+size_t RemoveDirectionalMarks(char *text, size_t length)
+{
+    char *writer = text;
+    for (size_t a = 0; a < length; a++)
+    {
+        // U+200E, U+200F and U+202A through U+202E are all encoded as 0xE2 0x80 followed by one byte
+        if (a + 2 < length && (uint8_t)text[a] == 0xE2 && (uint8_t)text[a + 1] == 0x80)
+        {
+            uint8_t last = (uint8_t)text[a + 2];
+            if (last == 0x8E || last == 0x8F || (last >= 0xAA && last <= 0xAE))
+            {
+                a += 2;
+                continue;
+            }
+        }
+        *writer++ = text[a];
+    }
+    return (size_t)(writer - text);
+}
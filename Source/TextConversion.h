@@ -0,0 +1,29 @@
+//
+//  TextConversion.h
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#ifndef TextConversion_h
+#define TextConversion_h
+
+#define REPLACEMENT_CHAR        0xFFFD // stands in for text that can't be decoded
+#define RTF_ESCAPE_MAX_GROWTH   9      // most bytes of RTF that one byte of UTF-8 can turn into (an invalid byte becomes "\uc0\u-3 ")
+#define RTF_UNICODE_ESCAPE_SIZE 13     // most bytes of RTF that one UTF-16 code unit can turn into, e.g. "\uc0\u-32768 "
+
+uint32_t DecodeUTF8(const char *text, const char *end, int *seqLength);
+char    *EncodeUTF8(uint32_t cp, char *writer);
+char    *WriteRTFUnicodeEscape(uint16_t unit, char *writer);
+char    *WriteRTFCodePoint(uint32_t cp, char *writer);
+char    *EscapeRTFIntoBuffer(const char *text, size_t length, char *writer);
+char    *EscapeRTFChar(const char **text, const char *end, char *writer);
+void     AppendRTFEscapedToOutFile(OutSink *sink, const char *text, size_t length);
+char    *EscapeUTF16ForRTFIntoBuffer(const char *utf16, size_t numUnits, char *writer);
+void     AppendUTF16AsRTFToOutFile(OutSink *sink, const char *utf16, size_t numUnits);
+char    *TranscodeUTF16ToUTF8IntoBuffer(const char *utf16, size_t numUnits, char *writer);
+void     AppendUTF16AsUTF8ToOutFile(OutSink *sink, const char *utf16, size_t numUnits);
+size_t   RemoveDirectionalMarks(char *text, size_t length);
+
+#endif /* TextConversion_h */
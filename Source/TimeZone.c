@@ -0,0 +1,381 @@
+//
+//  TimeZone.c
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#include <stdbool.h> // bool
+#include <stdint.h>  // int64_t
+#include <stdio.h>   // printf()
+#include <stdlib.h>  // realloc()
+#include <string.h>  // memcmp()
+#include "FileIO.h"
+#include "bplistReader.h"
+#include "TimeZone.h"
+
+const int kTZifHeaderSize = 44; // "TZif", the version, 15 reserved bytes and six 4-byte counts
+
+#pragma mark Zone management
+// Set up "tz" with no transitions and no offset
+void InitTimeZone(TimeZone *tz)
+{
+    tz->tzTransitions = NULL;
+    tz->tzOffsets = NULL;
+    tz->tzNumTransitions = 0;
+    tz->tzCapacity = 0;
+    tz->tzInitialOffset = 0;
+}
+
+// Free the transitions of "tz"
+void FreeTimeZone(TimeZone *tz)
+{
+    free(tz->tzTransitions);
+    free(tz->tzOffsets);
+    InitTimeZone(tz);
+}
+
+// Load the zone "name", which is either a name in the zoneinfo database such as "America/New_York" or the full path to a TZif file,
+// into "tz", spelling out its yearly rule into transitions up to LAST_ZONE_YEAR. Returns false after printing an error if it can't.
+bool LoadTimeZone(TimeZone *tz, const char *name)
+{
+    InitTimeZone(tz);
+    
+    char *path = NULL;
+    if (name[0] == '/')
+        asprintf(&path, "%s", name); // freed below
+    else
+        asprintf(&path, "%s/%s", ZONEINFO_DIR, name); // freed below
+    if (path == NULL)
+    {
+        printf("Fatal error: Memory allocation failed.\n");
+        return false;
+    }
+    
+    char *contents = NULL;
+    size_t length = 0;
+    bool loaded = LoadInFile(path, &contents, &length);
+    if (loaded && !ParseTZif(tz, contents, length))
+    {
+        printf("Fatal error: \"%s\" is not a time zone file that can be read.\n", path);
+        FreeTimeZone(tz);
+        loaded = false;
+    }
+    else if (!loaded)
+        printf("Fatal error: Could not load time zone \"%s\".\n", name);
+    
+    if (contents != NULL)
+        CloseInFile(&contents, &length);
+    free(path);
+    return loaded;
+}
+
+// Read the TZif file of "length" bytes at "data" into "tz". Files of version 2 and later are read from their second part, which has
+// 64-bit times, and the rule at their end is used for the years after the last transition that they list. Returns false if the file is
+// malformed or memory ran out.
+bool ParseTZif(TimeZone *tz, const char *data, size_t length)
+{
+    if (length < (size_t)kTZifHeaderSize || memcmp(data, "TZif", 4))
+        return false;
+    
+    // The counts of each part of the data, as given in the header, and the size of the data that they add up to
+    const char *header = data;
+    int timeSize = 4;
+    uint64_t isUTCCount, isStdCount, leapCount, timeCount, typeCount, charCount, dataSize;
+    for (int part = 1; part <= 2; part++)
+    {
+        isUTCCount = ReadUInt_4Byte((char *)header + 20);
+        isStdCount = ReadUInt_4Byte((char *)header + 24);
+        leapCount = ReadUInt_4Byte((char *)header + 28);
+        timeCount = ReadUInt_4Byte((char *)header + 32);
+        typeCount = ReadUInt_4Byte((char *)header + 36);
+        charCount = ReadUInt_4Byte((char *)header + 40);
+        dataSize = timeCount * (uint64_t)timeSize + timeCount + typeCount * 6 + charCount + leapCount * (uint64_t)(timeSize + 4) +
+                   isStdCount + isUTCCount;
+        if ((uint64_t)(header - data) + (uint64_t)kTZifHeaderSize + dataSize > length)
+            return false;
+        
+        // A version 1 file has only the first part; later versions repeat the header and data with 64-bit times
+        if (part == 2 || data[4] < '2')
+            break;
+        header += kTZifHeaderSize + dataSize;
+        if ((uint64_t)(header - data) + (uint64_t)kTZifHeaderSize > length || memcmp(header, "TZif", 4))
+            return false;
+        timeSize = 8;
+    }
+    if (typeCount == 0)
+        return false;
+    
+    const char *times = header + kTZifHeaderSize;
+    const char *typeIndices = times + timeCount * (uint64_t)timeSize;
+    const char *types = typeIndices + timeCount;
+    
+    // Times before the first transition use the first local time type
+    tz->tzInitialOffset = (int32_t)ReadUInt_4Byte((char *)types);
+    for (uint64_t a = 0; a < timeCount; a++)
+    {
+        int64_t when;
+        if (timeSize == 8)
+            when = (int64_t)ReadUInt_8Byte((char *)times + a * 8);
+        else
+            when = (int32_t)ReadUInt_4Byte((char *)times + a * 4);
+        uint8_t typeIndex = (uint8_t)typeIndices[a];
+        if (typeIndex >= typeCount || (a > 0 && when <= tz->tzTransitions[tz->tzNumTransitions - 1]))
+            return false;
+        if (!AddZoneTransition(tz, when, (int32_t)ReadUInt_4Byte((char *)types + typeIndex * 6)))
+            return false;
+    }
+    
+    // The rule comes after the data, between newlines; a file without a rule keeps the last offset for ever
+    const char *footer = header + kTZifHeaderSize + dataSize;
+    if (timeSize == 4 || footer >= data + length || *footer != '\n')
+        return true;
+    const char *footerEnd = memchr(footer + 1, '\n', (size_t)(data + length - footer - 1));
+    if (footerEnd == NULL || footerEnd == footer + 1)
+        return true;
+    
+    char rule[256];
+    if (footerEnd - footer - 1 >= (long)sizeof(rule))
+        return true;
+    memcpy(rule, footer + 1, (size_t)(footerEnd - footer - 1));
+    rule[footerEnd - footer - 1] = '\0';
+    ZoneRule zr;
+    if (!ParseZoneRule(rule, &zr))
+        return true;
+    
+    return ExtendZoneTransitions(tz, &zr);
+}
+
+// Add a transition at "when" to offset "offset" to the end of the table of "tz"
+bool AddZoneTransition(TimeZone *tz, int64_t when, int32_t offset)
+{
+    if (tz->tzNumTransitions == tz->tzCapacity)
+    {
+        uint64_t capacity = (tz->tzCapacity == 0 ? 256 : tz->tzCapacity * 2);
+        int64_t *transitions = realloc(tz->tzTransitions, (size_t)capacity * sizeof(int64_t)); // freed with FreeTimeZone()
+        if (transitions == NULL)
+            return false;
+        tz->tzTransitions = transitions;
+        int32_t *offsets = realloc(tz->tzOffsets, (size_t)capacity * sizeof(int32_t)); // freed with FreeTimeZone()
+        if (offsets == NULL)
+            return false;
+        tz->tzOffsets = offsets;
+        tz->tzCapacity = capacity;
+    }
+    
+    tz->tzTransitions[tz->tzNumTransitions] = when;
+    tz->tzOffsets[tz->tzNumTransitions] = offset;
+    tz->tzNumTransitions++;
+    return true;
+}
+#pragma mark POSIX TZ rules
+// Read a rule of the form "std offset [dst [offset] [,start[/time],end[/time]]]" into "zr". Returns false if the rule is malformed or
+// names daylight saving time without saying when it starts and ends.
+bool ParseZoneRule(const char *rule, ZoneRule *zr)
+{
+    // POSIX offsets are the amount to add to local time to get UTC, so they are the other way round from the offsets in the table
+    int32_t offset;
+    rule = ParseZoneName(rule);
+    if (rule == NULL || (rule = ParseZoneTime(rule, &offset)) == NULL)
+        return false;
+    zr->zrStdOffset = -offset;
+    zr->zrHasDst = false;
+    if (*rule == '\0')
+        return true;
+    
+    // Daylight saving time is an hour ahead of standard time unless it says otherwise
+    if ((rule = ParseZoneName(rule)) == NULL)
+        return false;
+    zr->zrDstOffset = zr->zrStdOffset + 60 * 60;
+    if (*rule != ',' && *rule != '\0')
+    {
+        if ((rule = ParseZoneTime(rule, &offset)) == NULL)
+            return false;
+        zr->zrDstOffset = -offset;
+    }
+    if (*rule++ != ',' || (rule = ParseZoneRuleDate(rule, &zr->zrStart)) == NULL)
+        return false;
+    if (*rule++ != ',' || (rule = ParseZoneRuleDate(rule, &zr->zrEnd)) == NULL)
+        return false;
+    
+    zr->zrHasDst = true;
+    return (*rule == '\0');
+}
+
+// Skip the name of a zone at the start of "rule", which is either letters or anything between '<' and '>', returning where the name
+// ends, or NULL if there is no name
+const char *ParseZoneName(const char *rule)
+{
+    const char *start = rule;
+    if (*rule == '<')
+    {
+        while (*rule != '\0' && *rule != '>')
+            rule++;
+        return (*rule == '>' ? rule + 1 : NULL);
+    }
+    
+    while ((*rule >= 'A' && *rule <= 'Z') || (*rule >= 'a' && *rule <= 'z'))
+        rule++;
+    return (rule > start ? rule : NULL);
+}
+
+// Read a time of the form "[+|-]hh[:mm[:ss]]" at the start of "rule" into "seconds", returning where it ends, or NULL if malformed
+const char *ParseZoneTime(const char *rule, int32_t *seconds)
+{
+    int sign = 1;
+    if (*rule == '+' || *rule == '-')
+        sign = (*rule++ == '-' ? -1 : 1);
+    
+    int32_t total = 0;
+    for (int part = 0; part < 3; part++)
+    {
+        if (part > 0 && *rule != ':')
+            break;
+        if (part > 0)
+            rule++;
+        if (*rule < '0' || *rule > '9')
+            return NULL;
+        int value = 0;
+        while (*rule >= '0' && *rule <= '9' && value < 1000)
+            value = value * 10 + (*rule++ - '0');
+        total += value * (part == 0 ? 60 * 60 : (part == 1 ? 60 : 1));
+    }
+    
+    *seconds = sign * total;
+    return rule;
+}
+
+// Read a date of the form "Jn", "n" or "Mm.w.d", followed by an optional "/time", at the start of "rule" into "date", returning where
+// it ends, or NULL if it is malformed. The time of day is 02:00:00 unless it says otherwise.
+const char *ParseZoneRuleDate(const char *rule, ZoneRuleDate *date)
+{
+    int *fields[3] = {&date->zdMonth, &date->zdWeek, &date->zdWeekday};
+    int numFields = 1;
+    date->zdForm = 'D';
+    if (*rule == 'J' || *rule == 'M')
+        date->zdForm = *rule++;
+    if (date->zdForm == 'M')
+        numFields = 3;
+    else
+        fields[0] = &date->zdDay;
+    
+    for (int a = 0; a < numFields; a++)
+    {
+        if (a > 0 && *rule++ != '.')
+            return NULL;
+        if (*rule < '0' || *rule > '9')
+            return NULL;
+        *fields[a] = 0;
+        while (*rule >= '0' && *rule <= '9' && *fields[a] < 1000)
+            *fields[a] = *fields[a] * 10 + (*rule++ - '0');
+    }
+    if (date->zdForm == 'J' && (date->zdDay < 1 || date->zdDay > 365))
+        return NULL;
+    if (date->zdForm == 'D' && date->zdDay > 365)
+        return NULL;
+    if (date->zdForm == 'M' && (date->zdMonth < 1 || date->zdMonth > 12 || date->zdWeek < 1 || date->zdWeek > 5 || date->zdWeekday > 6))
+        return NULL;
+    
+    date->zdTime = 2 * 60 * 60;
+    if (*rule == '/')
+        rule = ParseZoneTime(rule + 1, &date->zdTime);
+    return rule;
+}
+
+// Spell out the daylight saving time of "zr" as transitions for each year from that of the last transition in "tz" up to
+// LAST_ZONE_YEAR, so that the offset of any moment can be found in the table
+bool ExtendZoneTransitions(TimeZone *tz, const ZoneRule *zr)
+{
+    int64_t last = (tz->tzNumTransitions > 0 ? tz->tzTransitions[tz->tzNumTransitions - 1] : INT64_MIN);
+    if (!zr->zrHasDst)
+    {
+        if (tz->tzNumTransitions == 0)
+            tz->tzInitialOffset = zr->zrStdOffset;
+        return true;
+    }
+    
+    int firstYear = 1970;
+    if (tz->tzNumTransitions > 0)
+    {
+        int month, day;
+        CivilFromDays(last / (24 * 60 * 60) - (last % (24 * 60 * 60) < 0 ? 1 : 0), &firstYear, &month, &day);
+    }
+    for (int year = firstYear; year <= LAST_ZONE_YEAR; year++)
+    {
+        // The start is given in standard time and the end in daylight saving time; in the southern hemisphere the end comes first
+        int64_t start = ReturnZoneRuleMoment(&zr->zrStart, year, zr->zrStdOffset);
+        int64_t end = ReturnZoneRuleMoment(&zr->zrEnd, year, zr->zrDstOffset);
+        int64_t moments[2] = {start, end};
+        int32_t offsets[2] = {zr->zrDstOffset, zr->zrStdOffset};
+        if (end < start)
+        {
+            moments[0] = end;
+            moments[1] = start;
+            offsets[0] = zr->zrStdOffset;
+            offsets[1] = zr->zrDstOffset;
+        }
+        
+        for (int a = 0; a < 2; a++)
+        {
+            if (moments[a] <= last)
+                continue;
+            if (!AddZoneTransition(tz, moments[a], offsets[a]))
+                return false;
+            last = moments[a];
+        }
+    }
+    
+    return true;
+}
+
+// Returns the moment, in seconds since 1970-01-01 UTC, at which "date" falls in "year", given that it is in local time with offset
+// "offset" from UTC
+int64_t ReturnZoneRuleMoment(const ZoneRuleDate *date, int year, int32_t offset)
+{
+    int64_t day = DaysFromCivil(year, 1, 1);
+    bool leapYear = ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0);
+    if (date->zdForm == 'J')
+        day += date->zdDay - 1 + (leapYear && date->zdDay >= 60 ? 1 : 0);
+    else if (date->zdForm == 'D')
+        day += date->zdDay;
+    else
+    {
+        // Find the first such weekday of the month, then go on by weeks, stepping back from week 5 if the month is too short for it
+        int64_t firstOfMonth = DaysFromCivil(year, date->zdMonth, 1);
+        int64_t nextMonth = (date->zdMonth == 12 ? DaysFromCivil(year + 1, 1, 1) : DaysFromCivil(year, date->zdMonth + 1, 1));
+        int firstWeekday = (int)(((firstOfMonth + 4) % 7 + 7) % 7); // 1970-01-01 was a Thursday
+        day = firstOfMonth + (date->zdWeekday - firstWeekday + 7) % 7 + (date->zdWeek - 1) * 7;
+        while (day >= nextMonth)
+            day -= 7;
+    }
+    
+    return day * 24 * 60 * 60 + date->zdTime - offset;
+}
+#pragma mark Looking up offsets
+// Returns the offset from UTC in seconds at "when", in seconds since 1970-01-01 UTC. "interval" remembers which stretch between two
+// transitions the last moment looked up fell in, so that a run of moments close together, as the messages of a log are, is answered
+// without searching; it must start at 0, and each thread needs one of its own.
+int32_t ReturnZoneOffset(const TimeZone *tz, int64_t when, uint64_t *interval)
+{
+    // Interval "i" runs from transition i - 1 up to transition i
+    uint64_t i = *interval;
+    bool outside = (i > tz->tzNumTransitions || (i > 0 && when < tz->tzTransitions[i - 1]));
+    if (outside || (i < tz->tzNumTransitions && when >= tz->tzTransitions[i]))
+    {
+        // Binary search for the number of transitions at or before "when"
+        uint64_t low = 0, high = tz->tzNumTransitions;
+        while (low < high)
+        {
+            uint64_t middle = low + (high - low) / 2;
+            if (tz->tzTransitions[middle] <= when)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        i = low;
+        *interval = i;
+    }
+    
+    return (i == 0 ? tz->tzInitialOffset : tz->tzOffsets[i - 1]);
+}
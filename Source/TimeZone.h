@@ -0,0 +1,61 @@
+//
+//  TimeZone.h
+//  Convert ichat Files
+//
+//  Created on 10/16/26.
+//  Copyright © 2026 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
+//
+
+#ifndef TimeZone_h
+#define TimeZone_h
+
+#define ZONEINFO_DIR   "/usr/share/zoneinfo" // where zone names given to LoadTimeZone() are looked for
+#define LAST_ZONE_YEAR 2100                  // the yearly rule at the end of a zone file is turned into transitions up to this year
+
+// The offsets from UTC of a time zone over the years, read once from its TZif file in the zoneinfo database into a table of the moments
+// at which the offset changes. Nothing in it is changed after LoadTimeZone(), so one zone can be shared by every thread.
+typedef struct TimeZone
+{
+    int64_t *tzTransitions;    // moments at which the offset changes, in seconds since 1970-01-01 UTC, in increasing order
+    int32_t *tzOffsets;        // offset from UTC in seconds that takes effect at each of "tzTransitions"
+    uint64_t tzNumTransitions; // number of entries in "tzTransitions" and "tzOffsets"
+    uint64_t tzCapacity;       // number of entries that "tzTransitions" and "tzOffsets" have room for
+    int32_t  tzInitialOffset;  // offset from UTC in seconds before the first transition
+} TimeZone;
+
+// A day of the year in a POSIX TZ rule, on which daylight saving time starts or ends
+typedef struct ZoneRuleDate
+{
+    char    zdForm;    // 'J' for "Jn" (1-365, never counting February 29), 'D' for "n" (0-365) or 'M' for "Mm.w.d"
+    int     zdDay;     // with 'J' or 'D', the day of the year
+    int     zdMonth;   // with 'M', the month, 1-12
+    int     zdWeek;    // with 'M', which week of the month, 1-5, where 5 means the last
+    int     zdWeekday; // with 'M', the day of the week, 0 (Sunday) to 6
+    int32_t zdTime;    // local time of day of the change, in seconds; may be negative or more than a day
+} ZoneRuleDate;
+
+// The POSIX TZ rule at the end of a TZif file, such as "EST5EDT,M3.2.0,M11.1.0", which gives the offsets after the last transition
+// listed in the file
+typedef struct ZoneRule
+{
+    int32_t      zrStdOffset; // offset from UTC in seconds in standard time
+    int32_t      zrDstOffset; // offset from UTC in seconds in daylight saving time
+    bool         zrHasDst;    // whether the zone has daylight saving time
+    ZoneRuleDate zrStart;     // when daylight saving time starts, in standard time
+    ZoneRuleDate zrEnd;       // when daylight saving time ends, in daylight saving time
+} ZoneRule;
+
+void        InitTimeZone(TimeZone *tz);
+void        FreeTimeZone(TimeZone *tz);
+bool        LoadTimeZone(TimeZone *tz, const char *name);
+bool        ParseTZif(TimeZone *tz, const char *data, size_t length);
+bool        AddZoneTransition(TimeZone *tz, int64_t when, int32_t offset);
+bool        ParseZoneRule(const char *rule, ZoneRule *zr);
+const char *ParseZoneName(const char *rule);
+const char *ParseZoneTime(const char *rule, int32_t *seconds);
+const char *ParseZoneRuleDate(const char *rule, ZoneRuleDate *date);
+bool        ExtendZoneTransitions(TimeZone *tz, const ZoneRule *zr);
+int64_t     ReturnZoneRuleMoment(const ZoneRuleDate *date, int year, int32_t offset);
+int32_t     ReturnZoneOffset(const TimeZone *tz, int64_t when, uint64_t *interval);
+
+#endif /* TimeZone_h */
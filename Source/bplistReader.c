@@ -7,12 +7,15 @@
 //
 
 #include <locale.h>  // setlocale()
-#include <math.h>    // pow()
+#include <math.h>    // floor()
 #include <stdbool.h> // bool
+#include <stdint.h>  // INT64_MIN
 #include <stdio.h>   // fprintf()
 #include <stdlib.h>  // malloc()
 #include <string.h>  // strcpy()
+#include <wchar.h>   // wint_t
 #include "bplistReader.h"
+#include "TimeZone.h"
 
 #pragma mark Globals
 // For reading binary plist header and trailer
@@ -27,66 +30,192 @@ const int   kNumObjOffset = 2;
 const int   kRootObjOffset = 10;
 const int   kOffsetTableOffsetOffset = 18;
 
-// For storing basic bplist information
-uint64_t  gRefSize = 0;
-uint64_t  gNumObj = 0;
-uint64_t  gRootObjID = 0;
-uint64_t *gOffsets = NULL;
-
-// For formatting output
-char *gUIDpad = NULL;         // formatting string for PrintObject() that will pad to the width of the largest UID
-int   gIndent = 0;            // how far to indent objects in browsing mode based on file's hierarchy
-bool  gPrintedSpaces = false; // used to prevent multiplied indentation when printing arrays and dicts
-
-extern bool  gFollowRefs;
-extern char *gInFileContents;
-extern long  gInFileLength;
+// For converting NSDates, which count from 2001-01-01
+const int64_t kDaysFrom1970To2001 = 11323;
 
 // Types of data that can be found in a bplist
 BPObjectType gTypeTable[] =
 {
-    //otEnum     otHighQuad otLowQuad otSizeType      otReadFunc              otPrintFunc              otName
-    {kTypeNone,           0,  0, kSizeNone,           NULL,                   NULL,                    ""},
-    {kTypeNull,           0,  0, kSizeNone,           ReadData_Null,          PrintData_Null,          "null"},
-    {kTypeBoolFalse,      0,  8, kSizeNone,           ReadData_BoolFalse,     PrintData_BoolFalse,     "boolean"},
-    {kTypeBoolTrue,       0,  9, kSizeNone,           ReadData_BoolTrue,      PrintData_BoolTrue,      "boolean"},
-    {kTypeFill,           0, 15, kSizeNone,           ReadData_Fill,          PrintData_Fill,          "fill"},
-    {kTypeInt,            1, -1, kSizePowerOfTwo,     ReadData_Int,           PrintData_Int,           "int"},
-    {kTypeReal,           2, -1, kSizePowerOfTwo,     ReadData_Real,          PrintData_Real,          "real"},
-    {kTypeDate,           3,  3, kSize8ByteFloat,     ReadData_Date,          PrintData_Date,          "date"},
-    {kTypeData,           4, -1, kSizeScalarOverflow, ReadData_Data,          PrintData_Data,          "data"},
-    {kTypeStringASCII,    5, -1, kSizeScalarOverflow, ReadData_StringASCII,   PrintData_StringASCII,   "string (ASCII)"},
-    {kTypeStringUnicode,  6, -1, kSizeScalarOverflow, ReadData_StringUnicode, PrintData_StringUnicode, "string (Unicode)"},
-    {kTypeUID,            8, -1, kSizeAddOne,         ReadData_UID,           PrintData_UID,           "UID"},
-    {kTypeArray,         10, -1, kSizeScalarOverflow, ReadData_Array,         PrintData_Array,         "array"},
-    {kTypeSet,           12, -1, kSizeScalarOverflow, ReadData_Set,           PrintData_Set,           "set"},
-    {kTypeDict,          13, -1, kSizeScalarOverflow, ReadData_Dict,          PrintData_Dict,          "dict"}
+    //otEnum              otReadFunc              otPrintFunc              otName
+    {kTypeNone,           NULL,                   NULL,                    ""},
+    {kTypeNull,           ReadData_Null,          PrintData_Null,          "null"},
+    {kTypeBoolFalse,      ReadData_BoolFalse,     PrintData_BoolFalse,     "boolean"},
+    {kTypeBoolTrue,       ReadData_BoolTrue,      PrintData_BoolTrue,      "boolean"},
+    {kTypeFill,           ReadData_Fill,          PrintData_Fill,          "fill"},
+    {kTypeInt,            ReadData_Int,           PrintData_Int,           "int"},
+    {kTypeReal,           ReadData_Real,          PrintData_Real,          "real"},
+    {kTypeDate,           ReadData_Date,          PrintData_Date,          "date"},
+    {kTypeData,           ReadData_Data,          PrintData_Data,          "data"},
+    {kTypeStringASCII,    ReadData_StringASCII,   PrintData_StringASCII,   "string (ASCII)"},
+    {kTypeStringUnicode,  ReadData_StringUnicode, PrintData_StringUnicode, "string (Unicode)"},
+    {kTypeUID,            ReadData_UID,           PrintData_UID,           "UID"},
+    {kTypeArray,          ReadData_Array,         PrintData_Array,         "array"},
+    {kTypeSet,            ReadData_Set,           PrintData_Set,           "set"},
+    {kTypeDict,           ReadData_Dict,          PrintData_Dict,          "dict"}
+};
+
+// Every possible marker byte, giving the type of the object that it starts and the size of the object's payload. The upper half of
+// the byte identifies the type, sometimes in league with the lower half; otherwise the lower half holds the size. Bytes that the
+// format doesn't use are left as kTypeNone.
+#define MarkerSize(sizeType, loQuad) ((sizeType) == kSizePowerOfTwo     ? 1 << (loQuad) : \
+                                      (sizeType) == kSize8ByteFloat     ? 8 :             \
+                                      (sizeType) == kSizeScalarOverflow ? (loQuad) :      \
+                                      (sizeType) == kSizeAddOne         ? (loQuad) + 1 : 0)
+#define Marker(type, sizeType, loQuad) {type, sizeType, MarkerSize(sizeType, loQuad)}
+#define MarkerRow(type, sizeType) \
+    Marker(type, sizeType, 0),  Marker(type, sizeType, 1),  Marker(type, sizeType, 2),  Marker(type, sizeType, 3),  \
+    Marker(type, sizeType, 4),  Marker(type, sizeType, 5),  Marker(type, sizeType, 6),  Marker(type, sizeType, 7),  \
+    Marker(type, sizeType, 8),  Marker(type, sizeType, 9),  Marker(type, sizeType, 10), Marker(type, sizeType, 11), \
+    Marker(type, sizeType, 12), Marker(type, sizeType, 13), Marker(type, sizeType, 14), Marker(type, sizeType, 15)
+const BPMarkerInfo gMarkerTable[256] =
+{
+    [0x00] = Marker(kTypeNull,      kSizeNone,       0),
+    [0x08] = Marker(kTypeBoolFalse, kSizeNone,       0),
+    [0x09] = Marker(kTypeBoolTrue,  kSizeNone,       0),
+    [0x0F] = Marker(kTypeFill,      kSizeNone,       0),
+    [0x10] = MarkerRow(kTypeInt,    kSizePowerOfTwo),
+    [0x20] = MarkerRow(kTypeReal,   kSizePowerOfTwo),
+    [0x33] = Marker(kTypeDate,      kSize8ByteFloat, 3),
+    [0x40] = MarkerRow(kTypeData,          kSizeScalarOverflow),
+    [0x50] = MarkerRow(kTypeStringASCII,   kSizeScalarOverflow),
+    [0x60] = MarkerRow(kTypeStringUnicode, kSizeScalarOverflow),
+    [0x80] = MarkerRow(kTypeUID,           kSizeAddOne),
+    [0xA0] = MarkerRow(kTypeArray,         kSizeScalarOverflow),
+    [0xC0] = MarkerRow(kTypeSet,           kSizeScalarOverflow),
+    [0xD0] = MarkerRow(kTypeDict,          kSizeScalarOverflow)
+};
+#undef MarkerRow
+#undef Marker
+#undef MarkerSize
+
+// Names of the keys in enum BPKeySymbol
+const char *gKeySymbolNames[kKeyCount] =
+{
+    [kKeyNone]                 = "",
+    [kKeyArchiveVersion]       = "$version",
+    [kKeyArchiveObjects]       = "$objects",
+    [kKeyArchiveTop]           = "$top",
+    [kKeyArchiveClass]         = "$class",
+    [kKeyMetadata]             = "metadata",
+    [kKeyNS_keys]              = "NS.keys",
+    [kKeyNS_objects]           = "NS.objects",
+    [kKeyNS_string]            = "NS.string",
+    [kKeyNS_time]              = "NS.time",
+    [kKeyStatusType]           = "StatusChatItemStatusType",
+    [kKeySubject]              = "Subject",
+    [kKeySender]               = "Sender",
+    [kKeyID]                   = "ID",
+    [kKeyTime]                 = "Time",
+    [kKeyMessageText]          = "MessageText",
+    [kKeyOriginalMessage]      = "OriginalMessage",
+    [kKeyNSString]             = "NSString",
+    [kKeyNSAttributeInfo]      = "NSAttributeInfo",
+    [kKeyNSAttributes]         = "NSAttributes",
+    [kKeyParticipants]         = "Participants",
+    [kKeyPresentityIDs]        = "PresentityIDs",
+    [kKeyFilenameAttribute]    = "__kIMFilenameAttributeName",
+    [kKeyBaseWritingDirection] = "BaseWritingDirection"
+};
+
+// Perfect hash of the names above, computed from a name's length and its first and last characters. The multipliers were chosen so
+// that no two known names land in the same slot; if a name is added, check that its KeySlot() is not already taken.
+#define KeySlotCount 64
+#define KeySlot(length, first, last) (((length) + (first) * 4 + (last) * 35) & (KeySlotCount - 1))
+const uint8_t gKeySymbolSlots[KeySlotCount] =
+{
+    [KeySlot( 8, '$', 'n')] = kKeyArchiveVersion,
+    [KeySlot( 8, '$', 's')] = kKeyArchiveObjects,
+    [KeySlot( 4, '$', 'p')] = kKeyArchiveTop,
+    [KeySlot( 6, '$', 's')] = kKeyArchiveClass,
+    [KeySlot( 8, 'm', 'a')] = kKeyMetadata,
+    [KeySlot( 7, 'N', 's')] = kKeyNS_keys,
+    [KeySlot(10, 'N', 's')] = kKeyNS_objects,
+    [KeySlot( 9, 'N', 'g')] = kKeyNS_string,
+    [KeySlot( 7, 'N', 'e')] = kKeyNS_time,
+    [KeySlot(24, 'S', 'e')] = kKeyStatusType,
+    [KeySlot( 7, 'S', 't')] = kKeySubject,
+    [KeySlot( 6, 'S', 'r')] = kKeySender,
+    [KeySlot( 2, 'I', 'D')] = kKeyID,
+    [KeySlot( 4, 'T', 'e')] = kKeyTime,
+    [KeySlot(11, 'M', 't')] = kKeyMessageText,
+    [KeySlot(15, 'O', 'e')] = kKeyOriginalMessage,
+    [KeySlot( 8, 'N', 'g')] = kKeyNSString,
+    [KeySlot(15, 'N', 'o')] = kKeyNSAttributeInfo,
+    [KeySlot(12, 'N', 's')] = kKeyNSAttributes,
+    [KeySlot(12, 'P', 's')] = kKeyParticipants,
+    [KeySlot(13, 'P', 's')] = kKeyPresentityIDs,
+    [KeySlot(26, '_', 'e')] = kKeyFilenameAttribute,
+    [KeySlot(20, 'B', 'n')] = kKeyBaseWritingDirection
+};
+// Ref readers for each width that the bplist format allows, indexed by width in bytes; widths with no entry are not supported
+const BPRefReaders gRefReaderTable[9] =
+{
+    [1] = {ReadRef_1Byte, FindKey_1Byte},
+    [2] = {ReadRef_2Byte, FindKey_2Byte},
+    [4] = {ReadRef_4Byte, FindKey_4Byte},
+    [8] = {ReadRef_8Byte, FindKey_8Byte}
 };
 #pragma mark File-level functions
+// Set up "bc" for a file that has not been loaded yet
+void InitBPContext(BPContext *bc)
+{
+    bc->bcFileContents = NULL;
+    bc->bcFileLength = 0;
+    bc->bcRefSize = 0;
+    bc->bcNumObj = 0;
+    bc->bcRootObjID = 0;
+    bc->bcOffsetTable = NULL;
+    bc->bcObjAreaEnd = 0;
+    bc->bcRefReaders = NULL;
+    bc->bcOffsetReaders = NULL;
+    bc->bcObjTypes = NULL;
+    bc->bcObjSizes = NULL;
+    bc->bcObjHeaderLengths = NULL;
+    bc->bcObjKeySymbols = NULL;
+    bc->bcFollowRefs = false;
+    bc->bcUIDpad[0] = '\0';
+    bc->bcIndent = 0;
+    bc->bcPrintedSpaces = false;
+    bc->bcTimeZone = NULL;
+}
+
+// Free the object header table of "bc". The file's mapping belongs to whoever loaded it and is left alone.
+void FreeBPContext(BPContext *bc)
+{
+    free(bc->bcObjTypes);
+    free(bc->bcObjSizes);
+    free(bc->bcObjHeaderLengths);
+    free(bc->bcObjKeySymbols);
+    bc->bcObjTypes = NULL;
+    bc->bcObjSizes = NULL;
+    bc->bcObjHeaderLengths = NULL;
+    bc->bcObjKeySymbols = NULL;
+}
+
 // Validate that this is a binary plist
-bool Validate_bplist(void)
+bool Validate_bplist(BPContext *bc)
 {
     // Sanity checks
-    if (gInFileContents == NULL)
+    if (bc->bcFileContents == NULL)
     {
         printf("Fatal error: File was not loaded.\n");
         return false;
     }
-    if (gInFileLength < kMagicWordLength + kVerLength)
+    if (bc->bcFileLength < kMagicWordLength + kVerLength + kTrailerOffset)
     {
         printf("Fatal error: File is not long enough to be a bplist.\n");
         return false;
     }
     
     // Look for magic word indicating bplist
-    if (strncmp(gInFileContents, kMagicWord, kMagicWordLength))
+    if (strncmp(bc->bcFileContents, kMagicWord, kMagicWordLength))
     {
         printf("Fatal error: This is not a bplist file.\n");
         return false;
     }
     
     // Look for version number (only known version is "00")
-    if (strncmp(gInFileContents + kMagicWordLength, kVersion_bplist, kVerLength))
+    if (strncmp(bc->bcFileContents + kMagicWordLength, kVersion_bplist, kVerLength))
     {
         printf("Fatal error: This is not a version %s bplist file, so I cannot read it.\n", kVersion_bplist);
         return false;
@@ -96,41 +225,52 @@ bool Validate_bplist(void)
 }
 
 // Read a binary plist's trailer and offset table into memory
-bool Load_bplist(void)
+bool Load_bplist(BPContext *bc)
 {
     uint64_t offsetTableOffset = 0, offsetSize = 0;
     
     // Read trailer data
-    char *trailer = gInFileContents + gInFileLength - kTrailerOffset;
+    char *trailer = bc->bcFileContents + bc->bcFileLength - kTrailerOffset;
     offsetSize = (uint64_t)*(trailer + kOffsetSizeOffset);
-    gRefSize = (uint64_t)*(trailer + kParamSizeOffset);
-    gNumObj = ReadUInt_8Byte(trailer + kNumObjOffset);
-    gRootObjID = ReadUInt_8Byte(trailer + kRootObjOffset);
+    bc->bcRefSize = (uint64_t)*(trailer + kParamSizeOffset);
+    bc->bcNumObj = ReadUInt_8Byte(trailer + kNumObjOffset);
+    bc->bcRootObjID = ReadUInt_8Byte(trailer + kRootObjOffset);
     offsetTableOffset = ReadUInt_8Byte(trailer + kOffsetTableOffsetOffset);
     
     // Sanity checks
-    if (!gNumObj)
+    if (!bc->bcNumObj)
     {
         printf("Fatal error: Found no objects in bplist!\n");
         return false;
     }
-    if (gRootObjID > gNumObj)
+    if (bc->bcRootObjID > bc->bcNumObj)
     {
         printf("Fatal error: Root object ID is higher than number of objects in bplist!\n");
         return false;
     }
-    
-    // Read all offsets into memory for future reference
-    gOffsets = malloc(gNumObj * sizeof(uint64_t)); // freed on program quit
-    char *offsetReader = gInFileContents + offsetTableOffset;
-    for (int a = 0; a < gNumObj; a++)
+    if (bc->bcRefSize > 8 || gRefReaderTable[bc->bcRefSize].rrReadRef == NULL ||
+        offsetSize > 8 || gRefReaderTable[offsetSize].rrReadRef == NULL)
     {
-        gOffsets[a] = ReadUInt_XByte(offsetReader, offsetSize);
-        offsetReader += offsetSize;
+        printf("Fatal error: Unsupported object reference size (%llu bytes) or offset size (%llu bytes)!\n", bc->bcRefSize, offsetSize);
+        return false;
+    }
+    bc->bcRefReaders = &gRefReaderTable[bc->bcRefSize];
+    bc->bcOffsetReaders = &gRefReaderTable[offsetSize];
+    
+    // The offsets are left in the file at their own width and read as needed, so the offset table only has to be checked to see that
+    // it fits between the object data and the trailer. The offsets themselves are checked once by BuildObjectTable().
+    uint64_t trailerStart = bc->bcFileLength - kTrailerOffset;
+    if (offsetTableOffset < kMagicWordLength + kVerLength || offsetTableOffset > trailerStart ||
+        bc->bcNumObj > (trailerStart - offsetTableOffset) / offsetSize)
+    {
+        printf("Fatal error: Offset table does not fit in the file!\n");
+        return false;
     }
+    bc->bcOffsetTable = bc->bcFileContents + offsetTableOffset;
+    bc->bcObjAreaEnd = offsetTableOffset;
     
     // Find how many digits the largest UID is and use this to set up our padding string for PrintObject()
-    uint64_t highestUID = gNumObj;
+    uint64_t highestUID = bc->bcNumObj;
     int UIDmag = 1;
     do
     {
@@ -138,20 +278,82 @@ bool Load_bplist(void)
         UIDmag++;
     }
     while (highestUID >= 10);
-    asprintf(&gUIDpad, "%%0%dllu:", UIDmag); // freed on program quit
+    snprintf(bc->bcUIDpad, sizeof(bc->bcUIDpad), "%%0%dllu:", UIDmag);
+    
+    return BuildObjectTable(bc);
+}
+
+// Run stages 2-4 of LoadObject() on every object in the file in a single pass over the offset table, saving the results in our
+// object header table. This is also where every offset and payload is checked to be within the object data, so that nothing
+// after this has to check them again.
+bool BuildObjectTable(BPContext *bc)
+{
+    bc->bcObjTypes = malloc(bc->bcNumObj * sizeof(uint8_t));         // freed with FreeBPContext()
+    bc->bcObjSizes = malloc(bc->bcNumObj * sizeof(uint64_t));        // freed with FreeBPContext()
+    bc->bcObjHeaderLengths = malloc(bc->bcNumObj * sizeof(uint8_t)); // freed with FreeBPContext()
+    bc->bcObjKeySymbols = malloc(bc->bcNumObj * sizeof(uint8_t));    // freed with FreeBPContext()
+    if (bc->bcObjTypes == NULL || bc->bcObjSizes == NULL || bc->bcObjHeaderLengths == NULL || bc->bcObjKeySymbols == NULL)
+    {
+        printf("Fatal error: Memory allocation failed.\n");
+        return false;
+    }
+    
+    BPObject obj;
+    for (uint64_t a = 0; a < bc->bcNumObj; a++)
+    {
+        uint64_t offset = ReturnObjectOffset(bc, a);
+        if (offset < kMagicWordLength + kVerLength || offset >= bc->bcObjAreaEnd)
+        {
+            printf("Fatal error: Object %llu is located outside of the object data!\n", a);
+            return false;
+        }
+        
+        LoadObject_S1_Init(a, &obj);
+        if (!LoadObject_S2_Locate(bc, &obj) || !LoadObject_S3_GetType(&obj))
+            return false;
+        
+        // An object that we can't identify is only a problem if someone actually tries to load it
+        if (obj.oType <= kTypeNone || !LoadObject_S4_ReadSize(&obj))
+        {
+            bc->bcObjTypes[a] = kTypeNone;
+            bc->bcObjSizes[a] = 0;
+            bc->bcObjHeaderLengths[a] = 0;
+            bc->bcObjKeySymbols[a] = kKeyNone;
+            continue;
+        }
+        
+        // Make sure that the payload doesn't run past the object data
+        uint64_t dataOffset = (uint64_t)(obj.oDataAddress - bc->bcFileContents);
+        uint64_t unitSize = ReturnPayloadUnitSize(bc, obj.oType);
+        if (dataOffset > bc->bcObjAreaEnd || (unitSize > 0 && obj.oSize > (bc->bcObjAreaEnd - dataOffset) / unitSize))
+        {
+            printf("Fatal error: Object %llu runs past the end of the object data!\n", a);
+            return false;
+        }
+        
+        bc->bcObjTypes[a] = (uint8_t)obj.oType;
+        bc->bcObjSizes[a] = obj.oSize;
+        bc->bcObjHeaderLengths[a] = (uint8_t)(dataOffset - offset);
+        
+        // Since bplists only store each string once, this interns every key name in the file
+        if (obj.oType == kTypeStringASCII)
+            bc->bcObjKeySymbols[a] = (uint8_t)LookUpKeySymbol(obj.oDataAddress, obj.oSize);
+        else
+            bc->bcObjKeySymbols[a] = kKeyNone;
+    }
     
     return true;
 }
 
 // Allow user to browse bplist interactively
-void Browse_bplistElements(void)
+void Browse_bplistElements(BPContext *bc)
 {
     // Start off by printing the root object
     printf("Printing root object:\n");
     BPObject o;
-    if (!LoadObject(gRootObjID, &o))
+    if (!LoadObject(bc, bc->bcRootObjID, &o))
         return;
-    PrintObject(&o);
+    PrintObject(bc, &o);
     
     // Enter interactive browsing mode
     char input[10];
@@ -159,7 +361,7 @@ void Browse_bplistElements(void)
     do
     {
         int inputted = 0;
-        printf("Type any letter to exit, or enter the number [0-%llu] of the element in the offset table to print:\n", gNumObj - 1);
+        printf("Type any letter to exit, or enter the number [0-%llu] of the element in the offset table to print:\n", bc->bcNumObj - 1);
         if (fgets(input, 10, stdin) != NULL)
             inputted = sscanf(input, "%llu", &inputNum);
         
@@ -169,33 +371,41 @@ void Browse_bplistElements(void)
             break;
         }
         
-        if (inputNum >= gNumObj)
+        if (inputNum >= bc->bcNumObj)
         {
             printf("Error: Input %lld out of range. Try again.\n", inputNum);
             continue;
         }
         
-        if (!LoadObject(inputNum, &o))
+        if (!LoadObject(bc, inputNum, &o))
             return;
-        PrintObject(&o);
+        PrintObject(bc, &o);
     }
     while (true);
 }
 #pragma mark Object management
-// Proceed through the five stages of loading an object's data from the bplist into memory
-bool LoadObject(uint64_t objNum, BPObject *obj)
+// Load an object's data from the bplist into memory. Stages 2-4 were already carried out for every object by BuildObjectTable(), so
+// we just read their results out of the object header table before calling on stage 5.
+bool LoadObject(BPContext *bc, uint64_t objNum, BPObject *obj)
 {
     if (!LoadObject_S1_Init(objNum, obj))
         return false;
     
-    if (!LoadObject_S2_Locate(obj))
+    if (objNum >= bc->bcNumObj)
+    {
+        printf("Error: Asked to get pointer to object %llu, which does not exist!\n", objNum);
         return false;
+    }
     
-    if (!LoadObject_S3_GetType(obj))
-        return false;
-        
-    if (!LoadObject_S4_ReadSize(obj))
+    obj->oObjAddress = bc->bcFileContents + ReturnObjectOffset(bc, objNum);
+    obj->oType = bc->bcObjTypes[objNum];
+    if (obj->oType == kTypeNone)
+    {
+        printf("LoadObject() was unable to identify the object with type code byte %02x.\n", *(obj->oObjAddress));
         return false;
+    }
+    obj->oSize = bc->bcObjSizes[objNum];
+    obj->oDataAddress = obj->oObjAddress + bc->bcObjHeaderLengths[objNum];
     
     if (!LoadObject_S5_ReadData(obj))
         return false;
@@ -227,35 +437,22 @@ bool LoadObject_S1_Init(uint64_t objNum, BPObject *obj)
     return true;
 }
 
-// Get location in file of object with UID "oUID" and save it in "oObjAddress"
-bool LoadObject_S2_Locate(BPObject *obj)
+// Get location in file of object with UID "oUID" and save it in "oObjAddress". The offset was already checked by BuildObjectTable()
+// along with all of the others.
+bool LoadObject_S2_Locate(BPContext *bc, BPObject *obj)
 {
-    if (gInFileContents == NULL)
-    {
-        printf("Error: Asked to get pointer to object before file was loaded!\n");
-        return false;
-    }
-    
-    if (obj->oUID < 0)
-    {
-        printf("Error: LoadObject_S2_Locate() was passed an object with a negative UID!\n");
-        return false;
-    }
-    
-    if (obj->oUID > gNumObj - 1)
+    if (obj->oUID >= bc->bcNumObj)
     {
         printf("Error: Asked to get pointer to object %llu, which does not exist!\n", obj->oUID);
         return false;
     }
     
-    uint64_t offset = gOffsets[obj->oUID];
-    char *ptr = (gInFileContents + offset);
-    obj->oObjAddress = ptr;
-    
+    obj->oObjAddress = bc->bcFileContents + ReturnObjectOffset(bc, obj->oUID);
     return true;
 }
 
-// Sets type of "obj" by reading data at "oObjAddress", using -1 if the object cannot be identified
+// Sets type of "obj" by reading data at "oObjAddress", using -1 if the object cannot be identified (this is reported by LoadObject()
+// if anyone tries to load the object)
 bool LoadObject_S3_GetType(BPObject *obj)
 {
     if (obj->oObjAddress == NULL)
@@ -264,35 +461,9 @@ bool LoadObject_S3_GetType(BPObject *obj)
         return false;
     }
     
-    int oType = -1;
-    uint16_t hiQuad = (*obj->oObjAddress & 0xF0) >> 4;
-    uint16_t loQuad = *obj->oObjAddress & 0x0F;
-    
-    // Get type of object by looking for our known quadbit codes
-    for (int a = 1; a < kTypeCount; a++) // skip element 0, the "none" type
-    {
-        if (hiQuad == gTypeTable[a].otHighQuad)
-        {
-            if (gTypeTable[a].otLowQuad != -1) // if we are supposed to match the low quad too, make sure that matches
-            {
-                if (loQuad == gTypeTable[a].otLowQuad)
-                {
-                    oType = gTypeTable[a].otEnum;
-                    break;
-                }
-                else
-                    continue;
-            }
-            // If we're still here, then that means we didn't need to match the low quad, so we're done
-            oType = gTypeTable[a].otEnum;
-            break;
-        }
-    }
-    
-    if (oType == -1)
-        printf("LoadObject_S3_GetType() was unable to identify the object with type code byte %02x.\n", *(obj->oObjAddress));
-    
-    obj->oType = oType;
+    // The marker byte's entry in gMarkerTable holds the type
+    int oType = gMarkerTable[(uint8_t)*obj->oObjAddress].miType;
+    obj->oType = (oType == kTypeNone ? -1 : oType);
     return true;
 }
 
@@ -305,31 +476,15 @@ bool LoadObject_S4_ReadSize(BPObject *obj)
         return false;
     }
     
-    uint64_t payloadSize = 0, overflow = 0;
-    uint16_t loQuad = (*obj->oObjAddress) & 0x0F;
-    
-    if (gTypeTable[obj->oType].otSizeType == kSizePowerOfTwo)
-        payloadSize = (uint64_t)pow(2, loQuad);
-    else if (gTypeTable[obj->oType].otSizeType == kSize8ByteFloat)
-        payloadSize = 8;
-    else if (gTypeTable[obj->oType].otSizeType == kSizeScalarOverflow)
-    {
-        payloadSize = loQuad;
-        if (payloadSize == 0xF) // then length is in subsequent scalar int
-        {
-            // The low quad of the next byte is the size of the data as a power of 2
-            uint16_t loScalarQuad = (*(obj->oObjAddress + 1)) & 0x0F;
-            uint64_t payloadSizeScalar = (uint64_t)pow(2, loScalarQuad);
-            payloadSize = ReadUInt_XByte(obj->oObjAddress + 2, payloadSizeScalar);
-            overflow = payloadSizeScalar + 1;
-        }
-    }
-    else if (gTypeTable[obj->oType].otSizeType == kSizeAddOne)
-        payloadSize = loQuad + 1;
-    else if (gTypeTable[obj->oType].otSizeType != kSizeNone)
+    // Apart from sizes too big for the marker byte, gMarkerTable already worked out the size from the lower quadbit
+    const BPMarkerInfo *marker = &gMarkerTable[(uint8_t)*obj->oObjAddress];
+    uint64_t payloadSize = marker->miSize, overflow = 0;
+    if (marker->miSizeType == kSizeScalarOverflow && payloadSize == 0xF) // then length is in subsequent scalar int
     {
-        printf("Error: LoadObject_S4_ReadSize() encountered an unknown size code.\n");
-        return false;
+        // The low quad of the next byte is the size of the data as a power of 2
+        uint64_t payloadSizeScalar = 1ULL << ((*(obj->oObjAddress + 1)) & 0x0F);
+        payloadSize = ReadUInt_XByte(obj->oObjAddress + 2, payloadSizeScalar);
+        overflow = payloadSizeScalar + 1;
     }
     
     obj->oSize = payloadSize;
@@ -364,15 +519,22 @@ bool LoadObject_S5_ReadData(BPObject *obj)
     return true;
 }
 
-// Copies special iChat-related formatting cues from key object to value object
-void CopyObjectMetadata(BPObject *objSrc, BPObject *objDest)
+// Copies special iChat-related formatting cues from key object to value object. The cues are worked out here from the key's name,
+// only when a key/value pair is actually being examined, rather than whenever a string or dict is loaded.
+void CopyObjectMetadata(BPContext *bc, BPObject *objSrc, BPObject *objDest)
 {
+    int key = ReturnKeySymbol(bc, objSrc->oUID);
+    if (key == kKeyBaseWritingDirection)
+        objSrc->oIsBaseWritingDirection = true;
+    else if (key == kKeyNS_time)
+        objSrc->oIsNSTime = true;
+    
     objDest->oIsBaseWritingDirection = objSrc->oIsBaseWritingDirection;
     objDest->oIsNSTime = objSrc->oIsNSTime;
 }
 
 // Calls the data type's designated print function
-void PrintObject(BPObject *obj)
+void PrintObject(BPContext *bc, BPObject *obj)
 {
     if (obj->oSize == (uint64_t)-1)
     {
@@ -389,9 +551,9 @@ void PrintObject(BPObject *obj)
     
     if (gTypeTable[oType].otPrintFunc != NULL)
     {
-        gPrintedSpaces = false;
-        printf(gUIDpad, obj->oUID);
-        gTypeTable[oType].otPrintFunc(obj);
+        bc->bcPrintedSpaces = false;
+        printf(bc->bcUIDpad, obj->oUID);
+        gTypeTable[oType].otPrintFunc(bc, obj);
     }
     else
         printf("Error: PrintObject() could not find the print function for this object's data type.\n");
@@ -438,16 +600,10 @@ void ReadData_Real(BPObject *obj)
         return;
     }
     
-    uint8_t *floatData = malloc(size); // freed below
-    char *reader;
-    for (int a = 0; a < size; a++)
-    {
-        reader = obj->oDataAddress + obj->oSize - 1 - a;
-        floatData[a] = (uint8_t)*reader;
-    }
-    double real = *(double *)floatData;
-    obj->oReal = real;
-    free(floatData);
+    if (size == 8)
+        obj->oReal = ReadReal_8Byte(obj->oDataAddress);
+    else
+        obj->oReal = ReadReal_4Byte(obj->oDataAddress);
 }
 
 // Saves an NSDate into "obj". This function merely reads the underlying 'float' into memory, to be passed later to ConvertNSDate().
@@ -461,72 +617,28 @@ void ReadData_Date(BPObject *obj)
         return;
     }
     
-    uint8_t *floatData = malloc(size); // freed below
-    char *reader;
-    for (int a = 0; a < size; a++)
-    {
-        reader = obj->oDataAddress + obj->oSize - 1 - a;
-        floatData[a] = (uint8_t)*reader;
-    }
-    double real = *(double *)floatData;
-    obj->oReal = real;
-    free(floatData);
+    if (size == 8)
+        obj->oReal = ReadReal_8Byte(obj->oDataAddress);
+    else
+        obj->oReal = ReadReal_4Byte(obj->oDataAddress);
 }
 
-// Copies blob of raw data into "obj"
+// Saves a pointer to a blob of raw data into "obj"
 void ReadData_Data(BPObject *obj)
 {
-    uint64_t size = obj->oSize;
-    
-    if (size > 0)
-    {
-        obj->oData = malloc(size); // freed with DeleteMessage()
-        memcpy(obj->oData, obj->oDataAddress, size);
-    }
-    else
-    {
-        //printf("Warning: Could not read data blob, as it was zero bytes.\n");
-        return;
-    }
+    obj->oData = obj->oDataAddress;
 }
 
-// Saves a pointer to an ASCII string into "obj"
+// Saves a pointer to an ASCII string into "obj"; "oSize" is the length of the string
 void ReadData_StringASCII(BPObject *obj)
 {
-    uint64_t size = obj->oSize;
-    
-    if (size > 0)
-    {
-        obj->oData = malloc(size + 1); // freed with DeleteMessage()
-        strncpy(obj->oData, obj->oDataAddress, size);
-        obj->oData[size] = '\0';
-        
-        if (!strcmp(obj->oData, "BaseWritingDirection"))
-            obj->oIsBaseWritingDirection = true;
-        else if (!strcmp(obj->oData, "NS.time"))
-            obj->oIsNSTime = true;
-    }
-    else
-    {
-        //printf("Warning: Did not attempt to get ASCII string, as it was empty.\n");
-        return;
-    }
+    obj->oData = obj->oDataAddress;
 }
 
-// Saves a pointer to a Unicode (16-bit) string into "obj"
+// Saves a pointer to a Unicode (16-bit) string into "obj"; "oSize" is the number of wide chars in the string
 void ReadData_StringUnicode(BPObject *obj)
 {
-    if (obj->oSize > 0)
-    {
-        obj->oData = malloc((obj->oSize * 2) + 1); // "oSize" is the number of wide chars; freed with DeleteMessage()
-        memcpy(obj->oData, obj->oDataAddress, obj->oSize * 2);
-        obj->oData[obj->oSize * 2] = '\0';
-    }
-    else
-    {
-        //printf("Warning: Did not attempt to get Unicode string, as it was empty.\n");
-        return;
-    }
+    obj->oData = obj->oDataAddress;
 }
 
 // Saves a scope-dependent XML node ID composed of "oSize" bytes into "obj"
@@ -547,59 +659,43 @@ void ReadData_Set(BPObject *obj)
     obj->oBool = false;
 }
 
-// There is nothing to save in "obj", but scan dictionary for special iChat-related flags
+// There is nothing to save in "obj", as this is just a dictionary of further objects. Only the dict's header is decoded here; its
+// keys and values are loaded when they are looked up, and any iChat-related flags are worked out by CopyObjectMetadata() then.
 void ReadData_Dict(BPObject *obj)
 {
-    uint64_t size = obj->oSize;
-    char *pairReader = obj->oDataAddress;
-    
-    for (int a = 0; a < size; a++)
-    {
-        // The values are listed after all the keys, so the value is at the location of the key plus the number of k/v pairs
-        uint64_t keyRef = ReadUInt_XByte(pairReader, gRefSize);
-        uint64_t valueRef = ReadUInt_XByte(pairReader + (gRefSize * size), gRefSize);
-        
-        BPObject key, value;
-        if (!LoadObject(keyRef, &key))
-            return;
-        if (!LoadObject(valueRef, &value))
-            return;
-        CopyObjectMetadata(&key, &value);
-        
-        pairReader += gRefSize;
-    }
+    obj->oBool = false;
 }
 #pragma mark Data-printing functions
-void PrintData_Null(BPObject *obj)
+void PrintData_Null(BPContext *bc, BPObject *obj)
 {
     obj=obj; // avoid "unused parameter" warning
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     printf("(null)\n");
 }
 
-void PrintData_BoolFalse(BPObject *obj)
+void PrintData_BoolFalse(BPContext *bc, BPObject *obj)
 {
     obj=obj; // avoid "unused parameter" warning
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     printf("false\n");
 }
 
-void PrintData_BoolTrue(BPObject *obj)
+void PrintData_BoolTrue(BPContext *bc, BPObject *obj)
 {
     obj=obj; // avoid "unused parameter" warning
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     printf("true\n");
 }
 
-void PrintData_Fill(BPObject *obj)
+void PrintData_Fill(BPContext *bc, BPObject *obj)
 {
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     printf("(%llu bytes of filler)\n", obj->oSize);
 }
 
-void PrintData_Int(BPObject *obj)
+void PrintData_Int(BPContext *bc, BPObject *obj)
 {
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     
     if (obj->oIsBaseWritingDirection)
         printf("%lli\n", (int64_t)obj->oInt);
@@ -607,122 +703,127 @@ void PrintData_Int(BPObject *obj)
         printf("%llu\n", obj->oInt);
 }
 
-void PrintData_Real(BPObject *obj)
+void PrintData_Real(BPContext *bc, BPObject *obj)
 {
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     
     if (obj->oIsNSTime)
-        ConvertNSDate(obj->oReal, NULL, kDatePrint);
+    {
+        BPDateCache cache;
+        InitDateCache(&cache, bc->bcTimeZone);
+        ConvertNSDate(obj->oReal, NULL, kDatePrint, &cache);
+    }
     else
         printf("%ff\n", obj->oReal);
 }
 
-void PrintData_Date(BPObject *obj)
+void PrintData_Date(BPContext *bc, BPObject *obj)
 {
-    PrintSpaces(gIndent);
-    ConvertNSDate(obj->oReal, NULL, kDatePrint);
+    BPDateCache cache;
+    InitDateCache(&cache, bc->bcTimeZone);
+    PrintSpaces(bc, bc->bcIndent);
+    ConvertNSDate(obj->oReal, NULL, kDatePrint, &cache);
 }
 
-void PrintData_Data(BPObject *obj)
+void PrintData_Data(BPContext *bc, BPObject *obj)
 {
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     printf("Printing %llu byte(s) of raw data:\n", obj->oSize);
     printf("hex  dec  char\n");
     for (int a = 0; a < obj->oSize; a++)
         printf("0x%02x %03d  '%c'\n", obj->oData[a], obj->oData[a], obj->oData[a]);
 }
 
-void PrintData_StringASCII(BPObject *obj)
+void PrintData_StringASCII(BPContext *bc, BPObject *obj)
 {
-    PrintSpaces(gIndent);
-    printf("'%s'\n", obj->oData);
+    PrintSpaces(bc, bc->bcIndent);
+    printf("'%.*s'\n", (int)obj->oSize, obj->oData);
 }
 
-void PrintData_StringUnicode(BPObject *obj)
+void PrintData_StringUnicode(BPContext *bc, BPObject *obj)
 {
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     PrintWideString(obj->oData, obj->oSize);
 }
 
-void PrintData_UID(BPObject *obj)
+void PrintData_UID(BPContext *bc, BPObject *obj)
 {
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     printf("UID %llu\n", obj->oInt);
 }
 
-void PrintData_Array(BPObject *obj)
+void PrintData_Array(BPContext *bc, BPObject *obj)
 {
     uint64_t size = obj->oSize;
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     printf("The array has %llu element%s:\n", size, size == 1 ? "" : "s");
-    gIndent++;
-    char *elemReader = obj->oDataAddress;
-    for (int a = 0; a < size; a++)
+    bc->bcIndent++;
+    for (uint64_t a = 0; a < size; a++)
     {
-        uint64_t elemRef = ReadUInt_XByte(elemReader, gRefSize);
-        if (gFollowRefs)
+        uint64_t elemRef = bc->bcRefReaders->rrReadRef(obj->oDataAddress, a);
+        if (bc->bcFollowRefs)
         {
             BPObject elem;
-            if (!LoadObject(elemRef, &elem))
+            if (!LoadObject(bc, elemRef, &elem))
                 return;
-            PrintObject(&elem);
+            PrintObject(bc, &elem);
         }
         else
         {
-            PrintSpaces(gIndent); gPrintedSpaces = false; // take the place of calling PrintObject()
+            PrintSpaces(bc, bc->bcIndent); bc->bcPrintedSpaces = false; // take the place of calling PrintObject()
             printf("(UID %llu)\n", elemRef);
         }
-        
-        elemReader += gRefSize;
     }
-    gIndent--;
+    bc->bcIndent--;
 }
 
-void PrintData_Set(BPObject *obj)
+void PrintData_Set(BPContext *bc, BPObject *obj)
 {
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     printf("Warning: The 'set' type is not supported yet, but this is a %llu-element set.\n", obj->oSize);
 }
 
-void PrintData_Dict(BPObject *obj)
+void PrintData_Dict(BPContext *bc, BPObject *obj)
 {
     uint64_t size = obj->oSize;
-    PrintSpaces(gIndent);
+    PrintSpaces(bc, bc->bcIndent);
     printf("The dict has %llu key/value pair%s.\n", size, size == 1 ? "" : "s");
-    gIndent++;
-    char *pairReader = obj->oDataAddress;
-    for (int a = 0; a < size; a++)
+    bc->bcIndent++;
+    for (uint64_t a = 0; a < size; a++)
     {
-        // The values are listed after all the keys, so the value is at the location of the key plus half the dict size. The
+        // The values are listed after all the keys, so the value is at the index of the key plus half the dict size. The
         // dict size is 2 * "size" because "size" is the number of k/v pairs.
-        uint64_t keyRef = ReadUInt_XByte(pairReader, gRefSize);
-        uint64_t valueRef = ReadUInt_XByte(pairReader + (gRefSize * size), gRefSize);
+        uint64_t keyRef = bc->bcRefReaders->rrReadRef(obj->oDataAddress, a);
+        uint64_t valueRef = bc->bcRefReaders->rrReadRef(obj->oDataAddress, a + size);
         
-        if (gFollowRefs)
+        if (bc->bcFollowRefs)
         {
             BPObject key, value;
-            if (!LoadObject(keyRef, &key))
+            if (!LoadObject(bc, keyRef, &key))
                 return;
-            if (!LoadObject(valueRef, &value))
+            if (!LoadObject(bc, valueRef, &value))
                 return;
-            CopyObjectMetadata(&key, &value);
-            PrintObject(&key);
-            PrintObject(&value);
+            CopyObjectMetadata(bc, &key, &value);
+            PrintObject(bc, &key);
+            PrintObject(bc, &value);
         }
         else
         {
-            PrintSpaces(gIndent); gPrintedSpaces = false; // take the place of calling PrintObject()
+            PrintSpaces(bc, bc->bcIndent); bc->bcPrintedSpaces = false; // take the place of calling PrintObject()
             printf("(UID %llu, %llu)\n", keyRef, valueRef);
         }
-        
-        pairReader += gRefSize;
     }
-    gIndent--;
+    bc->bcIndent--;
 }
 #pragma mark Utility functions
 // Search given dictionary for given key name and return the value as a reference (offset table index)
-uint64_t ReturnValueRefForKeyName(BPObject *dict, char *name)
+uint64_t ReturnValueRefForKeyName(BPContext *bc, BPObject *dict, char *name)
 {
+    // If this is one of the names that we interned, we can just compare key symbols
+    int key = LookUpKeySymbol(name, strlen(name));
+    if (key != kKeyNone)
+        return ReturnValueRefForKey(bc, dict, key);
+    
     if (dict->oSize == (uint64_t)-1)
     {
         printf("Error: ReturnValueRefForKeyName() was passed an object that was not finished loading.\n");
@@ -736,32 +837,137 @@ uint64_t ReturnValueRefForKeyName(BPObject *dict, char *name)
     }
     
     // Search dictionary's key names
-    char *reader = dict->oDataAddress;
-    for (int a = 0; a < dict->oSize; a++)
+    for (uint64_t a = 0; a < dict->oSize; a++)
     {
-        uint64_t keyRef = ReadUInt_XByte(reader, gRefSize);
+        uint64_t keyRef = bc->bcRefReaders->rrReadRef(dict->oDataAddress, a);
         BPObject key;
-        if (!LoadObject(keyRef, &key))
+        if (!LoadObject(bc, keyRef, &key))
             return (uint64_t)-1;
         if (key.oType == kTypeStringASCII)
         {
-            if (!strcmp(key.oData, name))
+            if (StringObjectEquals(&key, name))
             {
                 // Corresponding value in this pair is in second half of dict, so add number of k/v pairs to jump to it
-                uint64_t valueRef = ReadUInt_XByte(reader + (gRefSize * dict->oSize), gRefSize);
-                return valueRef;
+                return bc->bcRefReaders->rrReadRef(dict->oDataAddress, a + dict->oSize);
             }
         }
-        
-        reader += gRefSize;
     }
     
     //printf("Warning: Failed to find key \"%s\" in dictionary with UID %llu.\n", name, dict->oUID);
     return (uint64_t)-1;
 }
 
+// Search given dictionary for the key with symbol "key" (a value from enum BPKeySymbol) and return the value as a reference (offset
+// table index). Unlike ReturnValueRefForKeyName(), this does not need to load any of the key objects.
+uint64_t ReturnValueRefForKey(BPContext *bc, BPObject *dict, int key)
+{
+    if (dict->oSize == (uint64_t)-1)
+    {
+        printf("Error: ReturnValueRefForKey() was passed an object that was not finished loading.\n");
+        return (uint64_t)-1;
+    }
+    
+    if (dict->oType != kTypeDict)
+    {
+        printf("Error: ReturnValueRefForKey() was passed an object that is not a dictionary.\n");
+        return (uint64_t)-1;
+    }
+    
+    uint64_t keyIndex = bc->bcRefReaders->rrFindKey(bc, dict->oDataAddress, dict->oSize, key);
+    if (keyIndex == (uint64_t)-1)
+        return (uint64_t)-1;
+    
+    // Corresponding value in this pair is in second half of dict, so add number of k/v pairs to jump to it
+    return bc->bcRefReaders->rrReadRef(dict->oDataAddress, keyIndex + dict->oSize);
+}
+
+// Record in "plan" where each key symbol sits among the keys of "dict", so that dicts laid out the same way can be looked up with
+// ReturnPlannedValueRef(). As with ReturnValueRefForKey(), a key that appears more than once is found at its first position. Returns
+// false if "dict" is not a loaded dict or has too many keys to plan.
+bool CompileFieldPlan(BPContext *bc, BPObject *dict, BPFieldPlan *plan)
+{
+    if (dict->oType != kTypeDict || dict->oSize == (uint64_t)-1 || dict->oSize >= FIELD_PLAN_NO_SLOT)
+        return false;
+    
+    plan->fpKeyRefs = dict->oDataAddress;
+    plan->fpNumKeys = dict->oSize;
+    memset(plan->fpSlots, FIELD_PLAN_NO_SLOT, sizeof(plan->fpSlots));
+    for (uint64_t a = dict->oSize; a > 0; a--)
+    {
+        uint64_t ref = bc->bcRefReaders->rrReadRef(dict->oDataAddress, a - 1);
+        if (ref < bc->bcNumObj)
+            plan->fpSlots[bc->bcObjKeySymbols[ref]] = (uint8_t)(a - 1);
+    }
+    
+    return true;
+}
+
+// Returns whether the keys of "dict" are the very same objects, in the same order, as those of the dict that "plan" was compiled from
+bool DictMatchesFieldPlan(BPContext *bc, BPObject *dict, const BPFieldPlan *plan)
+{
+    return (dict->oType == kTypeDict && dict->oSize == plan->fpNumKeys &&
+            !memcmp(dict->oDataAddress, plan->fpKeyRefs, (size_t)(plan->fpNumKeys * bc->bcRefSize)));
+}
+
+// Returns the value for the key with symbol "key" in "dict", which must match "plan", as a reference (offset table index), or
+// (uint64_t)-1 if the dict doesn't have the key. Without a plan, this is the same as ReturnValueRefForKey().
+uint64_t ReturnPlannedValueRef(BPContext *bc, const BPFieldPlan *plan, BPObject *dict, int key)
+{
+    if (plan == NULL)
+        return ReturnValueRefForKey(bc, dict, key);
+    
+    uint8_t slot = plan->fpSlots[key];
+    if (slot == FIELD_PLAN_NO_SLOT)
+        return (uint64_t)-1;
+    
+    return bc->bcRefReaders->rrReadRef(dict->oDataAddress, slot + dict->oSize);
+}
+
+// Returns the value from enum BPKeySymbol for the key name "name" of length "length", or kKeyNone if it is not a name that we know
+int LookUpKeySymbol(const char *name, uint64_t length)
+{
+    if (length == 0 || length > 255)
+        return kKeyNone;
+    
+    uint8_t key = gKeySymbolSlots[KeySlot(length, (uint8_t)name[0], (uint8_t)name[length - 1])];
+    if (key == kKeyNone || strlen(gKeySymbolNames[key]) != length || memcmp(gKeySymbolNames[key], name, length))
+        return kKeyNone;
+    
+    return key;
+}
+
+// Returns where object "objNum" starts, as an offset from the start of the file, by reading its entry in the offset table
+uint64_t ReturnObjectOffset(BPContext *bc, uint64_t objNum)
+{
+    return bc->bcOffsetReaders->rrReadRef(bc->bcOffsetTable, objNum);
+}
+
+// Returns the number of bytes taken up by each unit of "oSize" for an object of type "oType"
+uint64_t ReturnPayloadUnitSize(BPContext *bc, int oType)
+{
+    if (oType == kTypeStringUnicode)
+        return 2;
+    else if (oType == kTypeArray || oType == kTypeSet)
+        return bc->bcRefSize;
+    else if (oType == kTypeDict)
+        return bc->bcRefSize * 2; // a key and a value for each pair
+    else if (oType <= kTypeFill)
+        return 0;
+    
+    return 1;
+}
+
+// Returns the value from enum BPKeySymbol that was matched to object "objNum" when the file was loaded
+int ReturnKeySymbol(BPContext *bc, uint64_t objNum)
+{
+    if (objNum >= bc->bcNumObj)
+        return kKeyNone;
+    
+    return bc->bcObjKeySymbols[objNum];
+}
+
 // Search given array for given element number and return the element as a reference (offset table index)
-uint64_t ReturnElemRef(BPObject *array, uint64_t elem)
+uint64_t ReturnElemRef(BPContext *bc, BPObject *array, uint64_t elem)
 {
     if (array->oSize == (uint64_t)-1)
     {
@@ -781,107 +987,166 @@ uint64_t ReturnElemRef(BPObject *array, uint64_t elem)
         return (uint64_t)-1;
     }
     
-    char *reader = array->oDataAddress;
-    reader += (elem * gRefSize);
-    uint64_t objNum = ReadUInt_XByte(reader, gRefSize);
-    return objNum;
+    return bc->bcRefReaders->rrReadRef(array->oDataAddress, elem);
 }
 
-// Converts "nsDate" into a string using a rough implementation of Apple's NSDate format, and if "mode" is 0 prints it to screen,
-// else it copies the string into "strDate"
-void ConvertNSDate(double nsDate, char **strDate, int mode)
+// Returns whether "obj" is an ASCII string with the same contents as "str"
+bool StringObjectEquals(BPObject *obj, const char *str)
 {
-    // Start at beginning of Apple's NSDate epoch
-    int theYear = 2001;
-    int theMonth = 1;
-    int theDay = 1;
-    int theHour = 0, theMinute = 0, theSecond = 0;
+    if (obj->oType != kTypeStringASCII || obj->oData == NULL)
+        return false;
     
-    // Info for calculating year-month-day
-#define DaysInYear(x) (x % 4 == 0 ? (x % 100 == 0 ? (x % 400 == 0 ? 366 : 365) : 366) : 365)
-#define DaysInFeb(x) (x % 4 == 0 ? (x % 100 == 0 ? (x % 400 == 0 ? 29 : 28) : 29) : 28)
-#define DaysInMonth(x, y) (x == 2 ? DaysInFeb(y) : daysInMonths[theMonth - 1])
-    int daysInMonths[12] = {31, -1, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    return (strlen(str) == obj->oSize && !memcmp(obj->oData, str, obj->oSize));
+}
+
+// Converts "nsDate" into a string using a rough implementation of Apple's NSDate format, and if "mode" is 0 prints it to screen,
+// else it writes the string into "strDate", which must have room for NSDATE_STRING_SIZE chars. "cache", which may be NULL, remembers
+// the date of the last day formatted, so that the many messages sent on one day only work out the date once, and gives the zone that
+// the time is written in; without it, the time is written LOCAL_TIME_ZONE hours from UTC.
+void ConvertNSDate(double nsDate, char *strDate, int mode, BPDateCache *cache)
+{
+    BPDateCache dayCache;
+    if (cache == NULL)
+    {
+        InitDateCache(&dayCache, NULL);
+        cache = &dayCache;
+    }
     
     // Number of days that we have to count from the epoch
-    int dayBank = (int)(nsDate / 60.f / 60.f / 24.f);
+    int64_t dayBank = (int64_t)floor(nsDate / 60.f / 60.f / 24.f);
     
     // Number of hours, minutes and seconds that we have to count into the day
-    double dayFraction = nsDate - (double)(dayBank * 60 * 60 * 24);
+    double dayFraction = nsDate - (double)dayBank * 60 * 60 * 24;
+    int theHour = (int)(dayFraction / 60.f / 60.f);
+    dayFraction -= (double)(theHour * 60 * 60);
+    int theMinute = (int)(dayFraction / 60.f);
+    dayFraction -= (double)(theMinute * 60);
+    int theSecond = (int)(dayFraction);
     
-    // Increment the year until we run out of a year's worth of days
-    for (; dayBank > DaysInYear(theYear); theYear++)
-        dayBank -= DaysInYear(theYear);
+    // Adjust for time zone, moving into the day before or after if need be; the zone's offset at this moment is usually the same as at
+    // the last one, which ReturnZoneOffset() checks before searching
+    int daySeconds = theHour * 60 * 60 + theMinute * 60 + theSecond;
+    int offset = LOCAL_TIME_ZONE * 60 * 60;
+    if (cache->dcZone != NULL)
+    {
+        int64_t unixTime = (dayBank + kDaysFrom1970To2001) * 24 * 60 * 60 + daySeconds;
+        offset = ReturnZoneOffset(cache->dcZone, unixTime, &cache->dcInterval);
+    }
+    daySeconds += offset;
+    while (daySeconds < 0)
+    {
+        daySeconds += 24 * 60 * 60;
+        dayBank--;
+    }
+    while (daySeconds >= 24 * 60 * 60)
+    {
+        daySeconds -= 24 * 60 * 60;
+        dayBank++;
+    }
     
-    // Increment the month until we run out of the month's worth of days
-    do
+    // Write "HH:MM:SS" at the end of the string, and the date before it in the long format
+    char output[NSDATE_STRING_SIZE];
+    char *timeStart = output;
+    if (mode == kDatePrint || mode == kDateSaveLong)
     {
-        if (dayBank > DaysInMonth(theMonth, theYear))
+        if (cache->dcDay != dayBank && !CacheNSDateDay(cache, dayBank))
         {
-            dayBank -= DaysInMonth(theMonth, theYear);
-            theMonth++;
+            // A year that doesn't fit in four digits is left to snprintf(), which will truncate the string if it must
+            int theYear, theMonth, theDay;
+            CivilFromDays(dayBank + kDaysFrom1970To2001, &theYear, &theMonth, &theDay);
+            snprintf(output, NSDATE_STRING_SIZE, "%d-%02d-%02d %02d:%02d:%02d", theYear, theMonth, theDay, daySeconds / 3600,
+                     daySeconds / 60 % 60, daySeconds % 60);
+            timeStart = NULL;
         }
         else
-            break;
-        if (theMonth > 12)
         {
-            theMonth = 1;
-            theYear++;
+            memcpy(output, cache->dcPrefix, sizeof(cache->dcPrefix));
+            timeStart = output + sizeof(cache->dcPrefix);
         }
     }
-    while (true);
-    
-    // The day of the month is however many days we have left to spend in the day bank
-    theDay += dayBank;
-    
-    // Set hour, minute and second of day
-    theHour = (int)(dayFraction / 60.f / 60.f);
-    dayFraction -= (double)(theHour * 60 * 60);
-    theMinute = (int)(dayFraction / 60.f);
-    dayFraction -= (double)(theMinute * 60);
-    theSecond = (int)(dayFraction);
-    
-    // Adjust for time zone; if this takes us into the previous day, deduct from theDay, theMonth, and theYear as needed
-    theHour += LOCAL_TIME_ZONE;
-    if (theHour < 0)
+    if (timeStart != NULL)
     {
-        theDay--;
-        theHour += 24;
-        if (theDay < 1)
-        {
-            theMonth--;
-            if (theMonth < 1)
-            {
-                theYear--;
-                theMonth += 12;
-            }
-            theDay += DaysInMonth(theMonth, theYear);
-        }
+        WriteTwoDigits(timeStart, daySeconds / 3600);
+        timeStart[2] = ':';
+        WriteTwoDigits(timeStart + 3, daySeconds / 60 % 60);
+        timeStart[5] = ':';
+        WriteTwoDigits(timeStart + 6, daySeconds % 60);
+        timeStart[8] = '\0';
     }
     
-    // Prepare string in desired format
-    char *output = NULL;
-    if (mode == kDatePrint || mode == kDateSaveLong)
-        asprintf(&output, "%d-%02d-%02d %02d:%02d:%02d", theYear, theMonth, theDay, theHour, theMinute, theSecond); // freed below
-    else // kDateSaveShort
-        asprintf(&output, "%02d:%02d:%02d", theHour, theMinute, theSecond); // freed below
-    
     // Print or save string
     if (mode == kDatePrint)
         printf("%s\n", output);
     else
+        memcpy(strDate, output, NSDATE_STRING_SIZE);
+}
+
+// Set up "cache" with no day in it, to convert times into "zone", which may be NULL
+void InitDateCache(BPDateCache *cache, const TimeZone *zone)
+{
+    cache->dcDay = INT64_MIN;
+    cache->dcZone = zone;
+    cache->dcInterval = 0;
+}
+
+// Put the date of day "day", counted from the NSDate epoch, into "cache" as "YYYY-MM-DD ". Returns false, leaving "cache" empty, if the
+// year doesn't have four digits.
+bool CacheNSDateDay(BPDateCache *cache, int64_t day)
+{
+    int theYear, theMonth, theDay;
+    CivilFromDays(day + kDaysFrom1970To2001, &theYear, &theMonth, &theDay);
+    if (theYear < 0 || theYear > 9999)
     {
-        uint64_t outputLength = strlen(output);
-        *strDate = malloc(outputLength + 1); // freed with DeleteMessage()
-        strncpy(*strDate, output, outputLength);
-        char *nullTerm = *strDate + outputLength;
-        *nullTerm = '\0';
+        cache->dcDay = INT64_MIN;
+        return false;
     }
     
-    free(output);
-#undef DaysInMonth
-#undef DaysInFeb
-#undef DaysInYear
+    char *prefix = cache->dcPrefix;
+    WriteTwoDigits(prefix, theYear / 100);
+    WriteTwoDigits(prefix + 2, theYear % 100);
+    prefix[4] = '-';
+    WriteTwoDigits(prefix + 5, theMonth);
+    prefix[7] = '-';
+    WriteTwoDigits(prefix + 8, theDay);
+    prefix[10] = ' ';
+    cache->dcDay = day;
+    return true;
+}
+
+// Work out the year, month (1-12) and day of the month (1-31) of day "days", counted from 1970-01-01, in the proleptic Gregorian
+// calendar. This takes the same few steps for any day: the days are split into 400-year eras, each of which has the same number of
+// days, and the years are counted from March so that the leap day comes at the end of the year.
+void CivilFromDays(int64_t days, int *year, int *month, int *day)
+{
+    days += 719468; // days from 0000-03-01 to 1970-01-01
+    int64_t era = (days >= 0 ? days : days - 146096) / 146097;
+    int64_t dayOfEra = days - era * 146097;                                                        // [0, 146096]
+    int64_t yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365; // [0, 399]
+    int64_t dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);            // [0, 365], from March 1
+    int64_t monthFromMarch = (5 * dayOfYear + 2) / 153;                                            // [0, 11]
+    
+    *day = (int)(dayOfYear - (153 * monthFromMarch + 2) / 5 + 1);
+    *month = (int)(monthFromMarch < 10 ? monthFromMarch + 3 : monthFromMarch - 9);
+    *year = (int)(yearOfEra + era * 400 + (*month <= 2 ? 1 : 0));
+}
+
+// Returns the number of days from 1970-01-01 to "year"-"month"-"day"; the inverse of CivilFromDays()
+int64_t DaysFromCivil(int year, int month, int day)
+{
+    int64_t y = year - (month <= 2 ? 1 : 0);
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yearOfEra = y - era * 400;                                                      // [0, 399]
+    int64_t dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;      // [0, 365], from March 1
+    int64_t dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;       // [0, 146096]
+    
+    return era * 146097 + dayOfEra - 719468;
+}
+
+// Write "value", which must be from 0 to 99, as two digits at "dest"
+void WriteTwoDigits(char *dest, int value)
+{
+    dest[0] = (char)('0' + value / 10);
+    dest[1] = (char)('0' + value % 10);
 }
 
 // Prints contents of a 16-bit big-endian Unicode string. "strSize" should be the number of two-byte characters in the string.
@@ -925,9 +1190,9 @@ void PrintTypeName(int oType)
 
 // Prints a sort of notched ruler in the space before an indented object is printed. The purpose is to help the reader of a long
 // printout of nested objects understand which level of the hierarchy each object is at.
-void PrintSpaces(int spaceNum)
+void PrintSpaces(BPContext *bc, int spaceNum)
 {
-    if (spaceNum <= 0 || gPrintedSpaces)
+    if (spaceNum <= 0 || bc->bcPrintedSpaces)
         return;
     
     char *gIndentRuler = "  |  |  |  |  |  |  |  |  |  |";
@@ -940,7 +1205,7 @@ void PrintSpaces(int spaceNum)
     spaceOutput[spaceNum] = '\0';
     printf("%s", spaceOutput);
     free(spaceOutput);
-    gPrintedSpaces = true;
+    bc->bcPrintedSpaces = true;
 }
 
 // Print a string of 1s and 0s based on the "inNumber" that is "inBytes" bytes long
@@ -956,12 +1221,36 @@ void PrintBinary(uint64_t inNumber, int inBytes)
     printf("\n");
 }
 #pragma mark Byte-reading functions
+// Object references and offsets in a file all have the same width, so there is a specialized set of readers for each width that
+// the format allows. Finding a key in a dict compares the key symbols interned by BuildObjectTable() in a tight loop over the refs.
+#define DefineRefReaders(width) \
+uint64_t ReadRef_##width##Byte(char *refs, uint64_t index) \
+{ \
+    return ReadUInt_##width##Byte(refs + (index * width)); \
+} \
+\
+uint64_t FindKey_##width##Byte(BPContext *bc, char *refs, uint64_t count, int keySym) \
+{ \
+    for (uint64_t a = 0; a < count; a++) \
+    { \
+        uint64_t ref = ReadUInt_##width##Byte(refs + (a * width)); \
+        if (ref < bc->bcNumObj && bc->bcObjKeySymbols[ref] == keySym) \
+            return a; \
+    } \
+    return (uint64_t)-1; \
+}
+DefineRefReaders(1)
+DefineRefReaders(2)
+DefineRefReaders(4)
+DefineRefReaders(8)
+#undef DefineRefReaders
+
 // Receiving an unsigned big-endian integer of "size" bytes starting at "start", calls the appropriate reader for that size of
 // integer
 uint64_t ReadUInt_XByte(char *start, uint64_t size)
 {
     if (size == 1)
-        return (uint8_t)(*start);
+        return ReadUInt_1Byte(start);
     else if (size == 2)
         return ReadUInt_2Byte(start);
     else if (size == 4)
@@ -976,29 +1265,31 @@ uint64_t ReadUInt_XByte(char *start, uint64_t size)
 // Returns the value of an eight-byte unsigned big-endian integer that starts at "start"
 uint64_t ReadUInt_8Byte(char *start)
 {
-    uint64_t result = 0;
-    for (int a = 0; a < 8; a++)
-        result |= (uint64_t)(*((uint8_t *)(start + a)) << ((7 - a) * 8));
-    
-    return result;
+    uint64_t result;
+    memcpy(&result, start, sizeof(result));
+    return __builtin_bswap64(result);
 }
 
 // Returns the value of a four-byte unsigned big-endian integer that starts at "start"
 uint32_t ReadUInt_4Byte(char *start)
 {
-    uint32_t result = 0;
-    for (int a = 0; a < 4; a++)
-        result |= (uint32_t)(*((uint8_t *)(start + a)) << ((3 - a) * 8));
-    
-    return result;
+    uint32_t result;
+    memcpy(&result, start, sizeof(result));
+    return __builtin_bswap32(result);
 }
 
 // Returns the value of a two-byte unsigned big-endian integer that starts at "start"
 uint16_t ReadUInt_2Byte(char *start)
 {
-    uint16_t result = (uint16_t)((*(uint8_t *)(start + 1)) + (*((uint8_t *)start) << 8));
-    
-    return result;
+    uint16_t result;
+    memcpy(&result, start, sizeof(result));
+    return __builtin_bswap16(result);
+}
+
+// Returns the value of the unsigned byte at "start"
+uint8_t ReadUInt_1Byte(char *start)
+{
+    return (uint8_t)*start;
 }
 
 // Receiving a big-endian integer of "size" bytes starting at "start", calls the appropriate reader for that size of integer
@@ -1044,3 +1335,27 @@ int16_t ReadInt_2Byte(char *start)
     
     return (int16_t)result;
 }
+
+// Returns the value of an eight-byte big-endian floating-point number that starts at "start"
+double ReadReal_8Byte(char *start)
+{
+    uint64_t bits;
+    memcpy(&bits, start, sizeof(bits));
+    bits = __builtin_bswap64(bits);
+    
+    double result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+// Returns the value of a four-byte big-endian floating-point number that starts at "start"
+float ReadReal_4Byte(char *start)
+{
+    uint32_t bits;
+    memcpy(&bits, start, sizeof(bits));
+    bits = __builtin_bswap32(bits);
+    
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
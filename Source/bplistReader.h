@@ -9,7 +9,8 @@
 #ifndef bplistReader_h
 #define bplistReader_h
 
-#define LOCAL_TIME_ZONE  -5
+#define LOCAL_TIME_ZONE    -5 // offset from UTC in hours of the times written when no zone is given with --tz
+#define NSDATE_STRING_SIZE 20 // room for "YYYY-MM-DD HH:MM:SS" plus null terminator
 
 // Possible types of data, as specified by the object's code byte; see Apple's CFBinaryPList.c for original bplist format breakdown
 enum BPObjectTypeCode
@@ -40,6 +41,18 @@ enum BPTimeConvertMode
     kDateSaveShort
 };
 
+struct TimeZone;
+
+// The date of the last day that ConvertNSDate() formatted, so that the dates of messages sent on the same day as the one before don't
+// have to be worked out again, and the zone that times are converted into. Each thread converting dates needs a cache of its own.
+typedef struct BPDateCache
+{
+    int64_t                dcDay;        // the day, counted from the NSDate epoch in local time, or INT64_MIN if none
+    char                   dcPrefix[11]; // "YYYY-MM-DD " for that day; not null-terminated
+    const struct TimeZone *dcZone;       // zone to convert times into, or NULL for a fixed offset of LOCAL_TIME_ZONE hours
+    uint64_t               dcInterval;   // the stretch between transitions of "dcZone" that the last time fell in
+} BPDateCache;
+
 // Ways in which an object indicates the size of its data payload
 enum BPObjectSizeType
 {
@@ -51,6 +64,45 @@ enum BPObjectSizeType
     kSizeAddOne          // payload is x+1 bytes, where 'x' is lower quadbit
 };
 
+// Names of the NSKeyedArchiver/iChat dict keys that we look for. Every ASCII string in a file is matched against these once, when the
+// object header table is built, so that looking up a key in a dict only requires comparing integers.
+enum BPKeySymbol
+{
+    kKeyNone = 0,              // not one of the names below
+    kKeyArchiveVersion,        // "$version"
+    kKeyArchiveObjects,        // "$objects"
+    kKeyArchiveTop,            // "$top"
+    kKeyArchiveClass,          // "$class"
+    kKeyMetadata,              // "metadata"
+    kKeyNS_keys,               // "NS.keys"
+    kKeyNS_objects,            // "NS.objects"
+    kKeyNS_string,             // "NS.string"
+    kKeyNS_time,               // "NS.time"
+    kKeyStatusType,            // "StatusChatItemStatusType"
+    kKeySubject,               // "Subject"
+    kKeySender,                // "Sender"
+    kKeyID,                    // "ID"
+    kKeyTime,                  // "Time"
+    kKeyMessageText,           // "MessageText"
+    kKeyOriginalMessage,       // "OriginalMessage"
+    kKeyNSString,              // "NSString"
+    kKeyNSAttributeInfo,       // "NSAttributeInfo"
+    kKeyNSAttributes,          // "NSAttributes"
+    kKeyParticipants,          // "Participants"
+    kKeyPresentityIDs,         // "PresentityIDs"
+    kKeyFilenameAttribute,     // "__kIMFilenameAttributeName"
+    kKeyBaseWritingDirection,  // "BaseWritingDirection"
+    kKeyCount
+};
+
+// What the marker byte at the start of an object says about it; see gMarkerTable
+typedef struct BPMarkerInfo
+{
+    uint8_t  miType;     // a value from enum BPObjectTypeCode, or kTypeNone if the marker is not used by the format
+    uint8_t  miSizeType; // a value from enum BPObjectSizeType
+    uint16_t miSize;     // size of the payload as given by the marker alone; for kSizeScalarOverflow, 0xF means it follows as an int
+} BPMarkerInfo;
+
 // For storing the information about a given object in the plist, plus its data in whichever type of variable is applicable
 typedef struct BPObject
 {
@@ -62,34 +114,88 @@ typedef struct BPObject
     bool     oBool;        // the data payload will be in one of these members, set in stage 5
     uint64_t oInt;         // used to store Int and UID data types
     double   oReal;        // used to store Real and Date data types
-    char    *oData;        // used to store ASCII and Unicode data types
+    char    *oData;        // used for ASCII, Unicode and Data types; points to the payload in the file, so it is not null-terminated
     bool     oIsBaseWritingDirection;
     bool     oIsNSTime;
 } BPObject;
 
+#define FIELD_PLAN_NO_SLOT 0xFF // marks a key that a field plan's dicts don't have; also the most keys that a plan can cover
+
+// Where each key that we look for sits in dicts whose keys are the same objects in the same order, as NSKeyedArchiver writes the keys of
+// every instance of a class. Looking a key up in a dict that matches a plan is one read instead of a scan of the keys.
+typedef struct BPFieldPlan
+{
+    char    *fpKeyRefs;          // the key references of the first dict seen with this layout, in the mapped file
+    uint64_t fpNumKeys;          // number of keys in the layout
+    uint8_t  fpSlots[kKeyCount]; // position among the keys of each key symbol, or FIELD_PLAN_NO_SLOT if the dicts don't have it
+} BPFieldPlan;
+
+struct BPContext;
+
+// Readers for lists of object references (and offset table entries) of one particular width. Load_bplist() picks the set that matches
+// the file from gRefReaderTable, so that walking a list never has to branch on the width.
+typedef struct BPRefReaders
+{
+    uint64_t (*rrReadRef)(char *refs, uint64_t index); // returns ref number "index" from the list at "refs"
+    
+    // Returns the index among the "count" refs at "refs" of the first one whose object matched key symbol "keySym", or (uint64_t)-1
+    uint64_t (*rrFindKey)(struct BPContext *bc, char *refs, uint64_t count, int keySym);
+} BPRefReaders;
+
+// Everything known about one bplist file. All of the functions that read a file are given its context rather than using globals, so
+// several files can be read at once on different threads.
+typedef struct BPContext
+{
+    // The file itself
+    char     *bcFileContents;  // read-only mapping of the file
+    size_t    bcFileLength;    // size of the mapping
+    
+    // Basic bplist information, read from the trailer by Load_bplist()
+    uint64_t  bcRefSize;       // width of an object reference, in bytes
+    uint64_t  bcNumObj;        // number of objects in the file
+    uint64_t  bcRootObjID;     // UID of the object at the top of the hierarchy
+    char     *bcOffsetTable;   // the offset table in the mapped file; offsets are decoded from it as needed
+    uint64_t  bcObjAreaEnd;    // offset of the end of the object data, which is where the offset table starts
+    const BPRefReaders *bcRefReaders;    // readers for the file's object references, chosen by Load_bplist()
+    const BPRefReaders *bcOffsetReaders; // readers for the file's offset table entries, chosen by Load_bplist()
+    
+    // Object header table, built once by BuildObjectTable() so that LoadObject() does not need to repeat stages 2-4 for every lookup
+    uint8_t  *bcObjTypes;         // type of each object, a value from enum BPObjectTypeCode, or kTypeNone if it was unidentifiable
+    uint64_t *bcObjSizes;         // size of each object's payload, in whatever units its type uses
+    uint8_t  *bcObjHeaderLengths; // number of bytes between the start of each object and its payload
+    uint8_t  *bcObjKeySymbols;    // if an object is an ASCII string, the value from enum BPKeySymbol that it matches, else kKeyNone
+    
+    // For browsing
+    bool      bcFollowRefs;    // whether to follow UIDs to the source or just print the UID #s when printing arrays and dicts
+    char      bcUIDpad[16];    // formatting string for PrintObject() that will pad to the width of the largest UID
+    int       bcIndent;        // how far to indent objects in browsing mode based on file's hierarchy
+    bool      bcPrintedSpaces; // used to prevent multiplied indentation when printing arrays and dicts
+    const struct TimeZone *bcTimeZone; // zone that dates are printed in, or NULL for LOCAL_TIME_ZONE
+} BPContext;
+
 // Allows us to build a table of object type info
 typedef struct BPObjectType
 {
     int    otEnum;     // a value from enum BPObjectTypeCode
-    int    otHighQuad; // upper half of byte identifies the type, sometimes in league with lower half
-    int    otLowQuad;  // if -1, then it is not part of the type code and precedes the count of following bytes/chars/objects
-    int    otSizeType; // a value from enum BPObjectSizeType
     void (*otReadFunc)(BPObject *); // designated function for reading this type of data
-    void (*otPrintFunc)(BPObject *); // designated function for printing this type of data
+    void (*otPrintFunc)(BPContext *, BPObject *); // designated function for printing this type of data
     char  *otName;     // human-readable name of type
 } BPObjectType;
 
-bool     Validate_bplist(void);
-bool     Load_bplist(void);
-void     Browse_bplistElements(void);
-bool     LoadObject(uint64_t objNum, BPObject *obj);
+void     InitBPContext(BPContext *bc);
+void     FreeBPContext(BPContext *bc);
+bool     Validate_bplist(BPContext *bc);
+bool     Load_bplist(BPContext *bc);
+bool     BuildObjectTable(BPContext *bc);
+void     Browse_bplistElements(BPContext *bc);
+bool     LoadObject(BPContext *bc, uint64_t objNum, BPObject *obj);
 bool     LoadObject_S1_Init(uint64_t objNum, BPObject *obj);
-bool     LoadObject_S2_Locate(BPObject *obj);
+bool     LoadObject_S2_Locate(BPContext *bc, BPObject *obj);
 bool     LoadObject_S3_GetType(BPObject *obj);
 bool     LoadObject_S4_ReadSize(BPObject *obj);
 bool     LoadObject_S5_ReadData(BPObject *obj);
-void     CopyObjectMetadata(BPObject *objSrc, BPObject *objDest);
-void     PrintObject(BPObject *obj);
+void     CopyObjectMetadata(BPContext *bc, BPObject *objSrc, BPObject *objDest);
+void     PrintObject(BPContext *bc, BPObject *obj);
 void     ReadData_Null(BPObject *obj);
 void     ReadData_BoolFalse(BPObject *obj);
 void     ReadData_BoolTrue(BPObject *obj);
@@ -104,34 +210,59 @@ void     ReadData_UID(BPObject *obj);
 void     ReadData_Array(BPObject *obj);
 void     ReadData_Set(BPObject *obj);
 void     ReadData_Dict(BPObject *obj);
-void     PrintData_Null(BPObject *obj);
-void     PrintData_BoolFalse(BPObject *obj);
-void     PrintData_BoolTrue(BPObject *obj);
-void     PrintData_Fill(BPObject *obj);
-void     PrintData_Int(BPObject *obj);
-void     PrintData_Real(BPObject *obj);
-void     PrintData_Date(BPObject *obj);
-void     PrintData_Data(BPObject *obj);
-void     PrintData_StringASCII(BPObject *obj);
-void     PrintData_StringUnicode(BPObject *obj);
-void     PrintData_UID(BPObject *obj);
-void     PrintData_Array(BPObject *obj);
-void     PrintData_Set(BPObject *obj);
-void     PrintData_Dict(BPObject *obj);
-uint64_t ReturnValueRefForKeyName(BPObject *dict, char *name);
-uint64_t ReturnElemRef(BPObject *array, uint64_t elem);
-void     ConvertNSDate(double nsDate, char **strDate, int mode);
+void     PrintData_Null(BPContext *bc, BPObject *obj);
+void     PrintData_BoolFalse(BPContext *bc, BPObject *obj);
+void     PrintData_BoolTrue(BPContext *bc, BPObject *obj);
+void     PrintData_Fill(BPContext *bc, BPObject *obj);
+void     PrintData_Int(BPContext *bc, BPObject *obj);
+void     PrintData_Real(BPContext *bc, BPObject *obj);
+void     PrintData_Date(BPContext *bc, BPObject *obj);
+void     PrintData_Data(BPContext *bc, BPObject *obj);
+void     PrintData_StringASCII(BPContext *bc, BPObject *obj);
+void     PrintData_StringUnicode(BPContext *bc, BPObject *obj);
+void     PrintData_UID(BPContext *bc, BPObject *obj);
+void     PrintData_Array(BPContext *bc, BPObject *obj);
+void     PrintData_Set(BPContext *bc, BPObject *obj);
+void     PrintData_Dict(BPContext *bc, BPObject *obj);
+uint64_t ReturnValueRefForKeyName(BPContext *bc, BPObject *dict, char *name);
+uint64_t ReturnValueRefForKey(BPContext *bc, BPObject *dict, int key);
+bool     CompileFieldPlan(BPContext *bc, BPObject *dict, BPFieldPlan *plan);
+bool     DictMatchesFieldPlan(BPContext *bc, BPObject *dict, const BPFieldPlan *plan);
+uint64_t ReturnPlannedValueRef(BPContext *bc, const BPFieldPlan *plan, BPObject *dict, int key);
+int      LookUpKeySymbol(const char *name, uint64_t length);
+uint64_t ReturnObjectOffset(BPContext *bc, uint64_t objNum);
+uint64_t ReturnPayloadUnitSize(BPContext *bc, int oType);
+int      ReturnKeySymbol(BPContext *bc, uint64_t objNum);
+uint64_t ReturnElemRef(BPContext *bc, BPObject *array, uint64_t elem);
+bool     StringObjectEquals(BPObject *obj, const char *str);
+void     ConvertNSDate(double nsDate, char *strDate, int mode, BPDateCache *cache);
+void     InitDateCache(BPDateCache *cache, const struct TimeZone *zone);
+bool     CacheNSDateDay(BPDateCache *cache, int64_t day);
+void     CivilFromDays(int64_t days, int *year, int *month, int *day);
+int64_t  DaysFromCivil(int year, int month, int day);
+void     WriteTwoDigits(char *dest, int value);
 void     PrintWideString(char *strPtr, uint64_t strSize);
 void     PrintTypeName(int oType);
-void     PrintSpaces(int spaceNum);
+void     PrintSpaces(BPContext *bc, int spaceNum);
 void     PrintBinary(uint64_t inNumber, int inBytes);
+uint64_t ReadRef_1Byte(char *refs, uint64_t index);
+uint64_t ReadRef_2Byte(char *refs, uint64_t index);
+uint64_t ReadRef_4Byte(char *refs, uint64_t index);
+uint64_t ReadRef_8Byte(char *refs, uint64_t index);
+uint64_t FindKey_1Byte(BPContext *bc, char *refs, uint64_t count, int keySym);
+uint64_t FindKey_2Byte(BPContext *bc, char *refs, uint64_t count, int keySym);
+uint64_t FindKey_4Byte(BPContext *bc, char *refs, uint64_t count, int keySym);
+uint64_t FindKey_8Byte(BPContext *bc, char *refs, uint64_t count, int keySym);
 uint64_t ReadUInt_XByte(char *start, uint64_t size);
 uint64_t ReadUInt_8Byte(char *start);
 uint32_t ReadUInt_4Byte(char *start);
 uint16_t ReadUInt_2Byte(char *start);
+uint8_t  ReadUInt_1Byte(char *start);
 int64_t  ReadInt_XByte(char *start, uint64_t size);
 int64_t  ReadInt_8Byte(char *start);
 int32_t  ReadInt_4Byte(char *start);
 int16_t  ReadInt_2Byte(char *start);
+double   ReadReal_8Byte(char *start);
+float    ReadReal_4Byte(char *start);
 
 #endif /* bplistReader_h */
@@ -7,38 +7,89 @@
 //
 
 #include <locale.h>  // setlocale()
+#include <pthread.h> // pthread_create()
+#include <stdarg.h>  // va_list
 #include <stdbool.h> // bool
+#include <stdint.h>  // uint64_t
 #include <stdio.h>   // fprintf()
 #include <stdlib.h>  // malloc()
 #include <string.h>  // strcpy()
+#include "Arena.h"
 #include "bplistReader.h"
 #include "FileIO.h"
 #include "ichatReader.h"
+#include "TextConversion.h"
 
 #pragma mark Globals
-const int kVersion_ichat = 100000; // only known version of iChat log format
+const int      kVersion_ichat = 100000;       // only known version of iChat log format
+const size_t   kMessageArenaSize = 64 * 1024; // starting size of "icMessageArena"; it grows if a message needs more
+const size_t   kChunkSinkSize = 256 * 1024;   // starting size of the out sink for each chunk of a log converted in parallel
+const uint64_t kMinMessagesPerChunk = 2048;   // a log is only split across threads if each chunk gets at least this many messages
 
-BPObject gObjectsArray;            // "$objects", the array object that points to all chat messages and metadata
-BPObject gMessageListArray;        // the array object that points to all messages in the chat
-uint64_t gNumParticipantNames = 0; // number of account IDs pointed to by gParticipantNames
-char   **gParticipantNames = NULL; // pointer to array of pointers to "real" names of participants
-uint64_t gNumParticipantIDs = 0;   // number of account IDs pointed to by gParticipantIDs
-char   **gParticipantIDs = NULL;   // pointer to array of pointers to account IDs of participants
-char    *gFirstMsgTime = NULL;     // long-format timestamp representing beginning of chat
-char    *gClientName = "iChat";    // name to use when message sender is the chat client itself
-
-extern uint64_t gRootObjID;
-extern bool     gUseRealNames;
-extern bool     gTrimEmailIDs;
+char *gClientName = "iChat"; // name to use when message sender is the chat client itself
 
 #pragma mark Chat-level functions
+// Set up "ic" for reading the iChat log in the bplist loaded into "bc". The options are left off for the caller to fill in.
+void InitICContext(ICContext *ic, BPContext *bc)
+{
+    ic->icBP = bc;
+    LoadObject_S1_Init(0, &ic->icObjectsArray);
+    LoadObject_S1_Init(0, &ic->icMessageListArray);
+    ic->icNumParticipantNames = 0;
+    ic->icParticipantNames = NULL;
+    ic->icNumParticipantIDs = 0;
+    ic->icParticipantIDs = NULL;
+    ic->icSenders = NULL;
+    ic->icSendersCapacity = 0;
+    ic->icNumSenders = 0;
+    ic->icAccountChains = NULL;
+    ic->icAccountChainsCapacity = 0;
+    ic->icNumAccountChains = 0;
+    ic->icAccountChainHits = 0;
+    ic->icAccountChainMisses = 0;
+    ic->icNumFieldPlans = 0;
+    ic->icFirstMsgTime[0] = '\0';
+    InitDateCache(&ic->icDateCache, NULL);
+    InitArena(&ic->icMessageArena, 0);
+    ic->icFirstMsgHeapAllocs = 0;
+    InitOutSink(&ic->icOutSink);
+    ic->icReport = NULL;
+    ic->icOutFileBase = NULL;
+    ic->icUseRealNames = false;
+    ic->icTrimEmailIDs = false;
+    ic->icOverwriteFile = false;
+    ic->icPrintStats = false;
+    ic->icNumThreads = 1;
+    ic->icTimeZone = NULL;
+}
+
+// Free the participant names and IDs loaded by Load_ichat() and the tables of senders and account chains
+void FreeICContext(ICContext *ic)
+{
+    FreeSenderTable(ic);
+    FreeAccountChains(ic);
+    
+    for (uint64_t a = 0; ic->icParticipantNames != NULL && a < ic->icNumParticipantNames; a++)
+        free(ic->icParticipantNames[a]);
+    free(ic->icParticipantNames);
+    ic->icParticipantNames = NULL;
+    ic->icNumParticipantNames = 0;
+    
+    for (uint64_t a = 0; ic->icParticipantIDs != NULL && a < ic->icNumParticipantIDs; a++)
+        free(ic->icParticipantIDs[a]);
+    free(ic->icParticipantIDs);
+    ic->icParticipantIDs = NULL;
+    ic->icNumParticipantIDs = 0;
+}
+
 // Determine if this binary plist is an iChat log
-bool Validate_ichat(void)
+bool Validate_ichat(ICContext *ic)
 {
+    BPContext *bc = ic->icBP;
     BPObject root, value;
     
     // Load root object, which should be a dictionary
-    if (!LoadObject(gRootObjID, &root))
+    if (!LoadObject(bc, bc->bcRootObjID, &root))
         return false;
     if (root.oType != kTypeDict)
     {
@@ -47,13 +98,13 @@ bool Validate_ichat(void)
     }
     
     // Look for "$version" in root dict, which should be an 'int'
-    uint64_t valueRef = ReturnValueRefForKeyName(&root, "$version");
+    uint64_t valueRef = ReturnValueRefForKey(bc, &root, kKeyArchiveVersion);
     if (valueRef == (uint64_t)-1)
     {
         //printf("Could not find '$version' in root object, so this is probably not an iChat log.\n");
         return false;
     }
-    if (!LoadObject(valueRef, &value))
+    if (!LoadObject(bc, valueRef, &value))
         return false;
     if (value.oType != kTypeInt)
     {
@@ -69,15 +120,15 @@ bool Validate_ichat(void)
     }
     
     // Locate "$objects" array which contains the chat messages
-    valueRef = ReturnValueRefForKeyName(&root, "$objects");
+    valueRef = ReturnValueRefForKey(bc, &root, kKeyArchiveObjects);
     if (valueRef == (uint64_t)-1)
     {
         //printf("Could not find '$objects' in file, so this is probably not an iChat log.\n");
         return false;
     }
-    if (!LoadObject(valueRef, &gObjectsArray))
+    if (!LoadObject(bc, valueRef, &ic->icObjectsArray))
         return false;
-    if (gObjectsArray.oType != kTypeArray)
+    if (ic->icObjectsArray.oType != kTypeArray)
     {
         //printf("Found '$objects' but it is not an array!\n");
         return false;
@@ -87,7 +138,7 @@ bool Validate_ichat(void)
 }
 
 // Load any relevant metadata about chat
-bool Load_ichat(void)
+bool Load_ichat(ICContext *ic)
 {
 #define DieIf(boole) \
 if (boole) \
@@ -97,47 +148,50 @@ return false; \
 } \
 do {} while (0)
     
+    BPContext *bc = ic->icBP;
+    InitDateCache(&ic->icDateCache, ic->icTimeZone);
+    
     /* Load list of message IDs into memory */
     BPObject messageListDict;
     
     // Load dict with array of message IDs
-    uint64_t messageListDictRef = ReturnElemRef(&gObjectsArray, 4);
+    uint64_t messageListDictRef = ReturnElemRef(bc, &ic->icObjectsArray, 4);
     DieIf(messageListDictRef == (uint64_t)-1);
-    DieIf(!LoadObject(messageListDictRef, &messageListDict));
+    DieIf(!LoadObject(bc, messageListDictRef, &messageListDict));
     DieIf(messageListDict.oType != kTypeDict);
     
     // Load array of message IDs
-    uint64_t messageListArrayRef = ReturnValueRefForKeyName(&messageListDict, "NS.objects");
+    uint64_t messageListArrayRef = ReturnValueRefForKey(bc, &messageListDict, kKeyNS_objects);
     DieIf(messageListArrayRef == (uint64_t)-1);
-    DieIf(!LoadObject(messageListArrayRef, &gMessageListArray));
-    DieIf(gMessageListArray.oType != kTypeArray);
+    DieIf(!LoadObject(bc, messageListArrayRef, &ic->icMessageListArray));
+    DieIf(ic->icMessageListArray.oType != kTypeArray);
     
     /* Load "real names" and account IDs of participants into memory */
     BPObject root, top, metadataID, metadata, metadataKeys, metadataValues, participantsDictID, participantsDict, participantsArray, participantID, participant, participantName, presentityDictID, presentityDict, presentityArray, presentityID, presentity, presentityName;
     
     // Look for dict called "$top" in root object
-    DieIf(!LoadObject(gRootObjID, &root));
-    uint64_t topRef = ReturnValueRefForKeyName(&root, "$top");
+    DieIf(!LoadObject(bc, bc->bcRootObjID, &root));
+    uint64_t topRef = ReturnValueRefForKey(bc, &root, kKeyArchiveTop);
     DieIf(topRef == (uint64_t)-1);
-    DieIf(!LoadObject(topRef, &top));
+    DieIf(!LoadObject(bc, topRef, &top));
     DieIf(top.oType != kTypeDict);
     
     // Look for "metadata" in dict, which is a UID leading to the metadata dict
-    uint64_t metadataIDRef = ReturnValueRefForKeyName(&top, "metadata");
+    uint64_t metadataIDRef = ReturnValueRefForKey(bc, &top, kKeyMetadata);
     DieIf(metadataIDRef == (uint64_t)-1);
-    DieIf(!LoadObject(metadataIDRef, &metadataID));
+    DieIf(!LoadObject(bc, metadataIDRef, &metadataID));
     DieIf(metadataID.oType != kTypeUID);
     
     // Load metadata dict with that UID
-    uint64_t metadataDictRef = ReturnElemRef(&gObjectsArray, metadataID.oInt);
+    uint64_t metadataDictRef = ReturnElemRef(bc, &ic->icObjectsArray, metadataID.oInt);
     DieIf(metadataDictRef == (uint64_t)-1);
-    DieIf(!LoadObject(metadataDictRef, &metadata));
+    DieIf(!LoadObject(bc, metadataDictRef, &metadata));
     DieIf(metadata.oType != kTypeDict);
     
     // Load "NS.keys" in metadata
-    uint64_t metadataKeysRef = ReturnValueRefForKeyName(&metadata, "NS.keys");
+    uint64_t metadataKeysRef = ReturnValueRefForKey(bc, &metadata, kKeyNS_keys);
     DieIf(metadataKeysRef == (uint64_t)-1);
-    DieIf(!LoadObject(metadataKeysRef, &metadataKeys));
+    DieIf(!LoadObject(bc, metadataKeysRef, &metadataKeys));
     DieIf(metadataKeys.oType != kTypeArray);
     
     // Search "NS.keys" array for keys called "Participants" and "PresentityIDs"
@@ -147,249 +201,240 @@ do {} while (0)
         BPObject metadataKeyID, metadataKey;
         
         // Load UID that points to name of this key
-        uint64_t metadataKeyIDref = ReturnElemRef(&metadataKeys, (uint64_t)a);
+        uint64_t metadataKeyIDref = ReturnElemRef(bc, &metadataKeys, (uint64_t)a);
         DieIf(metadataKeyIDref == (uint64_t)-1);
-        DieIf(!LoadObject(metadataKeyIDref, &metadataKeyID));
+        DieIf(!LoadObject(bc, metadataKeyIDref, &metadataKeyID));
         DieIf(metadataKeyID.oType != kTypeUID);
         
         // Load name of this key
-        uint64_t metadataKeyRef = ReturnElemRef(&gObjectsArray, metadataKeyID.oInt);
+        uint64_t metadataKeyRef = ReturnElemRef(bc, &ic->icObjectsArray, metadataKeyID.oInt);
         DieIf(metadataKeyRef == (uint64_t)-1);
-        DieIf(!LoadObject(metadataKeyRef, &metadataKey));
+        DieIf(!LoadObject(bc, metadataKeyRef, &metadataKey));
         DieIf(metadataKey.oType != kTypeStringASCII);
         
-        if (!strcmp(metadataKey.oData, "Participants"))
+        if (ReturnKeySymbol(bc, metadataKeyRef) == kKeyParticipants)
             partIndex = a;
-        else if (!strcmp(metadataKey.oData, "PresentityIDs"))
+        else if (ReturnKeySymbol(bc, metadataKeyRef) == kKeyPresentityIDs)
             presIndex = a;
     }
     DieIf(partIndex == -1);
     DieIf(presIndex == -1);
     
     // Load "NS.objects" array that corresponds to "NS.keys"
-    uint64_t metadataValuesRef = ReturnValueRefForKeyName(&metadata, "NS.objects");
+    uint64_t metadataValuesRef = ReturnValueRefForKey(bc, &metadata, kKeyNS_objects);
     DieIf(metadataValuesRef == (uint64_t)-1);
-    DieIf(!LoadObject(metadataValuesRef, &metadataValues));
+    DieIf(!LoadObject(bc, metadataValuesRef, &metadataValues));
     DieIf(metadataValues.oType != kTypeArray);
     
     // Load UID in "NS.objects" that points to the dict that represents the value corresponding to the "Participants" key
-    uint64_t participantsIDref = ReturnElemRef(&metadataValues, (uint64_t)partIndex);
+    uint64_t participantsIDref = ReturnElemRef(bc, &metadataValues, (uint64_t)partIndex);
     DieIf(participantsIDref == (uint64_t)-1);
-    DieIf(!LoadObject(participantsIDref, &participantsDictID));
+    DieIf(!LoadObject(bc, participantsIDref, &participantsDictID));
     DieIf(participantsDictID.oType != kTypeUID);
     
     // Load the dict that represents the value corresponding to the "Participants" key
-    uint64_t participantsDictRef = ReturnElemRef(&gObjectsArray, participantsDictID.oInt);
+    uint64_t participantsDictRef = ReturnElemRef(bc, &ic->icObjectsArray, participantsDictID.oInt);
     DieIf(participantsDictRef == (uint64_t)-1);
-    DieIf(!LoadObject(participantsDictRef, &participantsDict));
+    DieIf(!LoadObject(bc, participantsDictRef, &participantsDict));
     DieIf(participantsDict.oType != kTypeDict);
     
     // Load the array in the dict that references a dict/string for each participant
-    uint64_t participantsListArrayRef = ReturnValueRefForKeyName(&participantsDict, "NS.objects");
+    uint64_t participantsListArrayRef = ReturnValueRefForKey(bc, &participantsDict, kKeyNS_objects);
     DieIf(participantsListArrayRef == (uint64_t)-1);
-    DieIf(!LoadObject(participantsListArrayRef, &participantsArray));
+    DieIf(!LoadObject(bc, participantsListArrayRef, &participantsArray));
     DieIf(participantsArray.oType != kTypeArray);
     
     // Record number of participants (might be a group chat) and allocate space for pointers to their names
-    gNumParticipantNames = participantsArray.oSize;
-    gParticipantNames = malloc(gNumParticipantNames * sizeof(char *)); // freed on program quit
-    for (int a = 0; a < gNumParticipantNames; a++)
-        gParticipantNames[a] = NULL;
+    ic->icNumParticipantNames = participantsArray.oSize;
+    ic->icParticipantNames = malloc(ic->icNumParticipantNames * sizeof(char *)); // freed with FreeICContext()
+    for (int a = 0; a < ic->icNumParticipantNames; a++)
+        ic->icParticipantNames[a] = NULL;
     
     // Read names of participants into memory
-    for (int a = 0; a < gNumParticipantNames; a++)
+    for (int a = 0; a < ic->icNumParticipantNames; a++)
     {
         // Load UID pointing to name dict/string
-        uint64_t nameID_IDref = ReturnElemRef(&participantsArray, (uint64_t)a);
+        uint64_t nameID_IDref = ReturnElemRef(bc, &participantsArray, (uint64_t)a);
         DieIf(nameID_IDref == (uint64_t)-1);
-        DieIf(!LoadObject(nameID_IDref, &participantID));
+        DieIf(!LoadObject(bc, nameID_IDref, &participantID));
         DieIf(participantID.oType != kTypeUID);
         
         // Load name dict/string
-        uint64_t participantRef = ReturnElemRef(&gObjectsArray, participantID.oInt);
+        uint64_t participantRef = ReturnElemRef(bc, &ic->icObjectsArray, participantID.oInt);
         DieIf(participantRef == (uint64_t)-1);
-        DieIf(!LoadObject(participantRef, &participant));
+        DieIf(!LoadObject(bc, participantRef, &participant));
         
         // The chat client user's name may be stored in a dict, whereas other participants are stored as straight ASCII strings,
         // so read name differently depending on what kind of object we just got
         if (participant.oType == kTypeDict)
         {
             // Look up value for key "NS.string"
-            uint64_t participantNameRef = ReturnValueRefForKeyName(&participant, "NS.string");
+            uint64_t participantNameRef = ReturnValueRefForKey(bc, &participant, kKeyNS_string);
             DieIf(participantNameRef == (uint64_t)-1);
-            DieIf(!LoadObject(participantNameRef, &participantName));
+            DieIf(!LoadObject(bc, participantNameRef, &participantName));
             DieIf(participantName.oType != kTypeStringASCII);
             
             // Save participant's name
             if (participantName.oSize > 0)
             {
-                gParticipantNames[a] = malloc(participantName.oSize + 1); // freed on program quit
-                strncpy(gParticipantNames[a], participantName.oData, participantName.oSize);
-                gParticipantNames[a][participantName.oSize] = '\0';
+                ic->icParticipantNames[a] = malloc(participantName.oSize + 1); // freed with FreeICContext()
+                memcpy(ic->icParticipantNames[a], participantName.oData, participantName.oSize);
+                ic->icParticipantNames[a][participantName.oSize] = '\0';
             }
             else
-                asprintf(&gParticipantNames[a], "%s", "<empty>");
+                asprintf(&ic->icParticipantNames[a], "%s", "<empty>");
         }
         else if (participant.oType == kTypeStringASCII)
         {
             // Save participant's name
             if (participant.oSize > 0)
             {
-                gParticipantNames[a] = malloc(participant.oSize + 1); // freed on program quit
-                strncpy(gParticipantNames[a], participant.oData, participant.oSize);
-                gParticipantNames[a][participant.oSize] = '\0';
+                ic->icParticipantNames[a] = malloc(participant.oSize + 1); // freed with FreeICContext()
+                memcpy(ic->icParticipantNames[a], participant.oData, participant.oSize);
+                ic->icParticipantNames[a][participant.oSize] = '\0';
             }
             else
-                asprintf(&gParticipantNames[a], "%s", "<empty>");
+                asprintf(&ic->icParticipantNames[a], "%s", "<empty>");
         }
         else if (participant.oType == kTypeStringUnicode)
         {
-            // This is probably because the participant name is embedded in "left-to-right" tags (0x202A/0x202C); we will strip all
-            // Unicode characters as we translate to UTF-8 to produce a straight ASCII string, for simplicity's sake
-            gParticipantNames[a] = calloc((participant.oSize * 2) + 1, 1); // freed on program quit
-            for (int b = 0; b < participant.oSize * 2; b += 2)
-            {
-                char *bytes = NULL;
-                ConvertUnicodeToUTF8((participant.oData + b), &bytes);
-                if (strlen(bytes) == 1)
-                    strcat(gParticipantNames[a], bytes);
-            }
-            // If all of the text was Unicode characters, we have an empty string on our hands, so put something in it
-            if (strlen(gParticipantNames[a]) == 0)
+            // This is probably because the participant name is embedded in "left-to-right" tags (0x202A/0x202C); the tags are
+            // dropped as the name is converted to UTF-8
+            ic->icParticipantNames[a] = malloc((participant.oSize * 3) + 1); // freed with FreeICContext()
+            
+            // If all of the text was tags, we have an empty string on our hands, so put something in it
+            if (ConvertUnicodeName(&participant, ic->icParticipantNames[a]) == 0)
             {
-                free(gParticipantNames[a]);
-                asprintf(&gParticipantNames[a], "%s", "<Unicode>");
+                free(ic->icParticipantNames[a]);
+                asprintf(&ic->icParticipantNames[a], "%s", "<Unicode>");
             }
         }
         else DieIf(true);
     }
     
     // Load UID in "NS.objects" that points to the dict that represents the value corresponding to the "PresentityIDs" key
-    uint64_t presentityIDref = ReturnElemRef(&metadataValues, (uint64_t)presIndex);
+    uint64_t presentityIDref = ReturnElemRef(bc, &metadataValues, (uint64_t)presIndex);
     DieIf(presentityIDref == (uint64_t)-1);
-    DieIf(!LoadObject(presentityIDref, &presentityDictID));
+    DieIf(!LoadObject(bc, presentityIDref, &presentityDictID));
     DieIf(presentityDictID.oType != kTypeUID);
     
     // Load the dict that represents the value corresponding to the "PresentityIDs" key
-    uint64_t presentityDictRef = ReturnElemRef(&gObjectsArray, presentityDictID.oInt);
+    uint64_t presentityDictRef = ReturnElemRef(bc, &ic->icObjectsArray, presentityDictID.oInt);
     DieIf(presentityDictRef == (uint64_t)-1);
-    DieIf(!LoadObject(presentityDictRef, &presentityDict));
+    DieIf(!LoadObject(bc, presentityDictRef, &presentityDict));
     DieIf(presentityDict.oType != kTypeDict);
     
     // Load the array in the dict that references a dict/string for each account ID
-    uint64_t presentityListArrayRef = ReturnValueRefForKeyName(&presentityDict, "NS.objects");
+    uint64_t presentityListArrayRef = ReturnValueRefForKey(bc, &presentityDict, kKeyNS_objects);
     DieIf(presentityListArrayRef == (uint64_t)-1);
-    DieIf(!LoadObject(presentityListArrayRef, &presentityArray));
+    DieIf(!LoadObject(bc, presentityListArrayRef, &presentityArray));
     DieIf(presentityArray.oType != kTypeArray);
     
     // Record number of account IDs (might be a group chat) and allocate space for pointers to their IDs
-    gNumParticipantIDs = presentityArray.oSize;
-    gParticipantIDs = malloc(gNumParticipantIDs * sizeof(char *)); // freed on program quit
-    for (int a = 0; a < gNumParticipantIDs; a++)
-        gParticipantIDs[a] = NULL;
+    ic->icNumParticipantIDs = presentityArray.oSize;
+    ic->icParticipantIDs = malloc(ic->icNumParticipantIDs * sizeof(char *)); // freed with FreeICContext()
+    for (int a = 0; a < ic->icNumParticipantIDs; a++)
+        ic->icParticipantIDs[a] = NULL;
     
     // Read account IDs of participants into memory
-    for (int a = 0; a < gNumParticipantIDs; a++)
+    for (int a = 0; a < ic->icNumParticipantIDs; a++)
     {
         // Load UID pointing to account ID dict/string
-        uint64_t nameID_IDref = ReturnElemRef(&presentityArray, (uint64_t)a);
+        uint64_t nameID_IDref = ReturnElemRef(bc, &presentityArray, (uint64_t)a);
         DieIf(nameID_IDref == (uint64_t)-1);
-        DieIf(!LoadObject(nameID_IDref, &presentityID));
+        DieIf(!LoadObject(bc, nameID_IDref, &presentityID));
         DieIf(presentityID.oType != kTypeUID);
         
         // Load account ID dict/string
-        uint64_t presentityRef = ReturnElemRef(&gObjectsArray, presentityID.oInt);
+        uint64_t presentityRef = ReturnElemRef(bc, &ic->icObjectsArray, presentityID.oInt);
         DieIf(presentityRef == (uint64_t)-1);
-        DieIf(!LoadObject(presentityRef, &presentity));
+        DieIf(!LoadObject(bc, presentityRef, &presentity));
         
         // The chat client user's account ID may be stored in a dict, whereas other participants are stored as straight ASCII strings,
         // so read ID differently depending on what kind of object we just got
         if (presentity.oType == kTypeDict)
         {
             // Look up value for key "NS.string"
-            uint64_t presentityNameRef = ReturnValueRefForKeyName(&presentity, "NS.string");
+            uint64_t presentityNameRef = ReturnValueRefForKey(bc, &presentity, kKeyNS_string);
             DieIf(presentityNameRef == (uint64_t)-1);
-            DieIf(!LoadObject(presentityNameRef, &presentityName));
+            DieIf(!LoadObject(bc, presentityNameRef, &presentityName));
             DieIf(presentityName.oType != kTypeStringASCII);
             
             // Save participant's account ID
             if (presentityName.oSize > 0)
             {
-                gParticipantIDs[a] = malloc(presentityName.oSize + 1); // freed on program quit
-                strncpy(gParticipantIDs[a], presentityName.oData, presentityName.oSize);
-                gParticipantIDs[a][presentityName.oSize] = '\0';
+                ic->icParticipantIDs[a] = malloc(presentityName.oSize + 1); // freed with FreeICContext()
+                memcpy(ic->icParticipantIDs[a], presentityName.oData, presentityName.oSize);
+                ic->icParticipantIDs[a][presentityName.oSize] = '\0';
                 
-                if (gTrimEmailIDs)
+                if (ic->icTrimEmailIDs)
                 {
-                    char *atPosition = strchr(gParticipantIDs[a], '@');
+                    char *atPosition = strchr(ic->icParticipantIDs[a], '@');
                     if (atPosition != NULL)
                         *atPosition = '\0'; // end string at '@'
                 }
             }
             else
-                asprintf(&gParticipantIDs[a], "%s", "<empty>");
+                asprintf(&ic->icParticipantIDs[a], "%s", "<empty>");
         }
         else if (presentity.oType == kTypeStringASCII)
         {
             // Save participant's account ID
             if (presentity.oSize > 0)
             {
-                gParticipantIDs[a] = malloc(presentity.oSize + 1); // freed on program quit
-                strncpy(gParticipantIDs[a], presentity.oData, presentity.oSize);
-                gParticipantIDs[a][presentity.oSize] = '\0';
+                ic->icParticipantIDs[a] = malloc(presentity.oSize + 1); // freed with FreeICContext()
+                memcpy(ic->icParticipantIDs[a], presentity.oData, presentity.oSize);
+                ic->icParticipantIDs[a][presentity.oSize] = '\0';
                 
-                if (gTrimEmailIDs)
+                if (ic->icTrimEmailIDs)
                 {
-                    char *atPosition = strchr(gParticipantIDs[a], '@');
+                    char *atPosition = strchr(ic->icParticipantIDs[a], '@');
                     if (atPosition != NULL)
                         *atPosition = '\0'; // end string at '@'
                 }
             }
             else
-                asprintf(&gParticipantIDs[a], "%s", "<empty>");
+                asprintf(&ic->icParticipantIDs[a], "%s", "<empty>");
         }
         else if (presentity.oType == kTypeStringUnicode)
         {
             // I have not encountered this case in a chat log, so simply apply the approach used for Unicode participant names (see
             // comment under line "else if (participant.oType == kTypeStringUnicode)" above) and hope that it works
-            gParticipantIDs[a] = calloc((presentity.oSize * 2) + 1, 1); // freed on program quit
-            for (int b = 0; b < presentity.oSize * 2; b += 2)
-            {
-                char *bytes = NULL;
-                ConvertUnicodeToUTF8((presentity.oData + b), &bytes);
-                if (strlen(bytes) == 1)
-                    strcat(gParticipantIDs[a], bytes);
-            }
-            // If all of the text was Unicode characters, we have an empty string on our hands, so put something in it
-            if (strlen(gParticipantIDs[a]) == 0)
+            ic->icParticipantIDs[a] = malloc((presentity.oSize * 3) + 1); // freed with FreeICContext()
+            
+            // If all of the text was tags, we have an empty string on our hands, so put something in it
+            if (ConvertUnicodeName(&presentity, ic->icParticipantIDs[a]) == 0)
             {
-                free(gParticipantIDs[a]);
-                asprintf(&gParticipantIDs[a], "%s", "<Unicode>");
+                free(ic->icParticipantIDs[a]);
+                asprintf(&ic->icParticipantIDs[a], "%s", "<Unicode>");
             }
         }
         else DieIf(true);
     }
     
     /*printf("Got the following IDs and \"real names\":\n");
-    for (int a = 0; a < gNumParticipantIDs; a++)
-        printf("ID %d: %s\n", a, gParticipantIDs[a]);
-    for (int a = 0; a < gNumParticipantNames; a++)
-        printf("Name %d: %s\n", a, gParticipantNames[a]);*/
+    for (int a = 0; a < ic->icNumParticipantIDs; a++)
+        printf("ID %d: %s\n", a, ic->icParticipantIDs[a]);
+    for (int a = 0; a < ic->icNumParticipantNames; a++)
+        printf("Name %d: %s\n", a, ic->icParticipantNames[a]);*/
+    
+    DieIf(!BuildSenderTable(ic));
     
     return true;
 #undef DieIf
 }
 
 // Allow user to browse iChat log's "$objects" array interactively
-void Browse_ichatObjects(void)
+void Browse_ichatObjects(ICContext *ic)
 {
+    BPContext *bc = ic->icBP;
     BPObject o;
     char input[10];
     int inputted = 0;
     uint64_t inputNum = 0;
     do
     {
-        printf("Type any letter to exit, or enter the UID [0-%llu] of the item in '$objects' to print:\n", gObjectsArray.oSize - 1);
+        printf("Type any letter to exit, or enter the UID [0-%llu] of the item in '$objects' to print:\n", ic->icObjectsArray.oSize - 1);
         if (fgets(input, 10, stdin) != NULL)
             inputted = sscanf(input, "%llu", &inputNum);
         
@@ -399,33 +444,35 @@ void Browse_ichatObjects(void)
             break;
         }
         
-        if (inputNum >= gObjectsArray.oSize)
+        if (inputNum >= ic->icObjectsArray.oSize)
         {
             printf("Error: Input %lld out of range. Try again.\n", inputNum);
             continue;
         }
         
-        uint64_t UID = ReturnElemRef(&gObjectsArray, inputNum);
+        uint64_t UID = ReturnElemRef(bc, &ic->icObjectsArray, inputNum);
         if (UID == (uint64_t)-1)
             return;
-        if (!LoadObject(UID, &o))
+        if (!LoadObject(bc, UID, &o))
             return;
-        PrintObject(&o);
+        PrintObject(bc, &o);
     }
     while (true);
 }
 
 // Allow user to browse message objects smartly
-void Browse_ichatMessages(void)
+void Browse_ichatMessages(ICContext *ic)
 {
+    BPContext *bc = ic->icBP;
     BPObject BPmsg;
     ICMessage ICmsg;
     char input[10];
     int inputted = 0;
     int64_t inputNum = 0;
+    InitArena(&ic->icMessageArena, kMessageArenaSize);
     do
     {
-        printf("Type any letter to exit, or enter the number [1-%llu] of the chat message to print, or enter 0 to print the whole chat:\n", gMessageListArray.oSize);
+        printf("Type any letter to exit, or enter the number [1-%llu] of the chat message to print, or enter 0 to print the whole chat:\n", ic->icMessageListArray.oSize);
         if (fgets(input, 10, stdin) != NULL)
             inputted = sscanf(input, "%lld", &inputNum);
         
@@ -437,26 +484,28 @@ void Browse_ichatMessages(void)
         
         if (inputNum == 0)
         {
-            for (int a = 0; a < gMessageListArray.oSize; a++)
+            for (int a = 0; a < ic->icMessageListArray.oSize; a++)
             {
-                uint64_t msgIDref = ReturnMessageRef((uint64_t)a);
+                uint64_t msgIDref = ReturnMessageRef(ic, (uint64_t)a);
                 if (msgIDref == (uint64_t)-1) return;
-                if (!LoadObject(msgIDref, &BPmsg)) return;
+                if (!LoadObject(bc, msgIDref, &BPmsg)) return;
                 InitMessage(&ICmsg);
-                if (LoadMessage(&BPmsg, &ICmsg, (a == 0)))
+                if (LoadMessage(ic, &BPmsg, &ICmsg, (a == 0)))
                     PrintMessage(&ICmsg);
                 DeleteMessage(&ICmsg);
+                ResetArena(&ic->icMessageArena);
             }
         }
-        else if (inputNum >= 1 && inputNum <= gMessageListArray.oSize)
+        else if (inputNum >= 1 && inputNum <= ic->icMessageListArray.oSize)
         {
-            uint64_t msgIDref = ReturnMessageRef((uint64_t)inputNum - 1);
+            uint64_t msgIDref = ReturnMessageRef(ic, (uint64_t)inputNum - 1);
             if (msgIDref == (uint64_t)-1) return;
-            if (!LoadObject(msgIDref, &BPmsg)) return;
+            if (!LoadObject(bc, msgIDref, &BPmsg)) return;
             InitMessage(&ICmsg);
-            if (LoadMessage(&BPmsg, &ICmsg, false))
+            if (LoadMessage(ic, &BPmsg, &ICmsg, false))
                 PrintMessage(&ICmsg);
             DeleteMessage(&ICmsg);
+            ResetArena(&ic->icMessageArena);
         }
         else
         {
@@ -465,48 +514,201 @@ void Browse_ichatMessages(void)
         }
     }
     while (true);
+    FreeArena(&ic->icMessageArena);
 }
 
-// Convert iChat log to TXT or RTF based on "useRTF"
-void Convert_ichat(bool useRTF)
+// Convert iChat log to TXT or RTF based on "useRTF". Returns whether the whole log was converted.
+bool Convert_ichat(ICContext *ic, bool useRTF)
 {
-    if (!CreateOutFile(useRTF))
-        return;
+    if (!CreateOutFile(&ic->icOutSink, ic->icOutFileBase, useRTF, ic->icOverwriteFile))
+        return false;
     
+    return FinishConvertedLog(ic, FormatLog(ic, useRTF));
+}
+
+// Write the log as TXT or RTF, based on "useRTF", to "icOutSink", which must already have an out file attached. The message arena is
+// left for FinishConvertedLog() to report on and free. Returns whether every message was converted.
+bool FormatLog(ICContext *ic, bool useRTF)
+{
     if (useRTF)
-        WriteRTFHeader();
+        WriteRTFHeader(ic);
+    
+    // All memory needed for a message comes from "icMessageArena", so once the arena has grown to fit the biggest message, converting
+    // a message does not touch the heap at all
+    InitArena(&ic->icMessageArena, kMessageArenaSize);
+    
+    // The first message is converted on its own, since the time that it was sent goes at the top of the log, and then the rest are
+    // split across threads if there are enough of them to be worth it. If a message can't be read, stop there, but keep what was
+    // converted up to that point.
+    uint64_t numMsgs = ic->icMessageListArray.oSize;
+    bool converted = ConvertMessageRange(ic, 0, (numMsgs > 0 ? 1 : 0), useRTF);
+    ic->icFirstMsgHeapAllocs = ic->icMessageArena.aHeapAllocs;
+    if (converted && numMsgs > 1)
+    {
+        uint64_t numChunks = (numMsgs - 1) / kMinMessagesPerChunk;
+        if (numChunks > (uint64_t)ic->icNumThreads)
+            numChunks = (uint64_t)ic->icNumThreads;
+        if (numChunks > 1)
+            converted = ConvertMessagesInParallel(ic, 1, numMsgs, numChunks, useRTF);
+        else
+            converted = ConvertMessageRange(ic, 1, numMsgs, useRTF);
+    }
+    
+    if (converted && useRTF)
+        WriteRTFFooter(ic);
     
+    return converted;
+}
+
+// Close the out file of a log written by FormatLog(), print the statistics if they were asked for, and free the message arena.
+// "converted" is what FormatLog() returned. Returns whether the whole log was converted and written.
+bool FinishConvertedLog(ICContext *ic, bool converted)
+{
+    OutSink *sink = &ic->icOutSink;
+    
+    CloseOutFile(sink);
+    if (sink->osFailed)
+        converted = false;
+    
+    if (converted && ic->icPrintStats)
+    {
+        printf("Converted %llu messages. The message arena went to the heap %llu time(s), %llu of them after the first message.\n",
+               ic->icMessageListArray.oSize, ic->icMessageArena.aHeapAllocs, ic->icMessageArena.aHeapAllocs - ic->icFirstMsgHeapAllocs);
+        printf("Wrote %llu bytes to the out file in %llu call(s).\n", sink->osBytes, sink->osWrites);
+        printf("Found %llu sender/subject account ID(s) already resolved and followed the references to %llu.\n",
+               ic->icAccountChainHits, ic->icAccountChainMisses);
+    }
+    FreeArena(&ic->icMessageArena);
+    
+    return converted;
+}
+
+// Convert the messages in "icMessageListArray" from position "firstMsg" up to but not including "endMsg". The time header is written
+// along with the message at position 0, so that message has to be converted before any other. Returns false if a message couldn't be
+// read, in which case the messages before it are kept.
+bool ConvertMessageRange(ICContext *ic, uint64_t firstMsg, uint64_t endMsg, bool useRTF)
+{
+    BPContext *bc = ic->icBP;
     BPObject BPmsg;
     ICMessage ICmsg;
-    for (int a = 0; a < gMessageListArray.oSize; a++)
+    
+    for (uint64_t a = firstMsg; a < endMsg; a++)
     {
-        uint64_t msgIDref = ReturnMessageRef((uint64_t)a);
-        if (msgIDref == (uint64_t)-1)
-            return;
-        if (!LoadObject(msgIDref, &BPmsg))
-            return;
+        uint64_t msgIDref = ReturnMessageRef(ic, a);
+        if (msgIDref == (uint64_t)-1 || !LoadObject(bc, msgIDref, &BPmsg))
+            return false;
         InitMessage(&ICmsg);
-        if (!LoadMessage(&BPmsg, &ICmsg, (a == 0)))
+        if (!LoadMessage(ic, &BPmsg, &ICmsg, (a == 0)))
         {
             DeleteMessage(&ICmsg);
-            return;
+            return false;
         }
         
         if (a == 0)
-            WriteTimeHeader(useRTF); // has to take place after LoadMessage() is called on first message
+            WriteTimeHeader(ic, useRTF); // has to take place after LoadMessage() is called on first message
         
         if (useRTF)
-            ConvertMessageToRTF(&ICmsg);
+            ConvertMessageToRTF(ic, &ICmsg);
         else
-            ConvertMessageToTXT(&ICmsg);
+            ConvertMessageToTXT(ic, &ICmsg);
         
         DeleteMessage(&ICmsg);
+        ResetArena(&ic->icMessageArena);
     }
     
-    if (useRTF)
-        WriteRTFFooter();
+    return true;
+}
+#pragma mark Parallel conversion
+// Convert the messages from "firstMsg" up to "endMsg" in "numChunks" chunks at once, one of them on the calling thread, and write them
+// to the out file in order. Position 0 must not be in the range. As with ConvertMessageRange(), the output stops at the first message
+// that couldn't be read, so the chunks after the one containing it are thrown away unwritten.
+bool ConvertMessagesInParallel(ICContext *ic, uint64_t firstMsg, uint64_t endMsg, uint64_t numChunks, bool useRTF)
+{
+    OutSink *sink = &ic->icOutSink;
+    ICChunk *chunks = malloc((size_t)numChunks * sizeof(ICChunk));     // freed below
+    pthread_t *threads = malloc((size_t)numChunks * sizeof(pthread_t)); // freed below
+    bool *started = calloc((size_t)numChunks, sizeof(bool));           // freed below
+    if (chunks == NULL || threads == NULL || started == NULL)
+    {
+        free(chunks);
+        free(threads);
+        free(started);
+        return ConvertMessageRange(ic, firstMsg, endMsg, useRTF);
+    }
+    
+    uint64_t numMsgs = endMsg - firstMsg;
+    for (uint64_t a = 0; a < numChunks; a++)
+    {
+        ICChunk *chunk = &chunks[a];
+        chunk->ckContext = *ic;
+        CopySenderTable(&chunk->ckContext, ic);
+        chunk->ckContext.icAccountChains = NULL;
+        chunk->ckContext.icAccountChainsCapacity = 0;
+        chunk->ckContext.icNumAccountChains = 0;
+        chunk->ckContext.icAccountChainHits = 0;
+        chunk->ckContext.icAccountChainMisses = 0;
+        InitArena(&chunk->ckContext.icMessageArena, 0);
+        InitOutSink(&chunk->ckContext.icOutSink);
+        InitOutSink(&chunk->ckReport);
+        chunk->ckContext.icReport = &chunk->ckReport;
+        chunk->ckFirstMsg = firstMsg + numMsgs * a / numChunks;
+        chunk->ckEndMsg = firstMsg + numMsgs * (a + 1) / numChunks;
+        chunk->ckUseRTF = useRTF;
+        chunk->ckConverted = false;
+    }
+    for (uint64_t a = 1; a < numChunks; a++)
+        started[a] = (pthread_create(&threads[a], NULL, RunMessageChunk, &chunks[a]) == 0);
+    RunMessageChunk(&chunks[0]);
     
-    CloseOutFile();
+    // Write the chunks out in order as they finish. A chunk whose thread couldn't be started is converted here instead, unless an
+    // earlier chunk failed and it isn't needed.
+    bool converted = true;
+    for (uint64_t a = 0; a < numChunks; a++)
+    {
+        ICChunk *chunk = &chunks[a];
+        if (started[a])
+            pthread_join(threads[a], NULL);
+        else if (a > 0 && converted)
+            RunMessageChunk(chunk);
+        
+        if (converted)
+        {
+            if (chunk->ckReport.osUsed > 0)
+                fwrite(chunk->ckReport.osBuffer, 1, chunk->ckReport.osUsed, stdout);
+            AppendToOutFile(sink, chunk->ckContext.icOutSink.osBuffer, chunk->ckContext.icOutSink.osUsed);
+            converted = chunk->ckConverted;
+        }
+        ic->icMessageArena.aHeapAllocs += chunk->ckContext.icMessageArena.aHeapAllocs;
+        ic->icAccountChainHits += chunk->ckContext.icAccountChainHits;
+        ic->icAccountChainMisses += chunk->ckContext.icAccountChainMisses;
+        FreeAccountChains(&chunk->ckContext);
+        FreeArena(&chunk->ckContext.icMessageArena);
+        FreeSenderTable(&chunk->ckContext);
+        FreeMemorySink(&chunk->ckContext.icOutSink);
+        FreeMemorySink(&chunk->ckReport);
+    }
+    
+    free(chunks);
+    free(threads);
+    free(started);
+    return converted;
+}
+
+// Body of a thread that converts one chunk of messages for ConvertMessagesInParallel()
+void *RunMessageChunk(void *arg)
+{
+    ICChunk *chunk = arg;
+    ICContext *ic = &chunk->ckContext;
+    
+    InitArena(&ic->icMessageArena, kMessageArenaSize);
+    if (!CreateMemorySink(&ic->icOutSink, kChunkSinkSize) || !CreateMemorySink(&chunk->ckReport, 0))
+        return NULL;
+    
+    chunk->ckConverted = ConvertMessageRange(ic, chunk->ckFirstMsg, chunk->ckEndMsg, chunk->ckUseRTF);
+    if (ic->icOutSink.osFailed || chunk->ckReport.osFailed)
+        chunk->ckConverted = false;
+    
+    return NULL;
 }
 #pragma mark Message-level functions
 // Initializes a message
@@ -516,35 +718,43 @@ void InitMessage(ICMessage *msg)
     msg->mFromClient = false;
     msg->mFileTransfer = 0;
     msg->mSenderID = NULL;
-    msg->mTime = NULL;
+    msg->mSenderIDLength = 0;
+    msg->mTime[0] = '\0';
     msg->mText = NULL;
+    msg->mTextLength = 0;
     msg->mWideStrSize = 0;
 }
 
 // Uses the BPObject dict passed in to look up the key data for a chat message and save it as an ICMessage. Warning: This function is
 // absolutely *filled* with "return" statements, mostly in the form of DieIf() calls.
-bool LoadMessage(BPObject *BPmsg, ICMessage *ICmsg, bool firstMsg)
+bool LoadMessage(ICContext *ic, BPObject *BPmsg, ICMessage *ICmsg, bool firstMsg)
 {
 #define DieIf(boole) \
 if (boole) \
 { \
-printf("Failed test on line %d in %s.\n", __LINE__, __FILE__); \
-free(subject); \
+ReportMessageProblem(ic, "Failed test on line %d in %s.\n", __LINE__, __FILE__); \
 return false; \
 } \
 do {} while (0)
     
+    BPContext *bc = ic->icBP;
+    
     char *subject = NULL;
+    int subjectLength = 0;
+    
+    // Messages are almost all laid out alike, so their keys are looked up through a field plan where there is one
+    const BPFieldPlan *plan;
+    ChooseFieldPlan(ic, BPmsg, &plan);
     
     // Determine if this is a message from the client or from a participant by looking for key "StatusChatItemStatusType" and seeing if
     // its value is "1" (participant has come online) or "2" (they have gone offline). The key can exist and have value "0", which seems
     // to have no meaning because the message will be an ordinary chat message. Usually the key does not exist at all in a message.
     bool isClient = false;
     BPObject statusType;
-    uint64_t statusTypeRef = ReturnValueRefForKeyName(BPmsg, "StatusChatItemStatusType");
+    uint64_t statusTypeRef = ReturnPlannedValueRef(bc, plan, BPmsg, kKeyStatusType);
     if (statusTypeRef != (uint64_t)-1)
     {
-        DieIf(!LoadObject(statusTypeRef, &statusType));
+        DieIf(!LoadObject(bc, statusTypeRef, &statusType));
         DieIf(statusType.oType != kTypeInt);
         if (statusType.oInt == 1 || statusType.oInt == 2)
             isClient = true;
@@ -554,84 +764,29 @@ do {} while (0)
     if (isClient)
     {
         /* Save the subject's account ID */
-        BPObject subjectDictID, subjectDict, subjectNameID, subjectName, subjectNameStr;
+        BPObject subjectDictID;
         ICmsg->mFromClient = true;
         
         // Look up value for key "Subject", which is a UID pointing to a dict with a UID pointing to a dict with the subject's ID
-        uint64_t subjectDictID_IDref = ReturnValueRefForKeyName(BPmsg, "Subject");
+        uint64_t subjectDictID_IDref = ReturnPlannedValueRef(bc, plan, BPmsg, kKeySubject);
         DieIf(subjectDictID_IDref == (uint64_t)-1);
-        DieIf(!LoadObject(subjectDictID_IDref, &subjectDictID));
+        DieIf(!LoadObject(bc, subjectDictID_IDref, &subjectDictID));
         DieIf(subjectDictID.oType != kTypeUID);
         
-        // Load dict with UID pointing to subject dict
-        uint64_t subjectDictIDref = ReturnElemRef(&gObjectsArray, subjectDictID.oInt);
-        DieIf(subjectDictIDref == (uint64_t)-1);
-        DieIf(!LoadObject(subjectDictIDref, &subjectDict));
-        DieIf(subjectDict.oType != kTypeDict);
-        
-        // Look up value for key "ID", which is a UID pointing to the subject's account ID
-        uint64_t subjectNameIDref = ReturnValueRefForKeyName(&subjectDict, "ID");
-        DieIf(subjectNameIDref == (uint64_t)-1);
-        DieIf(!LoadObject(subjectNameIDref, &subjectNameID));
-        DieIf(subjectNameID.oType != kTypeUID);
-        
-        // Load dict with subject's account ID
-        uint64_t subjectNameRef = ReturnElemRef(&gObjectsArray, subjectNameID.oInt);
-        DieIf(subjectNameRef == (uint64_t)-1);
-        DieIf(!LoadObject(subjectNameRef, &subjectName));
-        if (subjectName.oType == kTypeDict)
-        {
-            // Look up value for key "NS.string"
-            uint64_t subjectNameStrRef = ReturnValueRefForKeyName(&subjectName, "NS.string");
-            DieIf(subjectNameStrRef == (uint64_t)-1);
-            DieIf(!LoadObject(subjectNameStrRef, &subjectNameStr));
-            DieIf(subjectNameStr.oType != kTypeStringASCII);
-            
-            // Save subject ID in ICMessage
-            uint64_t nameLength = strlen(subjectNameStr.oData);
-            subject = malloc(nameLength + 1); // freed with DieIf() or at end of function
-            strncpy(subject, subjectNameStr.oData, nameLength);
-            subject[nameLength] = '\0';
-        }
-        else if (subjectName.oType == kTypeStringASCII)
-        {
-            // Save subject ID in ICMessage
-            uint64_t nameLength = strlen(subjectName.oData);
-            subject = malloc(nameLength + 1); // freed with DieIf() or at end of function
-            strncpy(subject, subjectName.oData, nameLength);
-            subject[nameLength] = '\0';
-        }
-        else if (subjectName.oType == kTypeStringUnicode)
-        {
-            // I have not encountered this case in a chat log, so simply apply the approach used for Unicode participant names (see
-            // comment under line "else if (participant.oType == kTypeStringUnicode)" above) and hope that it works
-            subject = calloc((subjectName.oSize * 2) + 1, 1); // freed on program quit
-            for (int b = 0; b < subjectName.oSize * 2; b += 2)
-            {
-                char *bytes = NULL;
-                ConvertUnicodeToUTF8((subjectName.oData + b), &bytes);
-                if (strlen(bytes) == 1)
-                    strcat(subject, bytes);
-            }
-            // If all of the text was Unicode characters, we have an empty string on our hands, so put something in it
-            if (strlen(subject) == 0)
-            {
-                free(subject);
-                asprintf(&subject, "%s", "<Unicode>");
-            }
-        }
-        else DieIf(true);
+        uint64_t subjectIDLength;
+        DieIf(!LoadAccountID(ic, subjectDictID.oInt, &subject, &subjectIDLength));
+        subjectLength = (int)subjectIDLength;
     }
     else
     {
         /* Save the sender's account ID (if the user asked for real names, the account will get replaced by their name when writing
          the message to disk) */
-        BPObject senderDictID, senderDict, senderNameID, senderName, senderNameStr;
+        BPObject senderDictID;
         
         // Look up value for key "Sender", which is a UID pointing to a dict with a UID pointing to a dict with the sender's ID
-        uint64_t senderDictID_IDref = ReturnValueRefForKeyName(BPmsg, "Sender");
+        uint64_t senderDictID_IDref = ReturnPlannedValueRef(bc, plan, BPmsg, kKeySender);
         DieIf(senderDictID_IDref == (uint64_t)-1);
-        DieIf(!LoadObject(senderDictID_IDref, &senderDictID));
+        DieIf(!LoadObject(bc, senderDictID_IDref, &senderDictID));
         DieIf(senderDictID.oType != kTypeUID);
         // UID 0 always seems to be "$null" and always seems to mean that the client is talking. We should have caught this above by
         // looking at "StatusChatItemStatusType", but if this somehow happens anyway, at least set this flag so we handle message
@@ -639,155 +794,95 @@ do {} while (0)
         if (senderDictID.oInt == 0)
             ICmsg->mFromClient = true;
         else
-        {
-            // Load dict with UID pointing to sender dict
-            uint64_t senderDictIDref = ReturnElemRef(&gObjectsArray, senderDictID.oInt);
-            DieIf(senderDictIDref == (uint64_t)-1);
-            DieIf(!LoadObject(senderDictIDref, &senderDict));
-            DieIf(senderDict.oType != kTypeDict);
-            
-            // Look up value for key "ID", which is a UID pointing to the sender's account ID
-            uint64_t senderNameIDref = ReturnValueRefForKeyName(&senderDict, "ID");
-            DieIf(senderNameIDref == (uint64_t)-1);
-            DieIf(!LoadObject(senderNameIDref, &senderNameID));
-            DieIf(senderNameID.oType != kTypeUID);
-            
-            // Load dict with sender's account ID
-            uint64_t senderNameRef = ReturnElemRef(&gObjectsArray, senderNameID.oInt);
-            DieIf(senderNameRef == (uint64_t)-1);
-            DieIf(!LoadObject(senderNameRef, &senderName));
-            if (senderName.oType == kTypeDict)
-            {
-                // Look up value for key "NS.string"
-                uint64_t senderNameStrRef = ReturnValueRefForKeyName(&senderName, "NS.string");
-                DieIf(senderNameStrRef == (uint64_t)-1);
-                DieIf(!LoadObject(senderNameStrRef, &senderNameStr));
-                DieIf(senderNameStr.oType != kTypeStringASCII);
-                
-                // Save sender ID in ICMessage
-                uint64_t nameLength = strlen(senderNameStr.oData);
-                ICmsg->mSenderID = malloc(nameLength + 1); // freed with DeleteMessage()
-                strncpy(ICmsg->mSenderID, senderNameStr.oData, nameLength);
-                ICmsg->mSenderID[nameLength] = '\0';
-            }
-            else if (senderName.oType == kTypeStringASCII)
-            {
-                // Save sender ID in ICMessage
-                uint64_t nameLength = strlen(senderName.oData);
-                ICmsg->mSenderID = malloc(nameLength + 1); // freed with DeleteMessage()
-                strncpy(ICmsg->mSenderID, senderName.oData, nameLength);
-                ICmsg->mSenderID[nameLength] = '\0';
-            }
-            else if (senderName.oType == kTypeStringUnicode)
-            {
-                // I have not encountered this case in a chat log, so simply apply the approach used for Unicode participant names (see
-                // comment under line "else if (participant.oType == kTypeStringUnicode)" above) and hope that it works
-                ICmsg->mSenderID = calloc((senderName.oSize * 2) + 1, 1); // freed on program quit
-                for (int b = 0; b < senderName.oSize * 2; b += 2)
-                {
-                    char *bytes = NULL;
-                    ConvertUnicodeToUTF8((ICmsg->mSenderID + b), &bytes);
-                    if (strlen(bytes) == 1)
-                        strcat(ICmsg->mSenderID, bytes);
-                }
-                // If all of the text was Unicode characters, we have an empty string on our hands, so put something in it
-                if (strlen(ICmsg->mSenderID) == 0)
-                {
-                    free(ICmsg->mSenderID);
-                    asprintf(&ICmsg->mSenderID, "%s", "<Unicode>");
-                }
-            }
-            else DieIf(true);
-        }
+            DieIf(!LoadAccountID(ic, senderDictID.oInt, &ICmsg->mSenderID, &ICmsg->mSenderIDLength));
     }
     
     /* Retrieve and save message timestamp */
     BPObject timeDictID, timeDict, time;
     
     // Look up value for key "Time", which is a UID pointing to a dict with the timestamp
-    uint64_t timeDictIDref = ReturnValueRefForKeyName(BPmsg, "Time");
+    uint64_t timeDictIDref = ReturnPlannedValueRef(bc, plan, BPmsg, kKeyTime);
     DieIf(timeDictIDref == (uint64_t)-1);
-    DieIf(!LoadObject(timeDictIDref, &timeDictID));
+    DieIf(!LoadObject(bc, timeDictIDref, &timeDictID));
     DieIf(timeDictID.oType != kTypeUID);
     
     // Look up dict containing the timestamp
-    uint64_t timeDictRef = ReturnElemRef(&gObjectsArray, timeDictID.oInt);
+    uint64_t timeDictRef = ReturnElemRef(bc, &ic->icObjectsArray, timeDictID.oInt);
     DieIf(timeDictRef == (uint64_t)-1);
-    DieIf(!LoadObject(timeDictRef, &timeDict));
+    DieIf(!LoadObject(bc, timeDictRef, &timeDict));
     DieIf(timeDict.oType != kTypeDict);
     
     // Convert NSTime to a string and save in ICMessage
-    uint64_t timeRef = ReturnValueRefForKeyName(&timeDict, "NS.time");
+    uint64_t timeRef = ReturnValueRefForKey(bc, &timeDict, kKeyNS_time);
     DieIf(timeRef == (uint64_t)-1);
-    DieIf(!LoadObject(timeRef, &time));
+    DieIf(!LoadObject(bc, timeRef, &time));
     DieIf(time.oType != kTypeReal);
     if (firstMsg) // save timestamp in long format for header of converted chat log
-        ConvertNSDate(time.oReal, &gFirstMsgTime, kDateSaveLong);
-    ConvertNSDate(time.oReal, &(ICmsg->mTime), kDateSaveShort);
+        ConvertNSDate(time.oReal, ic->icFirstMsgTime, kDateSaveLong, &ic->icDateCache);
+    ConvertNSDate(time.oReal, ICmsg->mTime, kDateSaveShort, &ic->icDateCache);
     
     /* Prepare to look up message text by loading "MessageText" dict */
     BPObject msgTextID, msgText;
     
     // Look up value for key "MessageText", which is a UID pointing to a dict containing a dict of message attributes
-    uint64_t msgTextIDref = ReturnValueRefForKeyName(BPmsg, "MessageText");
+    uint64_t msgTextIDref = ReturnPlannedValueRef(bc, plan, BPmsg, kKeyMessageText);
     DieIf(msgTextIDref == (uint64_t)-1);
-    DieIf(!LoadObject(msgTextIDref, &msgTextID));
+    DieIf(!LoadObject(bc, msgTextIDref, &msgTextID));
     DieIf(msgTextID.oType != kTypeUID);
     
     // Follow UID to dict containing the dict containing the message attributes
-    uint64_t msgTextRef = ReturnElemRef(&gObjectsArray, msgTextID.oInt);
+    uint64_t msgTextRef = ReturnElemRef(bc, &ic->icObjectsArray, msgTextID.oInt);
     DieIf(msgTextRef == (uint64_t)-1);
-    DieIf(!LoadObject(msgTextRef, &msgText));
+    DieIf(!LoadObject(bc, msgTextRef, &msgText));
     DieIf(msgText.oType != kTypeDict);
     
     // Determine if this is a chat message or file transfer message by looking for key "OriginalMessage". If we find it, this is a
     // regular text message.
-    bool isText = (ReturnValueRefForKeyName(BPmsg, "OriginalMessage") != -1);
+    bool isText = (ReturnPlannedValueRef(bc, plan, BPmsg, kKeyOriginalMessage) != -1);
     if (isText)
     {
         /* Get text of message */
         BPObject stringDictID, stringDict, string;
         
         // Look up value for key "NSString", which is a UID pointing to a dict that contains the actual string
-        uint64_t stringDictIDref = ReturnValueRefForKeyName(&msgText, "NSString");
+        uint64_t stringDictIDref = ReturnValueRefForKey(bc, &msgText, kKeyNSString);
         DieIf(stringDictIDref == (uint64_t)-1);
-        DieIf(!LoadObject(stringDictIDref, &stringDictID));
+        DieIf(!LoadObject(bc, stringDictIDref, &stringDictID));
         DieIf(stringDictID.oType != kTypeUID);
         
         // Follow UID to dict containing the string
-        uint64_t stringDictRef = ReturnElemRef(&gObjectsArray, stringDictID.oInt);
+        uint64_t stringDictRef = ReturnElemRef(bc, &ic->icObjectsArray, stringDictID.oInt);
         DieIf(stringDictRef == (uint64_t)-1);
-        DieIf(!LoadObject(stringDictRef, &stringDict));
+        DieIf(!LoadObject(bc, stringDictRef, &stringDict));
         
         // Look up value for key "NS.string", which is a UID pointing to the message text
-        uint64_t stringRef = ReturnValueRefForKeyName(&stringDict, "NS.string");
+        uint64_t stringRef = ReturnValueRefForKey(bc, &stringDict, kKeyNS_string);
         DieIf(stringRef == (uint64_t)-1);
-        DieIf(!LoadObject(stringRef, &string));
+        DieIf(!LoadObject(bc, stringRef, &string));
         
-        // If message was stored in plain ASCII, simply copy the string into ICMessage
+        // If message was stored in plain ASCII, simply point ICMessage to the string
         if (string.oType == kTypeStringASCII)
         {
             // If this is a client message that says that "%@" is now on/offline, replace "%@" with subject name gotten earlier
-            if (isClient && !strcmp(string.oData, "%@ is now online."))
-                asprintf(&ICmsg->mText, "%s is now online.", subject); // freed in either DeleteMessage() or ConvertMessageToRTF()
-            else if (isClient && !strcmp(string.oData, "%@ is now offline."))
-                asprintf(&ICmsg->mText, "%s is now offline.", subject); // freed in either DeleteMessage() or ConvertMessageToRTF()
+            if (isClient && StringObjectEquals(&string, "%@ is now online."))
+                ICmsg->mText = PrintToArena(&ic->icMessageArena, "%.*s is now online.", subjectLength, subject);
+            else if (isClient && StringObjectEquals(&string, "%@ is now offline."))
+                ICmsg->mText = PrintToArena(&ic->icMessageArena, "%.*s is now offline.", subjectLength, subject);
+            
+            if (ICmsg->mText != NULL)
+                ICmsg->mTextLength = strlen(ICmsg->mText);
             else
             {
-                uint64_t msgLength = strlen(string.oData);
-                ICmsg->mText = malloc(msgLength + 1); // freed in either DeleteMessage() or ConvertMessageToRTF()
-                strncpy(ICmsg->mText, string.oData, msgLength);
-                ICmsg->mText[msgLength] = '\0';
+                ICmsg->mText = string.oData;
+                ICmsg->mTextLength = string.oSize;
             }
         }
-        // Otherwise, copy Unicode as memory block rather than normal string since it can have null bytes
+        // Otherwise, point to the Unicode as a memory block rather than a normal string since it can have null bytes
         else if (string.oType == kTypeStringUnicode)
         {
             ICmsg->mWideStrSize = string.oSize;
-            uint64_t msgLength = string.oSize * 2; // "oSize" is the number of wide chars
-            ICmsg->mText = malloc(msgLength + 1); // freed in either DeleteMessage() or ConvertMessageToRTF()
-            memcpy(ICmsg->mText, string.oData, msgLength);
-            ICmsg->mText[msgLength] = '\0';
+            ICmsg->mText = string.oData;
+            ICmsg->mTextLength = string.oSize * 2; // "oSize" is the number of wide chars
         }
         else DieIf(true);
     }
@@ -797,44 +892,44 @@ do {} while (0)
         BPObject attribID, attrib, msgKeys, msgValues, attribObjects, attribObjID, attribObj, fileNameID, fileName;
         
         // Look up value for key "MessageText", which is a UID pointing to a dict containing a dict of message attributes
-        uint64_t textIDref = ReturnValueRefForKeyName(BPmsg, "MessageText");
+        uint64_t textIDref = ReturnPlannedValueRef(bc, plan, BPmsg, kKeyMessageText);
         DieIf(textIDref == (uint64_t)-1);
-        DieIf(!LoadObject(textIDref, &msgTextID));
+        DieIf(!LoadObject(bc, textIDref, &msgTextID));
         DieIf(msgTextID.oType != kTypeUID);
         
         // Follow UID to dict containing the dict containing the message attributes
-        uint64_t textRef = ReturnElemRef(&gObjectsArray, msgTextID.oInt);
+        uint64_t textRef = ReturnElemRef(bc, &ic->icObjectsArray, msgTextID.oInt);
         DieIf(textRef == (uint64_t)-1);
-        DieIf(!LoadObject(textRef, &msgText));
+        DieIf(!LoadObject(bc, textRef, &msgText));
         DieIf(msgText.oType != kTypeDict);
         
         // Look for NSAttributeInfo. If present, multiple files are being sent with this one message.
-        bool isMultipleFiles = (ReturnValueRefForKeyName(&msgText, "NSAttributeInfo") != -1);
+        bool isMultipleFiles = (ReturnValueRefForKey(bc, &msgText, kKeyNSAttributeInfo) != -1);
         
         // Look up value for key "NSAttributes", which is a UID pointing to a dict containing message attributes
-        uint64_t attribIDref = ReturnValueRefForKeyName(&msgText, "NSAttributes");
+        uint64_t attribIDref = ReturnValueRefForKey(bc, &msgText, kKeyNSAttributes);
         if (attribIDref == (uint64_t)-1) // this means there will be no message text, so there's no harm in skipping it
         {
-            printf("Warning: SMS hiccup detected; message skipped.\n");
+            ReportMessageProblem(ic, "Warning: SMS hiccup detected; message skipped.\n");
             ICmsg->mHiccup = true;
             return true;
         }
-        DieIf(!LoadObject(attribIDref, &attribID));
+        DieIf(!LoadObject(bc, attribIDref, &attribID));
         DieIf(attribID.oType != kTypeUID);
         
         // Follow UID to dict containing the message attributes
-        uint64_t attribRef = ReturnElemRef(&gObjectsArray, attribID.oInt);
+        uint64_t attribRef = ReturnElemRef(bc, &ic->icObjectsArray, attribID.oInt);
         DieIf(attribRef == (uint64_t)-1);
-        DieIf(!LoadObject(attribRef, &attrib));
+        DieIf(!LoadObject(bc, attribRef, &attrib));
         DieIf(attrib.oType != kTypeDict);
         
         // Set number of files that are being transferred in this message and look up relevant element in NSAttributes
         if (isMultipleFiles)
         {
             // Look up "NS.objects" in the "NSAttributes" dict; this is an array of dicts with the properties of each file
-            uint64_t attribObjectsRef = ReturnValueRefForKeyName(&attrib, "NS.objects");
+            uint64_t attribObjectsRef = ReturnValueRefForKey(bc, &attrib, kKeyNS_objects);
             DieIf(attribObjectsRef == (uint64_t)-1);
-            DieIf(!LoadObject(attribObjectsRef, &attribObjects));
+            DieIf(!LoadObject(bc, attribObjectsRef, &attribObjects));
             DieIf(attribObjects.oType != kTypeArray);
             
             ICmsg->mFileTransfer = attribObjects.oSize; // number of items in array is number of files
@@ -842,15 +937,15 @@ do {} while (0)
         else
         {
             // Look up "NS.keys" in the "NSAttributes" dict; these are the properties of the single file being transferred
-            uint64_t attribKeysRef = ReturnValueRefForKeyName(&attrib, "NS.keys");
+            uint64_t attribKeysRef = ReturnValueRefForKey(bc, &attrib, kKeyNS_keys);
             DieIf(attribKeysRef == (uint64_t)-1);
-            DieIf(!LoadObject(attribKeysRef, &msgKeys));
+            DieIf(!LoadObject(bc, attribKeysRef, &msgKeys));
             DieIf(msgKeys.oType != kTypeArray);
             
             // Load "NS.objects" array that corresponds to "NS.keys"
-            uint64_t attribValuesRef = ReturnValueRefForKeyName(&attrib, "NS.objects");
+            uint64_t attribValuesRef = ReturnValueRefForKey(bc, &attrib, kKeyNS_objects);
             DieIf(attribValuesRef == (uint64_t)-1);
-            DieIf(!LoadObject(attribValuesRef, &msgValues));
+            DieIf(!LoadObject(bc, attribValuesRef, &msgValues));
             DieIf(msgValues.oType != kTypeArray);
             
             ICmsg->mFileTransfer = 1;
@@ -863,27 +958,27 @@ do {} while (0)
             if (isMultipleFiles)
             {
                 // Load UID that points to a file element in array
-                uint64_t attribObjIDref = ReturnElemRef(&attribObjects, a);
+                uint64_t attribObjIDref = ReturnElemRef(bc, &attribObjects, a);
                 DieIf(attribObjIDref == (uint64_t)-1);
-                DieIf(!LoadObject(attribObjIDref, &attribObjID));
+                DieIf(!LoadObject(bc, attribObjIDref, &attribObjID));
                 DieIf(attribObjID.oType != kTypeUID);
                 
                 // Follow UID to file element
-                uint64_t attribObjRef = ReturnElemRef(&gObjectsArray, attribObjID.oInt);
+                uint64_t attribObjRef = ReturnElemRef(bc, &ic->icObjectsArray, attribObjID.oInt);
                 DieIf(attribObjRef == (uint64_t)-1);
-                DieIf(!LoadObject(attribObjRef, &attribObj));
+                DieIf(!LoadObject(bc, attribObjRef, &attribObj));
                 DieIf(attribObj.oType != kTypeDict);
                 
                 // Look up "NS.keys" in element's dict; these are the properties of the file
-                uint64_t attribObjKeysRef = ReturnValueRefForKeyName(&attribObj, "NS.keys");
+                uint64_t attribObjKeysRef = ReturnValueRefForKey(bc, &attribObj, kKeyNS_keys);
                 DieIf(attribObjKeysRef == (uint64_t)-1);
-                DieIf(!LoadObject(attribObjKeysRef, &msgKeys));
+                DieIf(!LoadObject(bc, attribObjKeysRef, &msgKeys));
                 DieIf(msgKeys.oType != kTypeArray);
                 
                 // Load "NS.objects" array that corresponds to "NS.keys"
-                uint64_t attribObjValuesRef = ReturnValueRefForKeyName(&attribObj, "NS.objects");
+                uint64_t attribObjValuesRef = ReturnValueRefForKey(bc, &attribObj, kKeyNS_objects);
                 DieIf(attribObjValuesRef == (uint64_t)-1);
-                DieIf(!LoadObject(attribObjValuesRef, &msgValues));
+                DieIf(!LoadObject(bc, attribObjValuesRef, &msgValues));
                 DieIf(msgValues.oType != kTypeArray);
             }
             
@@ -894,33 +989,33 @@ do {} while (0)
                 BPObject msgKeyID, msgKey;
                 
                 // Load UID that points to name of this key
-                uint64_t msgKeyIDref = ReturnElemRef(&msgKeys, (uint64_t)b);
+                uint64_t msgKeyIDref = ReturnElemRef(bc, &msgKeys, (uint64_t)b);
                 DieIf(msgKeyIDref == (uint64_t)-1);
-                DieIf(!LoadObject(msgKeyIDref, &msgKeyID));
+                DieIf(!LoadObject(bc, msgKeyIDref, &msgKeyID));
                 DieIf(msgKeyID.oType != kTypeUID);
                 
                 // Load name of this key
-                uint64_t msgKeyRef = ReturnElemRef(&gObjectsArray, msgKeyID.oInt);
+                uint64_t msgKeyRef = ReturnElemRef(bc, &ic->icObjectsArray, msgKeyID.oInt);
                 DieIf(msgKeyRef == (uint64_t)-1);
-                DieIf(!LoadObject(msgKeyRef, &msgKey));
+                DieIf(!LoadObject(bc, msgKeyRef, &msgKey));
                 DieIf(msgKey.oType != kTypeStringASCII);
                 
-                if (!strcmp(msgKey.oData, "__kIMFilenameAttributeName"))
+                if (ReturnKeySymbol(bc, msgKeyRef) == kKeyFilenameAttribute)
                     nameIndex = b;
             }
             DieIf(nameIndex == -1);
             
             // Load UID in "NS.objects" that points to the object that represents the value corresponding to the
             // "__kIMFilenameAttributeName" key
-            uint64_t fileNameIDref = ReturnElemRef(&msgValues, (uint64_t)nameIndex);
+            uint64_t fileNameIDref = ReturnElemRef(bc, &msgValues, (uint64_t)nameIndex);
             DieIf(fileNameIDref == (uint64_t)-1);
-            DieIf(!LoadObject(fileNameIDref, &fileNameID));
+            DieIf(!LoadObject(bc, fileNameIDref, &fileNameID));
             DieIf(fileNameID.oType != kTypeUID);
             
             // Follow this UID to the actual file name
-            uint64_t fileNameRef = ReturnElemRef(&gObjectsArray, fileNameID.oInt);
+            uint64_t fileNameRef = ReturnElemRef(bc, &ic->icObjectsArray, fileNameID.oInt);
             DieIf(fileNameRef == (uint64_t)-1);
-            DieIf(!LoadObject(fileNameRef, &fileName));
+            DieIf(!LoadObject(bc, fileNameRef, &fileName));
             DieIf(fileName.oType != kTypeStringASCII);
             
             // Copy the file name into ICMessage
@@ -928,26 +1023,116 @@ do {} while (0)
             {
                 // If there is already at least one file name in "mText", add ", " onto end of that string and append this file name
                 if (ICmsg->mText != NULL)
-                {
-                    char *prevStr = NULL;
-                    asprintf(&prevStr, "%s", ICmsg->mText); // freed below
-                    free(ICmsg->mText);
-                    asprintf(&ICmsg->mText, "%s, %s", prevStr, fileName.oData); // freed in either DeleteMessage() or ConvertMessageToRTF()
-                    free(prevStr);
-                }
+                    ICmsg->mText = PrintToArena(&ic->icMessageArena, "%s, %.*s", ICmsg->mText, (int)fileName.oSize, fileName.oData);
                 else
-                    asprintf(&ICmsg->mText, "%s", fileName.oData);
+                    ICmsg->mText = PrintToArena(&ic->icMessageArena, "%.*s", (int)fileName.oSize, fileName.oData);
+                ICmsg->mTextLength = strlen(ICmsg->mText);
             }
             else
             {
-                uint64_t fileStrLength = strlen(fileName.oData);
-                ICmsg->mText = malloc(fileStrLength + 1); // freed in either DeleteMessage() or ConvertMessageToRTF()
-                strncpy(ICmsg->mText, fileName.oData, fileStrLength);
-                ICmsg->mText[fileStrLength] = '\0';
+                ICmsg->mText = fileName.oData;
+                ICmsg->mTextLength = fileName.oSize;
             }
         }
     }
-    free(subject);
+    return true;
+#undef DieIf
+}
+
+// Point "plan" to the field plan for the layout of "dict", compiling one if this is a layout we haven't seen and there is room for it.
+// Returns false, setting "plan" to NULL so that the keys are scanned for instead, if there is no plan for the layout.
+bool ChooseFieldPlan(ICContext *ic, BPObject *dict, const BPFieldPlan **plan)
+{
+    BPContext *bc = ic->icBP;
+    
+    *plan = NULL;
+    for (int a = 0; a < ic->icNumFieldPlans; a++)
+    {
+        if (DictMatchesFieldPlan(bc, dict, &ic->icFieldPlans[a]))
+        {
+            *plan = &ic->icFieldPlans[a];
+            return true;
+        }
+    }
+    
+    if (ic->icNumFieldPlans == MAX_FIELD_PLANS || !CompileFieldPlan(bc, dict, &ic->icFieldPlans[ic->icNumFieldPlans]))
+        return false;
+    *plan = &ic->icFieldPlans[ic->icNumFieldPlans++];
+    return true;
+}
+
+// Follow the chain of references from the UID "accountUID" in a message's "Sender" or "Subject" value to the account ID at its end,
+// pointing "accountID" to the ID and setting "length" to its length. A log has only a few participants, and the messages of each point
+// to the same chain, so the ID at the end of each chain is remembered and only the first message from a participant has to follow it.
+bool LoadAccountID(ICContext *ic, uint64_t accountUID, char **accountID, uint64_t *length)
+{
+#define DieIf(boole) \
+if (boole) \
+{ \
+ReportMessageProblem(ic, "Failed test on line %d in %s.\n", __LINE__, __FILE__); \
+return false; \
+} \
+do {} while (0)
+    
+    BPContext *bc = ic->icBP;
+    BPObject accountDict, accountNameID, accountName, accountNameStr;
+    
+    if (FindAccountChain(ic, accountUID, accountID, length))
+        return true;
+    
+    // Load dict with UID pointing to account dict
+    uint64_t accountDictRef = ReturnElemRef(bc, &ic->icObjectsArray, accountUID);
+    DieIf(accountDictRef == (uint64_t)-1);
+    DieIf(!LoadObject(bc, accountDictRef, &accountDict));
+    DieIf(accountDict.oType != kTypeDict);
+    
+    // Look up value for key "ID", which is a UID pointing to the account ID
+    uint64_t accountNameIDref = ReturnValueRefForKey(bc, &accountDict, kKeyID);
+    DieIf(accountNameIDref == (uint64_t)-1);
+    DieIf(!LoadObject(bc, accountNameIDref, &accountNameID));
+    DieIf(accountNameID.oType != kTypeUID);
+    
+    // Load dict with account ID
+    uint64_t accountNameRef = ReturnElemRef(bc, &ic->icObjectsArray, accountNameID.oInt);
+    DieIf(accountNameRef == (uint64_t)-1);
+    DieIf(!LoadObject(bc, accountNameRef, &accountName));
+    if (accountName.oType == kTypeDict)
+    {
+        // Look up value for key "NS.string"
+        uint64_t accountNameStrRef = ReturnValueRefForKey(bc, &accountName, kKeyNS_string);
+        DieIf(accountNameStrRef == (uint64_t)-1);
+        DieIf(!LoadObject(bc, accountNameStrRef, &accountNameStr));
+        DieIf(accountNameStr.oType != kTypeStringASCII);
+        
+        // Point to account ID
+        *accountID = accountNameStr.oData;
+        *length = accountNameStr.oSize;
+    }
+    else if (accountName.oType == kTypeStringASCII)
+    {
+        // Point to account ID
+        *accountID = accountName.oData;
+        *length = accountName.oSize;
+    }
+    else if (accountName.oType == kTypeStringUnicode)
+    {
+        // I have not encountered this case in a chat log, so simply apply the approach used for Unicode participant names (see
+        // comment under line "else if (participant.oType == kTypeStringUnicode)" above) and hope that it works. The converted ID
+        // only lasts as long as the message, so it isn't remembered.
+        *accountID = AllocFromArena(&ic->icMessageArena, (accountName.oSize * 3) + 1);
+        *length = ConvertUnicodeName(&accountName, *accountID);
+        
+        // If all of the text was tags, we have an empty string on our hands, so put something in it
+        if (*length == 0)
+        {
+            *accountID = "<Unicode>";
+            *length = strlen(*accountID);
+        }
+        return true;
+    }
+    else DieIf(true);
+    
+    AddAccountChain(ic, accountUID, *accountID, *length);
     return true;
 #undef DieIf
 }
@@ -964,28 +1149,32 @@ void PrintMessage(ICMessage *msg)
     if (msg->mFileTransfer > 0)
     {
         if (msg->mFileTransfer == 1)
-            printf("%s %s sent file %s.\n", msg->mTime, msg->mSenderID, msg->mText);
+            printf("%s %.*s sent file %.*s.\n", msg->mTime, (int)msg->mSenderIDLength, msg->mSenderID, (int)msg->mTextLength,
+                   msg->mText);
         else
-            printf("%s %s sent %llu files: %s.\n", msg->mTime, msg->mSenderID, msg->mFileTransfer, msg->mText);
+            printf("%s %.*s sent %llu files: %.*s.\n", msg->mTime, (int)msg->mSenderIDLength, msg->mSenderID, msg->mFileTransfer,
+                   (int)msg->mTextLength, msg->mText);
         return;
     }
     
     if (msg->mFromClient)
     {
-        printf("%s %s:\n   %s\n", msg->mTime, gClientName, msg->mText);
+        printf("%s %s:\n   %.*s\n", msg->mTime, gClientName, (int)msg->mTextLength, msg->mText);
         return;
     }
     
-    printf("%s %s said:\n   ", msg->mTime, msg->mSenderID);
+    printf("%s %.*s said:\n   ", msg->mTime, (int)msg->mSenderIDLength, msg->mSenderID);
     if (msg->mWideStrSize == 0)
-        printf("%s\n", msg->mText);
+        printf("%.*s\n", (int)msg->mTextLength, msg->mText);
     else
         PrintWideString(msg->mText, msg->mWideStrSize);
 }
 
 // Write message to disk in RTF
-void ConvertMessageToRTF(ICMessage *msg)
+void ConvertMessageToRTF(ICContext *ic, ICMessage *msg)
 {
+    OutSink *sink = &ic->icOutSink;
+    
     // Do nothing for an SMS hiccup
     if (msg->mHiccup)
         return;
@@ -993,108 +1182,61 @@ void ConvertMessageToRTF(ICMessage *msg)
     // If this message is coming from the chat client, print timestamp and then name of client in bold
     if (msg->mFromClient)
     {
-        char *clientMsg = NULL;
-        asprintf(&clientMsg, "\\cf1 %s \\cf0 \\b1 %s\\b0 ", msg->mTime, gClientName); // freed below
-        WriteToOutFile(clientMsg);
-        free(clientMsg);
+        AppendLiteralToOutFile(sink, "\\cf1 ");
+        AppendStringToOutFile(sink, msg->mTime);
+        AppendLiteralToOutFile(sink, " \\cf0 \\b1 ");
+        AppendStringToOutFile(sink, gClientName);
+        AppendLiteralToOutFile(sink, "\\b0 ");
     }
     else
     {
         // Write timestamp of message in gray
-        char *time = NULL;
-        asprintf(&time, "\\cf1 %s ", msg->mTime); // freed below
-        WriteToOutFile(time);
-        free(time);
+        AppendLiteralToOutFile(sink, "\\cf1 ");
+        AppendStringToOutFile(sink, msg->mTime);
+        AppendCharToOutFile(sink, ' ');
         
         // Print out sender name
-        WriteSenderName(msg, true);
+        WriteSenderName(ic, msg, true);
     }
     
     if (msg->mFileTransfer > 0)
     {
         // Simply write name of file transferred. End the italics tag started in WriteSenderName().
-        char *fileMsg = NULL;
         if (msg->mFileTransfer == 1)
-            asprintf(&fileMsg, "\\cf0  sent file %s.\\i0 \n", msg->mText); // freed below
+            AppendLiteralToOutFile(sink, "\\cf0  sent file ");
         else
-            asprintf(&fileMsg, "\\cf0  sent %llu files: %s.\\i0 \n", msg->mFileTransfer, msg->mText); // freed below
-        WriteToOutFile(fileMsg);
-        free(fileMsg);
+        {
+            AppendLiteralToOutFile(sink, "\\cf0  sent ");
+            AppendNumToOutFile(sink, msg->mFileTransfer);
+            AppendLiteralToOutFile(sink, " files: ");
+        }
+        AppendToOutFile(sink, msg->mText, msg->mTextLength);
+        AppendLiteralToOutFile(sink, ".\\i0 \n");
     }
     else
     {
         // Prepare to write message in black
-        WriteToOutFile("\\cf0 : ");
+        AppendLiteralToOutFile(sink, "\\cf0 : ");
         
         // Since RTF uses curly braces and backslashes as part of its markup, we need to escape any that are part of the message.
-        // Newlines in the message also need to be escaped to display as such in RTF. This is the code for ASCII strings; Unicode
-        // strings are escaped during file-write below.
-        if (msg->mWideStrSize == 0)
-        {
-            // If we find something that needs escaping, allocate the biggest string we could need (2x current string size) and then
-            // scan through message, escaping all applicable characters
-            if (strchr(msg->mText, '{') || strchr(msg->mText, '}') || strchr(msg->mText, '\\') || strchr(msg->mText, 0x0A))
-            {
-                uint64_t strLen = strlen(msg->mText);
-                char *newStr = calloc((strLen * 2) + 1, 1); // freed with DeleteMessage()
-                strncpy(newStr, msg->mText, strLen);
-                char *reader = newStr;
-                do
-                {
-                    // Move string right to open up a place for the backslash, insert it, then skip past escaped character
-                    if (*reader == '{' || *reader == '}' || *reader == '\\' || *reader == 0x0A)
-                    {
-                        memmove(reader + 1, reader, strlen(reader));
-                        *reader = '\\';
-                        reader++;
-                    }
-                    reader++;
-                }
-                while (*reader != '\0');
-                free(msg->mText);
-                msg->mText = newStr;
-            }
-        }
-        
-        // Write message as plain-text if it's regular ASCII, otherwise convert Unicode hex value to RTF Unicode markup
+        // Newlines in the message also need to be escaped to display as such in RTF. Both kinds of text are escaped on their way
+        // into the out file's buffer, with Unicode characters converted to RTF's decimal Unicode markup, e.g. 0x2019 => "\uc0\u8217 ".
         if (msg->mWideStrSize == 0)
-            WriteToOutFile(msg->mText);
+            AppendRTFEscapedToOutFile(sink, msg->mText, msg->mTextLength);
         else
         {
-            for (int byte = 0; byte < msg->mWideStrSize * 2; byte += 2)
-            {
-                int wc = (*(char *)(msg->mText + byte) << 8) + *(char *)(msg->mText + byte + 1);
-                
-                // If this 2-byte character falls within the standard ASCII range, e.g. 0x0061, write it as just that ASCII byte
-                if (wc <= 127)
-                {
-                    // Escape curly braces and backslashes to avoid breaking RTF markup. Escape newlines to make them display as such.
-                    if (wc == '{' || wc == '}' || wc == '\\' || wc == 0x0A)
-                    {
-                        char escStr[2] = {'\\', 0};
-                        WriteToOutFile(escStr);
-                    }
-                    char byteStr[2] = {(char)wc, 0};
-                    WriteToOutFile(byteStr);
-                }
-                // Otherwise convert the hex value to RTF's decimal Unicode markup, e.g. 0x2019 => "\uc0\u8217 "
-                else
-                {
-                    char *bytes = NULL;
-                    asprintf(&bytes, "\\uc0\\u%d ", wc); // freed below
-                    WriteToOutFile(bytes);
-                    free(bytes);
-                }
-            }
-            WriteToOutFile("\n");
+            AppendUTF16AsRTFToOutFile(sink, msg->mText, msg->mWideStrSize);
+            AppendCharToOutFile(sink, '\n');
         }
     }
-    WriteToOutFile("\\\n");
+    AppendLiteralToOutFile(sink, "\\\n");
 }
 
 // Write message to disk in plain-text format
-void ConvertMessageToTXT(ICMessage *msg)
+void ConvertMessageToTXT(ICContext *ic, ICMessage *msg)
 {
+    OutSink *sink = &ic->icOutSink;
+    
     // Do nothing for an SMS hiccup
     if (msg->mHiccup)
         return;
@@ -1102,257 +1244,525 @@ void ConvertMessageToTXT(ICMessage *msg)
     // If this message is coming from the chat client, print timestamp and then name of client in bold
     if (msg->mFromClient)
     {
-        char *clientMsg = NULL;
-        asprintf(&clientMsg, "%s %s ", msg->mTime, gClientName); // freed below
-        WriteToOutFile(clientMsg);
-        free(clientMsg);
+        AppendStringToOutFile(sink, msg->mTime);
+        AppendCharToOutFile(sink, ' ');
+        AppendStringToOutFile(sink, gClientName);
+        AppendCharToOutFile(sink, ' ');
     }
     else
     {
         // Write timestamp of message in gray
-        char *time = NULL;
-        asprintf(&time, "%s ", msg->mTime); // freed below
-        WriteToOutFile(time);
-        free(time);
+        AppendStringToOutFile(sink, msg->mTime);
+        AppendCharToOutFile(sink, ' ');
         
         // Print out sender name
-        WriteSenderName(msg, false);
+        WriteSenderName(ic, msg, false);
     }
     
     if (msg->mFileTransfer > 0)
     {
         // Simply write name of file transferred
-        char *fileMsg = NULL;
         if (msg->mFileTransfer == 1)
-            asprintf(&fileMsg, " sent file %s.\n", msg->mText); // freed below
+            AppendLiteralToOutFile(sink, " sent file ");
         else
-            asprintf(&fileMsg, " sent %llu files: %s.\n", msg->mFileTransfer, msg->mText); // freed below
-        WriteToOutFile(fileMsg);
-        free(fileMsg);
+        {
+            AppendLiteralToOutFile(sink, " sent ");
+            AppendNumToOutFile(sink, msg->mFileTransfer);
+            AppendLiteralToOutFile(sink, " files: ");
+        }
+        AppendToOutFile(sink, msg->mText, msg->mTextLength);
+        AppendLiteralToOutFile(sink, ".\n");
     }
     else
     {
         // Prepare to write message
-        WriteToOutFile(": ");
+        AppendLiteralToOutFile(sink, ": ");
         
-        // Write message as plain-text if it's regular ASCII, otherwise convert each 16-bit character to UTF-8
+        // Write message as plain-text if it's regular ASCII, otherwise convert the 16-bit characters to UTF-8
         if (msg->mWideStrSize == 0)
-        {
-            WriteToOutFile(msg->mText);
-            WriteToOutFile("\n");
-        }
+            AppendToOutFile(sink, msg->mText, msg->mTextLength);
         else
-        {
-            for (int a = 0; a < msg->mWideStrSize * 2; a += 2)
-            {
-                char *bytes = NULL;
-                ConvertUnicodeToUTF8((msg->mText + a), &bytes);
-                WriteToOutFile(bytes);
-            }
-            WriteToOutFile("\n");
-        }
+            AppendUTF16AsUTF8ToOutFile(sink, msg->mText, msg->mWideStrSize);
+        AppendCharToOutFile(sink, '\n');
     }
 }
 
-// Release memory allocated for message
+// Forget the strings belonging to a message. Nothing needs to be freed here, as the message's memory is reclaimed all at once when
+// "icMessageArena" is reset.
 void DeleteMessage(ICMessage *msg)
 {
-    free(msg->mSenderID);
     msg->mSenderID = NULL;
-    free(msg->mTime);
-    msg->mTime = NULL;
-    free(msg->mText);
+    msg->mSenderIDLength = 0;
     msg->mText = NULL;
+    msg->mTextLength = 0;
 }
 
-// Return the ID (offset table index) for the message in gMessageListArray at position "msgNum"
-uint64_t ReturnMessageRef(uint64_t msgNum)
+// Return the ID (offset table index) for the message in "icMessageListArray" at position "msgNum"
+uint64_t ReturnMessageRef(ICContext *ic, uint64_t msgNum)
 {
+    BPContext *bc = ic->icBP;
     BPObject msgID_ID;
-    uint64_t msgID_IDref = ReturnElemRef(&gMessageListArray, (uint64_t)msgNum);
+    uint64_t msgID_IDref = ReturnElemRef(bc, &ic->icMessageListArray, (uint64_t)msgNum);
     if (msgID_IDref == (uint64_t)-1)
         return (uint64_t)-1;
-    if (!LoadObject(msgID_IDref, &msgID_ID))
+    if (!LoadObject(bc, msgID_IDref, &msgID_ID))
         return (uint64_t)-1;
     if (msgID_ID.oType != kTypeUID)
         return false;
-    uint64_t msgIDref = ReturnElemRef(&gObjectsArray, msgID_ID.oInt);
+    uint64_t msgIDref = ReturnElemRef(bc, &ic->icObjectsArray, msgID_ID.oInt);
     if (msgIDref == (uint64_t)-1)
         return (uint64_t)-1;
     
     return msgIDref;
 }
-#pragma mark Utility functions
-// Takes the 16-bit Unicode character passed in and returns a UTF-8 string of up to 4 characters
-void ConvertUnicodeToUTF8(char *unicodeStr, char **utf8Str)
+#pragma mark Account chains
+// Look for the account ID at the end of the chain that starts at "accountUID" among those already found, counting a hit or a miss
+bool FindAccountChain(ICContext *ic, uint64_t accountUID, char **accountID, uint64_t *length)
+{
+    for (uint64_t slot = HashAccountUID(accountUID); ic->icAccountChainsCapacity > 0; slot++)
+    {
+        ICAccountChain *chain = &ic->icAccountChains[slot & (ic->icAccountChainsCapacity - 1)];
+        if (chain->acID == NULL)
+            break;
+        if (chain->acUID == accountUID)
+        {
+            *accountID = chain->acID;
+            *length = chain->acIDLength;
+            ic->icAccountChainHits++;
+            return true;
+        }
+    }
+    
+    ic->icAccountChainMisses++;
+    return false;
+}
+
+// Remember that the chain starting at "accountUID" ends at "accountID". If there is no memory for it, the chain is simply followed
+// again next time.
+void AddAccountChain(ICContext *ic, uint64_t accountUID, char *accountID, uint64_t length)
+{
+    if ((ic->icNumAccountChains + 1) * 2 > ic->icAccountChainsCapacity && !GrowAccountChains(ic))
+        return;
+    
+    uint64_t slot = HashAccountUID(accountUID);
+    while (ic->icAccountChains[slot & (ic->icAccountChainsCapacity - 1)].acID != NULL)
+        slot++;
+    ICAccountChain *chain = &ic->icAccountChains[slot & (ic->icAccountChainsCapacity - 1)];
+    chain->acUID = accountUID;
+    chain->acID = accountID;
+    chain->acIDLength = length;
+    ic->icNumAccountChains++;
+}
+
+// Double the number of slots in the table of account chains, moving each chain to its slot in the new table
+bool GrowAccountChains(ICContext *ic)
 {
-    int wc = (*(char *)unicodeStr << 8) + *(char *)(unicodeStr + 1);
-    *utf8Str = calloc(5, 1); // freed with DeleteMessage()
-    char *byte = *utf8Str;
-    if (wc < 0x80) // 7 bits or less, so we have a standard ASCII byte; just save it
-        *byte = (char)wc;
-    else if (wc < 0x800) // no more than 11 bits, so we can fit the Unicode into two bytes of 5 + 6 bits
+    uint64_t capacity = (ic->icAccountChainsCapacity == 0 ? 16 : ic->icAccountChainsCapacity * 2);
+    ICAccountChain *chains = calloc((size_t)capacity, sizeof(ICAccountChain)); // freed with FreeICContext()
+    if (chains == NULL)
+        return false;
+    
+    for (uint64_t a = 0; a < ic->icAccountChainsCapacity; a++)
     {
-        *byte++ = (char)(0xC0 + (wc >> 6)); // add b110xxxxx to upper five bits
-        *byte = (char)(0x80 + (wc & 0x3F)); // add b10xxxxxx to lower six bits
+        ICAccountChain *chain = &ic->icAccountChains[a];
+        if (chain->acID == NULL)
+            continue;
+        uint64_t slot = HashAccountUID(chain->acUID);
+        while (chains[slot & (capacity - 1)].acID != NULL)
+            slot++;
+        chains[slot & (capacity - 1)] = *chain;
     }
-    else if ((unsigned)wc - 0xd800u < 0x800) // falls in forbidden range
-        printf("Error: Failed to convert a Unicode character: forbidden range.\n");
-    else if (wc < 0x10000) // no more than 16 bits, so we can fit it in 4 + 6 + 6 bits
+    
+    free(ic->icAccountChains);
+    ic->icAccountChains = chains;
+    ic->icAccountChainsCapacity = capacity;
+    return true;
+}
+
+// Free the table of account chains; the account IDs themselves belong to the file
+void FreeAccountChains(ICContext *ic)
+{
+    free(ic->icAccountChains);
+    ic->icAccountChains = NULL;
+    ic->icAccountChainsCapacity = 0;
+    ic->icNumAccountChains = 0;
+}
+
+// Spread UIDs, which are small consecutive numbers, across the table
+uint64_t HashAccountUID(uint64_t accountUID)
+{
+    return (accountUID * 0x9E3779B97F4A7C15ULL) >> 32;
+}
+#pragma mark Sender table
+// Fill the table of senders with each participant's account ID, which is how most messages give their sender, so that converting the
+// messages mostly finds senders that are already resolved. Returns false if memory ran out.
+bool BuildSenderTable(ICContext *ic)
+{
+    FreeSenderTable(ic);
+    
+    // Keep the table no more than half full, leaving room for the other forms of ID that the messages may use
+    uint64_t capacity = 16;
+    while (capacity < ic->icNumParticipantIDs * 4)
+        capacity *= 2;
+    ic->icSenders = calloc((size_t)capacity, sizeof(ICSender)); // freed with FreeICContext()
+    if (ic->icSenders == NULL)
     {
-        *byte++ = (char)(0xE0 + (wc >> 12));       // add b1110xxxx to upper four bits
-        *byte++ = (char)0x80 + ((wc >> 6) & 0x3F); // add b10xxxxxx to next six bits
-        *byte = (char)(0x80 + (wc & 0x3F));        // add b10xxxxxx to final six bits
+        printf("Fatal error: Memory allocation failed.\n");
+        return false;
     }
-    else if (wc < 0x110000) // no more than 20 bits, so it is not too large (Unicode stops at 21 bits, 3 + 6 + 6 + 6)
+    ic->icSendersCapacity = capacity;
+    
+    for (uint64_t a = 0; a < ic->icNumParticipantIDs; a++)
     {
-        *byte++ = (char)(0xF0 + (wc >> 18));          // add b11110xxx to upper three bits
-        *byte++ = (char)(0x80 + ((wc >> 12) & 0x3F)); // add b10xxxxxx to next six bits
-        *byte++ = (char)(0x80 + ((wc >> 6) & 0x3F));  // add b10xxxxxx to next six bits
-        *byte = (char)(0x80 + (wc >> 6));             // add b10xxxxxx to final six bits
+        ICSender *sender;
+        if (!FindSender(ic, ic->icParticipantIDs[a], strlen(ic->icParticipantIDs[a]), &sender))
+            return false;
     }
-    else
-        printf("Error: Failed to convert a Unicode character: out of range.\n");
+    
+    return true;
 }
 
-// Write sender account ID or real name to disk, and trim ID if requested by user
-void WriteSenderName(ICMessage *msg, bool useRTF)
+// Give "dest" a table of senders of its own with the entries in the table of "src", so that a context converting part of a log on
+// another thread can add to it without locking. If this fails, "dest" is left with an empty table, which FindSender() fills as needed.
+bool CopySenderTable(ICContext *dest, const ICContext *src)
 {
-    char *nameToUse = NULL;
-    char *senderCompareCopy = NULL;
-    bool lookupSuccess = false;
+    dest->icSenders = NULL;
+    dest->icSendersCapacity = 0;
+    dest->icNumSenders = 0;
+    if (src->icSenders == NULL)
+        return true;
+    
+    dest->icSenders = calloc((size_t)src->icSendersCapacity, sizeof(ICSender)); // freed with FreeICContext()
+    if (dest->icSenders == NULL)
+        return false;
+    dest->icSendersCapacity = src->icSendersCapacity;
+    
+    for (uint64_t a = 0; a < src->icSendersCapacity; a++)
+    {
+        const ICSender *original = &src->icSenders[a];
+        if (original->sdBytes == NULL)
+            continue;
+        
+        ICSender *copy = &dest->icSenders[a];
+        *copy = *original;
+        uint64_t numBytes = original->sdIDLength + original->sdNameLength + original->sdRTFLength;
+        copy->sdBytes = malloc((size_t)numBytes); // freed with FreeICContext()
+        if (copy->sdBytes == NULL)
+        {
+            FreeSenderTable(dest);
+            return false;
+        }
+        memcpy(copy->sdBytes, original->sdBytes, (size_t)numBytes);
+        copy->sdID = copy->sdBytes;
+        copy->sdName = copy->sdBytes + (original->sdName - original->sdBytes);
+        copy->sdRTF = copy->sdBytes + (original->sdRTF - original->sdBytes);
+        dest->icNumSenders++;
+    }
+    
+    return true;
+}
+
+// Free the table of senders and everything in it
+void FreeSenderTable(ICContext *ic)
+{
+    for (uint64_t a = 0; ic->icSenders != NULL && a < ic->icSendersCapacity; a++)
+        free(ic->icSenders[a].sdBytes);
+    free(ic->icSenders);
+    ic->icSenders = NULL;
+    ic->icSendersCapacity = 0;
+    ic->icNumSenders = 0;
+}
+
+// Double the number of slots in the table of senders, moving each entry to its slot in the new table
+bool GrowSenderTable(ICContext *ic)
+{
+    uint64_t capacity = (ic->icSendersCapacity == 0 ? 16 : ic->icSendersCapacity * 2);
+    ICSender *senders = calloc((size_t)capacity, sizeof(ICSender)); // freed with FreeICContext()
+    if (senders == NULL)
+    {
+        printf("Fatal error: Memory allocation failed.\n");
+        return false;
+    }
     
-    // Make copy of sender name for this comparison, then adjust it for known differences in how sender name can be stored in the
-    // "Participants" array versus the message metadata
-    asprintf(&senderCompareCopy, "%s", msg->mSenderID); // freed at end of function
+    for (uint64_t a = 0; a < ic->icSendersCapacity; a++)
+    {
+        ICSender *sender = &ic->icSenders[a];
+        if (sender->sdBytes == NULL)
+            continue;
+        uint64_t slot = sender->sdHash & (capacity - 1);
+        while (senders[slot].sdBytes != NULL)
+            slot = (slot + 1) & (capacity - 1);
+        senders[slot] = *sender;
+    }
+    
+    free(ic->icSenders);
+    ic->icSenders = senders;
+    ic->icSendersCapacity = capacity;
+    return true;
+}
+
+// Point "sender" to the entry in the table for the sender ID "senderID" of "length" bytes, resolving the ID and adding it to the table if
+// it hasn't been seen before. Returns false if memory ran out.
+bool FindSender(ICContext *ic, const char *senderID, uint64_t length, ICSender **sender)
+{
+    uint64_t hash = HashSenderID(senderID, length);
+    
+    // Probe from the ID's slot until we find it or reach an empty slot, which is where it belongs if it's not in the table yet
+    uint64_t slot = 0;
+    if (ic->icSendersCapacity > 0)
+    {
+        slot = hash & (ic->icSendersCapacity - 1);
+        while (ic->icSenders[slot].sdBytes != NULL)
+        {
+            ICSender *entry = &ic->icSenders[slot];
+            if (entry->sdHash == hash && entry->sdIDLength == length && !memcmp(entry->sdID, senderID, (size_t)length))
+            {
+                *sender = entry;
+                return true;
+            }
+            slot = (slot + 1) & (ic->icSendersCapacity - 1);
+        }
+    }
+    
+    if ((ic->icNumSenders + 1) * 2 > ic->icSendersCapacity)
+    {
+        if (!GrowSenderTable(ic))
+            return false;
+        slot = hash & (ic->icSendersCapacity - 1);
+        while (ic->icSenders[slot].sdBytes != NULL)
+            slot = (slot + 1) & (ic->icSendersCapacity - 1);
+    }
+    
+    if (!ResolveSender(ic, senderID, length, hash, &ic->icSenders[slot]))
+        return false;
+    ic->icNumSenders++;
+    *sender = &ic->icSenders[slot];
+    return true;
+}
+
+// Match the sender ID "senderID" of "length" bytes against the participants' account IDs and work out what WriteSenderName() should
+// write for it, filling in "sender" with the results. Returns false if memory ran out, leaving "sender" empty.
+bool ResolveSender(ICContext *ic, const char *senderID, uint64_t length, uint64_t hash, ICSender *sender)
+{
+    const char *nameToUse = NULL;
+    uint64_t nameLength = 0;
+    
+    // Work out a view of the sender name for this comparison that is adjusted for known differences in how sender name can be stored
+    // in the "Participants" array versus the message metadata
+    const char *compareStart = senderID;
+    uint64_t compareLength = length;
     
     // "e:user@domain.com" in a message might be stored as "e:user" in "Participants"
-    char *atMarkPosition = strchr(senderCompareCopy, '@');
+    const char *atMarkPosition = memchr(senderID, '@', (size_t)length);
     if (atMarkPosition != NULL)
-        *atMarkPosition = '\0';
+        compareLength = (uint64_t)(atMarkPosition - senderID);
     
     // "+15551235555" in a message might be stored as "15551235555" in "Participants"
-    if (*senderCompareCopy == '+')
+    if (compareLength > 0 && *compareStart == '+')
     {
-        uint64_t copySize = strlen(senderCompareCopy);
-        memmove(senderCompareCopy, senderCompareCopy + 1, copySize + 1);
+        compareStart++;
+        compareLength--;
     }
     
     // Look for this account ID in our preloaded array of IDs. If we are using "real names", this will give us the location of said
     // real name. If we are simply using account ID, then we still need to know the location of this ID in our master array so we can
     // pick the appropriate color below.
     int nameIndex = -1;
-    for (int a = 0; a < gNumParticipantIDs; a++)
+    for (int a = 0; a < ic->icNumParticipantIDs; a++)
     {
         // Try message's sender ID against a raw participant ID and also our massaged version of it
-        if (!strcmp(gParticipantIDs[a], msg->mSenderID) || !strcmp(gParticipantIDs[a], senderCompareCopy))
+        uint64_t IDlength = strlen(ic->icParticipantIDs[a]);
+        if ((IDlength == length && !memcmp(ic->icParticipantIDs[a], senderID, (size_t)length)) ||
+            (IDlength == compareLength && !memcmp(ic->icParticipantIDs[a], compareStart, (size_t)compareLength)))
         {
             nameIndex = a;
             break;
         }
     }
-    if (nameIndex == -1)
-        printf("Warning: The sender ID on this message, %s, did not match a known participant ID.\n", msg->mSenderID);
     
     // If "real names" were requested, see if we have one for this sender ID
-    if (gUseRealNames)
-    {
-        if (nameIndex > gNumParticipantNames)
-            printf("Error: There is no corresponding real name for sender with ID '%s' at index %d. Falling back to account ID.\n", msg->mSenderID, nameIndex);
-        else if (gParticipantNames[nameIndex] == NULL)
-            printf("Error: Attempted to look up real name of sender '%s' at index %d, but it was missing. Falling back to account ID.\n", msg->mSenderID, nameIndex);
-        else
-            lookupSuccess = true;
-    }
-    
-    // Retrieve "real name" if it exists
-    if (lookupSuccess) // automatically "false" if gUseRealNames is "false"
+    bool lookupSuccess = false;
+    if (ic->icUseRealNames)
     {
-        uint64_t nameLength = strlen(gParticipantNames[nameIndex]);
-        nameToUse = malloc(nameLength + 1); // freed at end of function
-        strncpy(nameToUse, gParticipantNames[nameIndex], nameLength);
-        nameToUse[nameLength] = '\0';
+        lookupSuccess = (nameIndex != -1 && nameIndex < ic->icNumParticipantNames && ic->icParticipantNames[nameIndex] != NULL);
+        if (lookupSuccess)
+        {
+            nameToUse = ic->icParticipantNames[nameIndex];
+            nameLength = strlen(nameToUse);
+        }
     }
     
     // If "real name" doesn't exist or we are using account ID, prepare account ID for writing to disk
-    if (!gUseRealNames || !lookupSuccess)
+    if (!lookupSuccess)
     {
-        uint64_t IDlength = strlen(msg->mSenderID);
-        char *IDstart = msg->mSenderID;
+        const char *IDstart = senderID;
+        const char *IDend = senderID + length;
         
         // Adjust string start/end if trimming was requested
-        if (gTrimEmailIDs)
+        if (ic->icTrimEmailIDs)
         {
             // Start string after 'e:'
-            char *colonPosition = strchr(msg->mSenderID, ':');
+            const char *colonPosition = memchr(senderID, ':', (size_t)length);
             if (colonPosition != NULL)
                 IDstart = colonPosition + 1;
             
             // End string at '@'
-            char *atMarkPosition2 = strchr(msg->mSenderID, '@');
-            if (atMarkPosition2 != NULL)
-                IDlength -= (uint32_t)((IDstart + IDlength) - atMarkPosition2);
+            if (atMarkPosition != NULL && atMarkPosition >= IDstart)
+                IDend = atMarkPosition;
         }
         
-        // Retrieve trimmed account ID
-        nameToUse = malloc(IDlength + 1); // freed at end of function
-        strncpy(nameToUse, IDstart, IDlength);
-        nameToUse[IDlength] = '\0';
+        nameToUse = IDstart;
+        nameLength = (uint64_t)(IDend - IDstart);
     }
     
-    if (useRTF)
+    // Lay out the ID, the name and the RTF markup one after another in a single block. For sender name, use colors 2 through 6 in our
+    // table depending on position in "icParticipantIDs"; use black if we couldn't find this participant in our list of known IDs for
+    // some reason. Names converted from Unicode are UTF-8, which has to be turned into RTF markup.
+    OutSink bytes;
+    CreateMemorySink(&bytes, 0);
+    AppendToOutFile(&bytes, senderID, (size_t)length);
+    AppendToOutFile(&bytes, nameToUse, (size_t)nameLength);
+    AppendLiteralToOutFile(&bytes, "\\cf");
+    AppendCharToOutFile(&bytes, (char)('0' + (nameIndex == -1 ? 0 : (nameIndex % 5) + 2)));
+    AppendCharToOutFile(&bytes, ' ');
+    AppendRTFEscapedToOutFile(&bytes, nameToUse, (size_t)nameLength);
+    if (bytes.osFailed)
     {
-        // For sender name, use colors 2 through 6 in our table depending on position in gParticipantIDs. Use black if we couldn't
-        // find this participant in our list of known IDs for some reason. Use italics if this is a file transfer (ending tag is in
-        // ConvertMessageToRTF()).
-        char *nameColor = NULL;
-        if (nameIndex == -1)
-            nameIndex = 0;
-        else
-            nameIndex = (nameIndex % 5) + 2;
-        asprintf(&nameColor, "%s\\cf%d ", msg->mFileTransfer ? "\\i1 " : "", nameIndex); // freed below
-        WriteToOutFile(nameColor);
-        free(nameColor);
+        FreeMemorySink(&bytes);
+        return false;
     }
     
-    // Actually write sender name
-    WriteToOutFile(nameToUse);
+    sender->sdBytes = bytes.osBuffer; // freed with FreeICContext()
+    sender->sdHash = hash;
+    sender->sdID = bytes.osBuffer;
+    sender->sdIDLength = length;
+    sender->sdName = sender->sdID + length;
+    sender->sdNameLength = nameLength;
+    sender->sdRTF = sender->sdName + nameLength;
+    sender->sdRTFLength = bytes.osUsed - length - nameLength;
+    sender->sdIndex = nameIndex;
+    sender->sdMissingName = (ic->icUseRealNames && !lookupSuccess);
+    return true;
+}
+
+// Give the warnings about "sender" that used to come from looking it up, each time a message from it is written
+void ReportSenderProblems(ICContext *ic, const ICSender *sender)
+{
+    int senderLength = (int)sender->sdIDLength;
+    int nameIndex = sender->sdIndex;
     
-    free(nameToUse);
-    free(senderCompareCopy);
+    if (nameIndex == -1)
+        ReportMessageProblem(ic, "Warning: The sender ID on this message, %.*s, did not match a known participant ID.\n", senderLength, sender->sdID);
+    if (!sender->sdMissingName)
+        return;
+    if (nameIndex == -1 || nameIndex >= ic->icNumParticipantNames)
+        ReportMessageProblem(ic, "Error: There is no corresponding real name for sender with ID '%.*s' at index %d. Falling back to account ID.\n", senderLength, sender->sdID, nameIndex);
+    else
+        ReportMessageProblem(ic, "Error: Attempted to look up real name of sender '%.*s' at index %d, but it was missing. Falling back to account ID.\n", senderLength, sender->sdID, nameIndex);
+}
+
+// FNV-1a hash of a sender ID
+uint64_t HashSenderID(const char *senderID, uint64_t length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint64_t a = 0; a < length; a++)
+    {
+        hash ^= (uint8_t)senderID[a];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+#pragma mark Utility functions
+// Converts the Unicode string "str" into a null-terminated UTF-8 string at "dest", which must have room for 3 bytes per character plus
+// the null terminator, leaving out the directional tags that names tend to be wrapped in. Returns the length of the string.
+uint64_t ConvertUnicodeName(BPObject *str, char *dest)
+{
+    char *end = TranscodeUTF16ToUTF8IntoBuffer(str->oData, str->oSize, dest);
+    size_t length = RemoveDirectionalMarks(dest, (size_t)(end - dest));
+    dest[length] = '\0';
+    return length;
+}
+
+// Write the name of the sender of "msg", in the participant's color if "useRTF" is set. The sender is looked up in the table of senders,
+// so the matching of the ID against the participants and the applying of the name options is only done the first time it is seen.
+void WriteSenderName(ICContext *ic, ICMessage *msg, bool useRTF)
+{
+    OutSink *sink = &ic->icOutSink;
+    ICSender *sender;
+    if (!FindSender(ic, msg->mSenderID, msg->mSenderIDLength, &sender))
+    {
+        AppendToOutFile(sink, msg->mSenderID, msg->mSenderIDLength);
+        return;
+    }
+    
+    ReportSenderProblems(ic, sender);
+    if (useRTF)
+    {
+        // Use italics if this is a file transfer (ending tag is in ConvertMessageToRTF())
+        if (msg->mFileTransfer)
+            AppendLiteralToOutFile(sink, "\\i1 ");
+        AppendToOutFile(sink, sender->sdRTF, sender->sdRTFLength);
+    }
+    else
+        AppendToOutFile(sink, sender->sdName, sender->sdNameLength);
 }
 
 // Starts RTF file with necessary header markup
-void WriteRTFHeader(void)
+void WriteRTFHeader(ICContext *ic)
 {
+    OutSink *sink = &ic->icOutSink;
+    
     // Standard Mac text and font settings
-    WriteToOutFile("{\\rtf1\\ansi\\ansicpg1252\\cocoartf1038\\cocoasubrtf360\n");
-    WriteToOutFile("{\\fonttbl\\f0\\fswiss\\fcharset0 Helvetica;}\n");
+    AppendLiteralToOutFile(sink, "{\\rtf1\\ansi\\ansicpg1252\\cocoartf1038\\cocoasubrtf360\n");
+    AppendLiteralToOutFile(sink, "{\\fonttbl\\f0\\fswiss\\fcharset0 Helvetica;}\n");
     
     // Set up color table with black for message, gray for timestamp, then blue, green, orange, cyan and red for participant names;
     // these five colors are cycled through in the case of more than five participants
-    WriteToOutFile("{\\colortbl\\red0\\green0\\blue0;\\red128\\green128\\blue128;\\red0\\green0\\blue128;\\red0\\green128\\blue0;");
-    WriteToOutFile("\\red255\\green128\\blue0;\\red0\\green128\\blue128;\\red128\\green0\\blue0;}\n");
+    AppendLiteralToOutFile(sink, "{\\colortbl\\red0\\green0\\blue0;\\red128\\green128\\blue128;\\red0\\green0\\blue128;\\red0\\green128\\blue0;");
+    AppendLiteralToOutFile(sink, "\\red255\\green128\\blue0;\\red0\\green128\\blue128;\\red128\\green0\\blue0;}\n");
     
     // Typical margin and view settings (vieww/h is Mac-only)
-    WriteToOutFile("\\margl1440\\margr1440\\vieww9000\\viewh8400\\viewkind0\n\n");
+    AppendLiteralToOutFile(sink, "\\margl1440\\margr1440\\vieww9000\\viewh8400\\viewkind0\n\n");
 }
 
 // Closes RTF markup at end of file
-void WriteRTFFooter(void)
+void WriteRTFFooter(ICContext *ic)
 {
-    WriteToOutFile("}");
+    OutSink *sink = &ic->icOutSink;
+    
+    AppendLiteralToOutFile(sink, "}");
 }
 
 // Write long-format timestamp at top of converted log
-void WriteTimeHeader(bool useRTF)
+void WriteTimeHeader(ICContext *ic, bool useRTF)
 {
+    OutSink *sink = &ic->icOutSink;
+    
     if (useRTF)
-        WriteToOutFile("\\cf1 "); // gray
-    WriteToOutFile("Chat window opened on ");
-    WriteToOutFile(gFirstMsgTime);
+        AppendLiteralToOutFile(sink, "\\cf1 "); // gray
+    AppendLiteralToOutFile(sink, "Chat window opened on ");
+    AppendStringToOutFile(sink, ic->icFirstMsgTime);
     if (useRTF)
-        WriteToOutFile(":\\\n");
+        AppendLiteralToOutFile(sink, ":\\\n");
     else
-        WriteToOutFile(":\n");
+        AppendLiteralToOutFile(sink, ":\n");
+}
+
+// Print a warning about the message being converted, or keep it in "icReport" to be printed later if the message is being converted
+// out of order on another thread
+void ReportMessageProblem(ICContext *ic, const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    if (ic->icReport == NULL)
+        vprintf(format, args);
+    else
+    {
+        char *text = NULL;
+        int length = vasprintf(&text, format, args); // freed below
+        if (length > 0)
+            AppendToOutFile(ic->icReport, text, (size_t)length);
+        free(text);
+    }
+    va_end(args);
 }
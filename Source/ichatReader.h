@@ -9,33 +9,137 @@
 #ifndef ichatReader_h
 #define ichatReader_h
 
+#define MAX_FIELD_PLANS 8 // number of message dict layouts that LoadMessage() keeps field plans for; other layouts are scanned
+
 typedef struct ICMessage
 {
     bool     mHiccup;       // if true, this message is an "SMS hiccup" and should be ignored
     bool     mFromClient;   // if true, this is a message from the IM client, not a human
     uint64_t mFileTransfer; // if zero, this message is a regular text message; otherwise, the number of files being sent
-    char    *mSenderID;     // account ID of this user with their IM service
-    char    *mTime;         // string with date and time that message was sent
-    char    *mText;         // the text of the message, or the name(s) of the file(s) if "mFileTransfer" is non-zero
-    uint64_t mWideStrSize;  // size of "mText" in 2-byte Unicode chars, if "mText" is not ASCII; doubles as flag marking msg as Unicode
+    char    *mSenderID;        // account ID of this user with their IM service; not null-terminated
+    uint64_t mSenderIDLength;  // length of "mSenderID" in bytes
+    char     mTime[NSDATE_STRING_SIZE]; // string with time that message was sent
+    char    *mText;            // the text of the message, or the name(s) of the file(s) if "mFileTransfer" is non-zero; not null-terminated
+    uint64_t mTextLength;      // length of "mText" in bytes
+    uint64_t mWideStrSize;     // size of "mText" in 2-byte Unicode chars, if "mText" is not ASCII; doubles as flag marking msg as Unicode
 } ICMessage;
 
-bool     Validate_ichat(void);
-bool     Load_ichat(void);
-void     Browse_ichatObjects(void);
-void     Browse_ichatMessages(void);
-void     Convert_ichat(bool useRTF);
+// "mSenderID" and "mText" point into the file unless their strings had to be modified, in which case the modified copies are kept in
+// the context's "icMessageArena" until it is reset after the message has been written
+
+// A sender ID that has been matched against the participants, with the name that WriteSenderName() writes for it in TXT and in RTF.
+// "sdID", "sdName" and "sdRTF" all point into "sdBytes", a single block owned by the entry.
+typedef struct ICSender
+{
+    char    *sdBytes;          // the sender ID, then the name, then the RTF markup; NULL if this slot of the table is empty
+    uint64_t sdHash;           // hash of the sender ID from HashSenderID()
+    char    *sdID;             // the sender ID as it appears in messages; not null-terminated
+    uint64_t sdIDLength;       // length of "sdID" in bytes
+    char    *sdName;           // the name to write for the sender after the "real names" and trimming options are applied
+    uint64_t sdNameLength;     // length of "sdName" in bytes
+    char    *sdRTF;            // the color markup for the sender followed by "sdName" escaped for RTF
+    uint64_t sdRTFLength;      // length of "sdRTF" in bytes
+    int      sdIndex;          // position of the sender's account ID in "icParticipantIDs", or -1 if it isn't there
+    bool     sdMissingName;    // whether a real name was wanted but the participant doesn't have one
+} ICSender;
+
+// The account ID at the end of the chain of references that starts at the UID in a message's "Sender" or "Subject" value
+typedef struct ICAccountChain
+{
+    uint64_t acUID;            // UID at the head of the chain
+    char    *acID;             // the account ID, which points into the file; NULL if this slot of the table is empty
+    uint64_t acIDLength;       // length of "acID" in bytes
+} ICAccountChain;
+
+// Everything belonging to the browsing or conversion of one iChat log, along with the options that it was asked for. Nothing in
+// ichatReader is shared between contexts, so several logs can be converted at once on different threads.
+typedef struct ICContext
+{
+    BPContext  *icBP;                  // the bplist that the log is read from
+    BPObject    icObjectsArray;        // "$objects", the array object that points to all chat messages and metadata
+    BPObject    icMessageListArray;    // the array object that points to all messages in the chat
+    uint64_t    icNumParticipantNames; // number of names pointed to by "icParticipantNames"
+    char      **icParticipantNames;    // pointer to array of pointers to "real" names of participants
+    uint64_t    icNumParticipantIDs;   // number of account IDs pointed to by "icParticipantIDs"
+    char      **icParticipantIDs;      // pointer to array of pointers to account IDs of participants
+    ICSender   *icSenders;             // hash table of the sender IDs resolved so far, filled with the participants' IDs by Load_ichat()
+    uint64_t    icSendersCapacity;     // number of slots in "icSenders", a power of two
+    uint64_t    icNumSenders;          // number of slots in "icSenders" in use
+    ICAccountChain *icAccountChains;   // hash table of the account IDs that LoadAccountID() has found, keyed by UID
+    uint64_t    icAccountChainsCapacity; // number of slots in "icAccountChains", a power of two
+    uint64_t    icNumAccountChains;    // number of slots in "icAccountChains" in use
+    uint64_t    icAccountChainHits;    // number of account IDs that LoadAccountID() found in "icAccountChains"
+    uint64_t    icAccountChainMisses;  // number of account IDs that LoadAccountID() had to follow the references to
+    BPFieldPlan icFieldPlans[MAX_FIELD_PLANS]; // where the keys are in each layout of message dict seen so far
+    int         icNumFieldPlans;       // number of plans in "icFieldPlans"
+    char        icFirstMsgTime[NSDATE_STRING_SIZE]; // long-format timestamp representing beginning of chat
+    BPDateCache icDateCache;           // the date of the day of the last message whose time was converted in long format
+    Arena       icMessageArena;        // memory for the message being converted or printed and its formatting; reset after each message
+    uint64_t    icFirstMsgHeapAllocs;  // number of times "icMessageArena" went to the heap up to the end of the first message
+    OutSink     icOutSink;             // where the converted log is written
+    OutSink    *icReport;              // where warnings about messages are collected, or NULL to print them straight away
+    
+    // Options
+    const char *icOutFileBase;         // path that the out file is named after by changing its suffix; normally the log's own path
+    bool        icUseRealNames;        // whether to look up names given to chat accounts in iChat or use account IDs
+    bool        icTrimEmailIDs;        // whether to remove '@domain.com' from end of account ID names
+    bool        icOverwriteFile;       // whether to overwrite a file by the same name as the out file
+    bool        icPrintStats;          // whether to print statistics about the conversion when it's done
+    int         icNumThreads;          // number of threads to format the messages on
+    const struct TimeZone *icTimeZone; // zone that message times are written in, or NULL for LOCAL_TIME_ZONE
+} ICContext;
+
+// A run of consecutive messages that ConvertMessagesInParallel() formats on a thread of its own. The chunk's output and warnings are
+// kept in memory until the chunks before it have been written, so the result is the same as converting the messages in order.
+typedef struct ICChunk
+{
+    ICContext   ckContext;             // copy of the log's context with an arena of its own and an out sink in memory
+    OutSink     ckReport;              // the warnings printed while converting the chunk's messages
+    uint64_t    ckFirstMsg;            // position in "icMessageListArray" of the first message in the chunk
+    uint64_t    ckEndMsg;              // position in "icMessageListArray" just past the last message in the chunk
+    bool        ckUseRTF;              // whether to convert into RTF instead of TXT
+    bool        ckConverted;           // whether every message in the chunk was converted
+} ICChunk;
+
+void     InitICContext(ICContext *ic, BPContext *bc);
+void     FreeICContext(ICContext *ic);
+bool     Validate_ichat(ICContext *ic);
+bool     Load_ichat(ICContext *ic);
+void     Browse_ichatObjects(ICContext *ic);
+void     Browse_ichatMessages(ICContext *ic);
+bool     Convert_ichat(ICContext *ic, bool useRTF);
+bool     FormatLog(ICContext *ic, bool useRTF);
+bool     FinishConvertedLog(ICContext *ic, bool converted);
+bool     ConvertMessageRange(ICContext *ic, uint64_t firstMsg, uint64_t endMsg, bool useRTF);
+bool     ConvertMessagesInParallel(ICContext *ic, uint64_t firstMsg, uint64_t endMsg, uint64_t numChunks, bool useRTF);
+void    *RunMessageChunk(void *arg);
 void     InitMessage(ICMessage *msg);
-bool     LoadMessage(BPObject *BPmsg, ICMessage *ICmsg, bool firstMsg);
+bool     LoadMessage(ICContext *ic, BPObject *BPmsg, ICMessage *ICmsg, bool firstMsg);
+bool     ChooseFieldPlan(ICContext *ic, BPObject *dict, const BPFieldPlan **plan);
+bool     LoadAccountID(ICContext *ic, uint64_t accountUID, char **accountID, uint64_t *length);
+bool     FindAccountChain(ICContext *ic, uint64_t accountUID, char **accountID, uint64_t *length);
+void     AddAccountChain(ICContext *ic, uint64_t accountUID, char *accountID, uint64_t length);
+bool     GrowAccountChains(ICContext *ic);
+void     FreeAccountChains(ICContext *ic);
+uint64_t HashAccountUID(uint64_t accountUID);
 void     PrintMessage(ICMessage *msg);
-void     ConvertMessageToRTF(ICMessage *msg);
-void     ConvertMessageToTXT(ICMessage *msg);
+void     ConvertMessageToRTF(ICContext *ic, ICMessage *msg);
+void     ConvertMessageToTXT(ICContext *ic, ICMessage *msg);
 void     DeleteMessage(ICMessage *msg);
-uint64_t ReturnMessageRef(uint64_t msgNum);
-void     ConvertUnicodeToUTF8(char *unicodeStr, char **utf8Str);
-void     WriteSenderName(ICMessage *msg, bool useRTF);
-void     WriteRTFHeader(void);
-void     WriteRTFFooter(void);
-void     WriteTimeHeader(bool useRTF);
+uint64_t ReturnMessageRef(ICContext *ic, uint64_t msgNum);
+uint64_t ConvertUnicodeName(BPObject *str, char *dest);
+bool     BuildSenderTable(ICContext *ic);
+bool     CopySenderTable(ICContext *dest, const ICContext *src);
+void     FreeSenderTable(ICContext *ic);
+bool     GrowSenderTable(ICContext *ic);
+bool     FindSender(ICContext *ic, const char *senderID, uint64_t length, ICSender **sender);
+bool     ResolveSender(ICContext *ic, const char *senderID, uint64_t length, uint64_t hash, ICSender *sender);
+void     ReportSenderProblems(ICContext *ic, const ICSender *sender);
+uint64_t HashSenderID(const char *senderID, uint64_t length);
+void     WriteSenderName(ICContext *ic, ICMessage *msg, bool useRTF);
+void     WriteRTFHeader(ICContext *ic);
+void     WriteRTFFooter(ICContext *ic);
+void     WriteTimeHeader(ICContext *ic, bool useRTF);
+void     ReportMessageProblem(ICContext *ic, const char *format, ...);
 
 #endif /* ichatReader_h */
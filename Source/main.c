@@ -6,13 +6,19 @@
 //  Copyright © 2016 Amethyst Software (contact@amethystsoftware.com). All rights reserved.
 //
 
+#include <pthread.h> // pthread_mutex_t
 #include <stdbool.h> // bool
+#include <stdint.h>  // uint64_t
 #include <stdio.h>   // fprintf()
 #include <stdlib.h>  // malloc()
 #include <string.h>  // strcpy()
+#include <unistd.h>  // sysconf()
+#include "Arena.h"
 #include "FileIO.h"
 #include "bplistReader.h"
 #include "ichatReader.h"
+#include "BatchConvert.h"
+#include "TimeZone.h"
 
 #pragma mark Enums
 enum ProgramModes
@@ -31,20 +37,29 @@ enum OutputFormats
 
 #pragma mark Function prototypes
 bool ProcessArguments(int argc, const char *argv[]);
+bool ConvertDirectory(void);
 void BrowseMenu_bplist(void);
-void BrowseMenu_ichat(void);
+void BrowseMenu_ichat(ICContext *ic);
 
 #pragma mark Globals
-bool  gIs_ichat = false;      // whether the file is an iChat log
-bool  gTreatAs_ichat = true;  // if false, browse the file as a bplist instead of an iChat log
-int   gMode = kModeNone;      // whether to browse or convert file
-char *gInFilePath = NULL;     // full path to file to process
-char *gInFileName = NULL;     // name of file to process
-int   gFormat = kFormatNone;  // whether to convert into TXT or RTF
-bool  gFollowRefs = false;    // whether to follow UIDs to the source or just print the UID #s when printing arrays and dicts
-bool  gUseRealNames = false;  // whether to look up names given to chat accounts in iChat or use account IDs
-bool  gOverwriteFile = false; // whether to overwrite a file by the same name when converting a log
-bool  gTrimEmailIDs = false;  // whether to remove '@domain.com' from end of account ID names when converting a log
+bool     gIs_ichat = false;      // whether the file is an iChat log
+bool     gTreatAs_ichat = true;  // if false, browse the file as a bplist instead of an iChat log
+int      gMode = kModeNone;      // whether to browse or convert file
+char    *gInFilePath = NULL;     // full path to file to process
+char    *gInFileName = NULL;     // name of file to process
+char    *gInDirPath = NULL;      // directory of files to convert, instead of a single file
+char    *gOutDirPath = NULL;     // directory in which to mirror "gInDirPath" with the converted files, instead of writing them beside the logs
+int      gNumThreads = 0;        // number of threads with which to convert a directory or a big log, or 0 for one per core
+int      gFormat = kFormatNone;  // whether to convert into TXT or RTF
+bool     gFollowRefs = false;    // whether to follow UIDs to the source or just print the UID #s when printing arrays and dicts
+bool     gUseRealNames = false;  // whether to look up names given to chat accounts in iChat or use account IDs
+bool     gOverwriteFile = false; // whether to overwrite a file by the same name when converting a log
+bool     gTrimEmailIDs = false;  // whether to remove '@domain.com' from end of account ID names when converting a log
+bool     gPrintStats = false;    // whether to print statistics about the conversion when it's done
+bool     gPipeline = false;      // whether to convert a directory with a thread for each stage of the work instead of one for each log
+uint64_t gMaxInflightBytes = 0;  // with "gPipeline", how many bytes of logs and output can be held in memory at once, or 0 for the default
+char    *gTimeZoneName = NULL;   // zoneinfo name or path of the zone to write times in, or NULL for LOCAL_TIME_ZONE
+TimeZone *gTimeZone = NULL;      // the zone named by "gTimeZoneName", once loaded
 
 #pragma mark Functions
 int main(int argc, const char *argv[])
@@ -52,16 +67,54 @@ int main(int argc, const char *argv[])
     if (!ProcessArguments(argc, argv))
         return 1;
     
-    if (!LoadInFile(gInFilePath))
+    // The zone's transitions are worked out once here and shared by every log and thread
+    TimeZone zone;
+    if (gTimeZoneName != NULL)
+    {
+        if (!LoadTimeZone(&zone, gTimeZoneName))
+            return 1;
+        gTimeZone = &zone;
+    }
+    
+    if (gInDirPath != NULL)
+    {
+        bool converted = ConvertDirectory();
+        if (gTimeZone != NULL)
+            FreeTimeZone(gTimeZone);
+        return (converted ? 0 : 1);
+    }
+    
+    // Everything about the file being read is kept in these contexts, which are handed to the functions that work on it
+    BPContext bc;
+    ICContext ic;
+    InitBPContext(&bc);
+    bc.bcFollowRefs = gFollowRefs;
+    bc.bcTimeZone = gTimeZone;
+    InitICContext(&ic, &bc);
+    ic.icOutFileBase = gInFilePath;
+    ic.icUseRealNames = gUseRealNames;
+    ic.icTrimEmailIDs = gTrimEmailIDs;
+    ic.icOverwriteFile = gOverwriteFile;
+    ic.icPrintStats = gPrintStats;
+    ic.icTimeZone = gTimeZone;
+    if (gNumThreads > 0)
+        ic.icNumThreads = gNumThreads;
+    else
+    {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        ic.icNumThreads = (cores > 0 ? (int)cores : 1);
+    }
+    
+    if (!LoadInFile(gInFilePath, &bc.bcFileContents, &bc.bcFileLength))
         return 1;
     
-    if (!Validate_bplist())
+    if (!Validate_bplist(&bc))
         return 1;
     
-    if (!Load_bplist())
+    if (!Load_bplist(&bc))
         return 1;
     
-    gIs_ichat = Validate_ichat();
+    gIs_ichat = Validate_ichat(&ic);
     
     if (gMode == kModeConvert)
         printf("Converting \"%s\"...\n", gInFileName);
@@ -74,13 +127,13 @@ int main(int argc, const char *argv[])
     
     if (gIs_ichat && gTreatAs_ichat)
     {
-        if (!Load_ichat())
+        if (!Load_ichat(&ic))
             return 1;
         
         if (gMode == kModeConvert)
-            Convert_ichat((gFormat == kFormatRTF));
+            Convert_ichat(&ic, (gFormat == kFormatRTF));
         else // kModeBrowse
-            BrowseMenu_ichat();
+            BrowseMenu_ichat(&ic);
     }
     else // handle as generic non-iChat bplist
     {
@@ -90,12 +143,43 @@ int main(int argc, const char *argv[])
             return 1;
         }
         else // kModeBrowse
-            Browse_bplistElements();
+            Browse_bplistElements(&bc);
     }
-
+    
+    FreeICContext(&ic);
+    FreeBPContext(&bc);
+    CloseInFile(&bc.bcFileContents, &bc.bcFileLength);
+    if (gTimeZone != NULL)
+        FreeTimeZone(gTimeZone);
     return 0;
 }
 
+// Convert every .ichat file under gInDirPath on a pool of threads, returning whether all of them were converted
+bool ConvertDirectory(void)
+{
+    Batch batch;
+    InitBatch(&batch);
+    batch.baInDir = gInDirPath;
+    batch.baOutDir = gOutDirPath;
+    if (gNumThreads > 0)
+        batch.baNumThreads = gNumThreads;
+    batch.baUseRTF = (gFormat == kFormatRTF);
+    batch.baUseRealNames = gUseRealNames;
+    batch.baTrimEmailIDs = gTrimEmailIDs;
+    batch.baOverwriteFile = gOverwriteFile;
+    batch.baPrintStats = gPrintStats;
+    batch.baPipeline = gPipeline;
+    if (gMaxInflightBytes > 0)
+        batch.baMaxInflightBytes = gMaxInflightBytes;
+    batch.baTimeZone = gTimeZone;
+    
+    printf("Converting the .ichat files in \"%s\"...\n", gInDirPath);
+    bool converted = Convert_batch(&batch);
+    FreeBatch(&batch);
+    
+    return converted;
+}
+
 // Interpret arguments passed to program
 bool ProcessArguments(int argc, const char *argv[])
 {
@@ -109,12 +193,19 @@ bool ProcessArguments(int argc, const char *argv[])
         printf(" Arguments:\n");
         printf("   -mode [convert | browse]: Required. Supply \"browse\" as the parameter in order to interactively browse a .ichat file or any other bplist. Supply \"convert\" to convert a .ichat file to a specified output format (specified by \"-format\" argument).\n");
         printf("   -input \"<full path to file>\": Required.\n");
+        printf("   -input-dir \"<full path to directory>\": Use instead of \"-input\" in \"convert\" mode to convert every .ichat file in the directory and its subdirectories.\n");
         printf("   -format [TXT | RTF]: Required when using \"convert\" mode. Used to specify which format a .ichat file should be outputted in.\n");
+        printf("   -output-dir \"<full path to directory>\": Optional with \"-input-dir\". The converted files are put in this directory, in the same subdirectories as the .ichat files, instead of beside the .ichat files.\n");
+        printf("   -threads <number>: Optional in \"convert\" mode. How many threads to convert with, whether that means several files at once with \"-input-dir\" or parts of one big file at once; by default, one per processor core.\n");
         printf(" Options:\n");
         printf("   --follow-links: When browsing, follow UID links to the objects they reference.\n");
         printf("   --overwrite: When converting, overwrite any existing file with the same name.\n");
         printf("   --real-names: When converting, use the \"real\" names that were attached to participants' accounts in iChat instead of the chat service account IDs.\n");
         printf("   --trim-email-ids: When converting, an account ID such as 'john@doe.com' is written as 'john'.\n");
+        printf("   --stats: When converting, print statistics about the conversion when it's done.\n");
+        printf("   --pipeline: When converting with \"-input-dir\", read, decode, convert and write files at the same time on a thread each, instead of converting one file per thread. Best for slow disks and network drives.\n");
+        printf("   --max-inflight-bytes <number>: With \"--pipeline\", the most memory in bytes to spend on files that are between stages; by default, 256 MB.\n");
+        printf("   --tz <zone>: The time zone to write message times in, as named in the zoneinfo database (e.g. \"America/New_York\" or \"UTC\") or as the full path to a zone file, following its changes to and from daylight saving time; by default, a fixed UTC-5.\n");
         return false;
     }
     
@@ -141,6 +232,34 @@ bool ProcessArguments(int argc, const char *argv[])
             else
                 break;
         }
+        else if (!strcmp(argv[a], "-input-dir"))
+        {
+            if (a + 1 < argc)
+                asprintf(&gInDirPath, "%s", argv[++a]); // freed on program quit
+            else
+                break;
+        }
+        else if (!strcmp(argv[a], "-output-dir"))
+        {
+            if (a + 1 < argc)
+                asprintf(&gOutDirPath, "%s", argv[++a]); // freed on program quit
+            else
+                break;
+        }
+        else if (!strcmp(argv[a], "-threads"))
+        {
+            if (a + 1 < argc)
+            {
+                gNumThreads = atoi(argv[++a]);
+                if (gNumThreads < 1)
+                {
+                    printf("Fatal error: You need to supply a number of at least 1 after the -threads argument.\n");
+                    error = true;
+                }
+            }
+            else
+                break;
+        }
         else if (!strcmp(argv[a], "-format"))
         {
             if (a + 1 < argc)
@@ -156,6 +275,31 @@ bool ProcessArguments(int argc, const char *argv[])
             gUseRealNames = true;
         else if (!strcmp(argv[a], "--trim-email-ids"))
             gTrimEmailIDs = true;
+        else if (!strcmp(argv[a], "--stats"))
+            gPrintStats = true;
+        else if (!strcmp(argv[a], "--pipeline"))
+            gPipeline = true;
+        else if (!strcmp(argv[a], "--tz"))
+        {
+            if (a + 1 < argc)
+                asprintf(&gTimeZoneName, "%s", argv[++a]); // freed on program quit
+            else
+                break;
+        }
+        else if (!strcmp(argv[a], "--max-inflight-bytes"))
+        {
+            if (a + 1 < argc)
+            {
+                gMaxInflightBytes = strtoull(argv[++a], NULL, 10);
+                if (gMaxInflightBytes == 0)
+                {
+                    printf("Fatal error: You need to supply a number of bytes of at least 1 after the --max-inflight-bytes argument.\n");
+                    error = true;
+                }
+            }
+            else
+                break;
+        }
     }
     
     // Review arguments received, save parameters, and look for problems
@@ -171,11 +315,41 @@ bool ProcessArguments(int argc, const char *argv[])
             error = true;
         }
     }
-    if (!error && gInFilePath == NULL)
+    if (!error && gInFilePath == NULL && gInDirPath == NULL)
     {
         printf("Fatal error: You need to supply the full path to the .ichat file or other bplist after the -input argument.\n");
         error = true;
     }
+    if (!error && gInFilePath != NULL && gInDirPath != NULL)
+    {
+        printf("Fatal error: You supplied both the -input and the -input-dir arguments, but only one of them can be used at a time.\n");
+        error = true;
+    }
+    if (!error && gInDirPath != NULL && gMode != kModeConvert)
+    {
+        printf("Fatal error: The -input-dir argument can only be used in \"convert\" mode.\n");
+        error = true;
+    }
+    if (!error && gInDirPath == NULL && gOutDirPath != NULL)
+    {
+        printf("Fatal error: The -output-dir argument can only be used along with the -input-dir argument.\n");
+        error = true;
+    }
+    if (!error && gInDirPath == NULL && gPipeline)
+    {
+        printf("Fatal error: The --pipeline argument can only be used along with the -input-dir argument.\n");
+        error = true;
+    }
+    if (!error && !gPipeline && gMaxInflightBytes != 0)
+    {
+        printf("Fatal error: The --max-inflight-bytes argument can only be used along with the --pipeline argument.\n");
+        error = true;
+    }
+    if (!error && gMode != kModeConvert && gNumThreads != 0)
+    {
+        printf("Fatal error: The -threads argument can only be used in \"convert\" mode.\n");
+        error = true;
+    }
     if (!error && gMode == kModeBrowse && format != NULL)
     {
         printf("Fatal error: You supplied the -format argument which is meant for conversion mode, but you asked for \"browse\" mode instead of \"convert\" mode.\n");
@@ -233,7 +407,7 @@ void BrowseMenu_bplist(void)
 
 // Allow "smart" browsing where messages are printed intelligently or troubleshooting mode where objects are printed through
 // bplistReader
-void BrowseMenu_ichat(void)
+void BrowseMenu_ichat(ICContext *ic)
 {
     int inputted = 0;
     fflush(stdin);
@@ -248,9 +422,9 @@ void BrowseMenu_ichat(void)
             inputted = sscanf(input, "%llu", &inputNum);
         
         if (inputNum == 1)
-            Browse_ichatMessages();
+            Browse_ichatMessages(ic);
         else if (inputNum == 2)
-            Browse_ichatObjects();
+            Browse_ichatObjects(ic);
         else
         {
             printf("All right, maybe next time!\n");